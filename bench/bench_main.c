@@ -0,0 +1,443 @@
+/* * Pool32 - Multi-threaded pools
+ * Copyright (C) 2023, 2023 Murilo Augusto <murilo@bad1337.com>
+ *
+ * This file is part of Pool32.
+ *
+ * Pool32 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pool32 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../src/include/pool.h"
+#include "../src/include/chacha20.h"
+
+/* One operation in BENCH_SAMPLE is timed on its own for the
+ * latency percentiles; the others only count for throughput. */
+#define BENCH_SAMPLE    64
+#define BENCH_MAX_SIZES 16
+
+#define BENCH_GET       0
+#define BENCH_INSERT    1
+#define BENCH_INSERT_AT 2
+#define BENCH_SWITCH    3
+#define BENCH_REFILL    4
+#define BENCH_QUEUE     5
+#define BENCH_KINDS     6
+
+static const char *bench_names[BENCH_KINDS] = {
+    "get", "insert", "insert_at", "switch", "refill", "queue"
+};
+
+typedef struct _bench_config {
+    uint32_t sizes[BENCH_MAX_SIZES];
+    uint32_t nsizes;
+    uint32_t nblocks;
+    uint32_t max_it;
+    uint32_t threads;
+    uint64_t ops;
+    bool pinned;
+    pool_options_t opts;
+} bench_config_t;
+
+typedef struct _bench_worker {
+    pthread_t thread;
+    pool_t *pool;
+    pool_queue_t *queue;
+    pthread_barrier_t *start;
+    int kind;
+    uint32_t cpu;
+    bool pinned;
+    uint64_t ops;
+    uint64_t elapsed;
+    uint64_t *samples;
+    uint64_t nsamples;
+    uint32_t sink;
+} bench_worker_t;
+
+static const char *policy_names[] = { "count", "time", "adaptive" };
+
+static const char *perf_names[POOL_PERF_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "l1d_misses", "branch_misses", "task_clock_ns"
+};
+
+/* Cost of one clock read, subtracted from every sample. */
+static uint64_t clock_overhead;
+
+/* Which perf counters this process can open. */
+static bool perf_available[POOL_PERF_COUNTERS];
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_calibrate(void)
+{
+    clock_overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = bench_now();
+        uint64_t t1 = bench_now();
+
+        if (t1 - t0 < clock_overhead) {
+            clock_overhead = t1 - t0;
+        }
+    }
+}
+
+static void bench_probe_perf(void)
+{
+    pool_perf_t perf;
+
+    pool_perf_open(&perf);
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        perf_available[i] = (perf.fds[i] >= 0);
+    }
+    pool_perf_close(&perf);
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(const uint64_t *sorted, uint64_t n, double q)
+{
+    uint64_t rank;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(q * (double)(n - 1));
+    return sorted[rank];
+}
+
+static inline uint32_t bench_op(bench_worker_t *w, uint64_t i)
+{
+    switch (w->kind) {
+    case BENCH_INSERT:
+        pool_insert(w->pool, (uint32_t)i);
+        return 0;
+    case BENCH_INSERT_AT:
+        pool_insert_at(w->pool, (uint32_t)i, (uint32_t)i);
+        return 0;
+    case BENCH_SWITCH:
+        return (uint32_t)pool_switch_block_s(w->pool);
+    case BENCH_QUEUE:
+        pool_queue_enqueue(w->queue, (uint32_t)i);
+        return pool_queue_dequeue(w->queue);
+    default:
+        return pool_get(w->pool, (uint32_t)i);
+    }
+}
+
+static void *bench_worker(void *args)
+{
+    bench_worker_t *w = (bench_worker_t*)args;
+    pool_perf_t perf;
+    uint64_t start;
+
+    if (w->pinned) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    pool_perf_open(&perf);
+    pthread_barrier_wait(w->start);
+    start = bench_now();
+    pool_perf_begin(&perf);
+
+    for (uint64_t i = 0; i < w->ops; i++) {
+        if (i % BENCH_SAMPLE == 0) {
+            uint64_t t0 = bench_now();
+
+            w->sink += bench_op(w, i);
+            uint64_t t = bench_now() - t0;
+            w->samples[w->nsamples++] = (t > clock_overhead) ? t - clock_overhead : 0;
+        } else {
+            w->sink += bench_op(w, i);
+        }
+    }
+
+    pool_perf_end(&perf, w->pool, w->ops);
+    w->elapsed = bench_now() - start;
+    pool_perf_close(&perf);
+    return NULL;
+}
+
+/**
+ * @brief Run `kind` on a fresh pool of `size` elements with
+ * `nthreads` threads and print one JSON result object.
+ * Refill runs use a ChaCha20 producer pool fed by a single
+ * service worker, so readers overlap with refills. Queue runs
+ * use the pool as a `pool_queue_t`: one operation is an enqueue
+ * followed by a dequeue.
+ */
+static void bench_run(const bench_config_t *cfg, int kind, uint32_t size, uint32_t nthreads, bool first)
+{
+    bench_worker_t *workers = calloc(nthreads, sizeof(*workers));
+    uint64_t per_thread = cfg->ops / nthreads;
+    uint64_t nsamples = 0, elapsed = 0, total = 0;
+    uint64_t *samples;
+    pool_service_t *service = NULL;
+    pool_queue_t *queue = NULL;
+    pthread_barrier_t start;
+    pool_stats_t stats;
+    chacha20_t chacha;
+    pool_t *pool;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (workers == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    if (kind == BENCH_REFILL) {
+        static const uint8_t key[32] = { 0 };
+        static const uint8_t nonce[12] = { 0 };
+
+        chacha20_init(&chacha, key, nonce, 0);
+        service = create_pool_service(1, cfg->nblocks * 2);
+        pool = create_pool_producer_opts(size, cfg->nblocks, cfg->max_it, &cfg->opts,
+                                         service, &chacha20_producer, &chacha);
+    } else {
+        pool = create_pool_opts(size, cfg->nblocks, cfg->max_it, &cfg->opts);
+    }
+
+    if (pool == NULL) {
+        fprintf(stderr, "invalid pool: size %u, %u blocks, %s policy\n", size, cfg->nblocks,
+                policy_names[cfg->opts.policy]);
+        exit(1);
+    }
+    if (kind == BENCH_QUEUE) {
+        queue = create_pool_queue(pool);
+    }
+
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (uint32_t i = 0; i < nthreads; i++) {
+        workers[i].pool = pool;
+        workers[i].queue = queue;
+        workers[i].start = &start;
+        workers[i].kind = kind;
+        workers[i].cpu = (uint32_t)(i % (uint32_t)ncpu);
+        workers[i].pinned = cfg->pinned;
+        workers[i].ops = per_thread;
+        workers[i].samples = malloc((per_thread / BENCH_SAMPLE + 1) * sizeof(uint64_t));
+        if (workers[i].samples == NULL) {
+            perror("Cannot allocate memory!");
+            exit(1);
+        }
+        if (pthread_create(&workers[i].thread, NULL, &bench_worker, &workers[i])) {
+            perror("Cannot create thread");
+            exit(2);
+        }
+    }
+
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        nsamples += workers[i].nsamples;
+        total += workers[i].ops;
+        if (workers[i].elapsed > elapsed) {
+            elapsed = workers[i].elapsed;
+        }
+    }
+    pthread_barrier_destroy(&start);
+
+    samples = malloc((nsamples + 1) * sizeof(uint64_t));
+    if (samples == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+    nsamples = 0;
+    for (uint32_t i = 0; i < nthreads; i++) {
+        memcpy(samples + nsamples, workers[i].samples, workers[i].nsamples * sizeof(uint64_t));
+        nsamples += workers[i].nsamples;
+        free(workers[i].samples);
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), &bench_compare);
+
+    if (service != NULL) {
+        destroy_pool_service(service);
+    }
+    pool_stats_snapshot(pool, &stats);
+
+    printf("%s    {\"bench\": \"%s\", \"size\": %u, \"threads\": %u, \"ops\": %llu, "
+           "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+           "\"switches\": %llu, \"switch_pending\": %llu, \"exhausted_reads\": %llu, "
+           "\"switch_p50_ns\": %llu, \"switch_p99_ns\": %llu, \"switch_p999_ns\": %llu, "
+           "\"refills\": %llu, \"refill_p50_ns\": %llu, \"refill_p99_ns\": %llu, \"refill_p999_ns\": %llu",
+           first ? "" : ",\n", bench_names[kind], size, nthreads, (unsigned long long)total,
+           elapsed ? (double)total * 1e9 / (double)elapsed : 0.0,
+           (unsigned long long)bench_percentile(samples, nsamples, 0.50),
+           (unsigned long long)bench_percentile(samples, nsamples, 0.99),
+           (unsigned long long)bench_percentile(samples, nsamples, 0.999),
+           (unsigned long long)stats.counts[POOL_STAT_SWITCHES],
+           (unsigned long long)stats.counts[POOL_STAT_SWITCH_PENDING],
+           (unsigned long long)stats.counts[POOL_STAT_EXHAUSTED_READS],
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.50),
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.99),
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.999),
+           (unsigned long long)stats.counts[POOL_STAT_REFILLS],
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_REFILL, 0.50),
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_REFILL, 0.99),
+           (unsigned long long)pool_stats_percentile(&stats, POOL_HIST_REFILL, 0.999));
+
+    /* Per-operation counter costs, null when the counter is not
+     * available on this machine. */
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        if (perf_available[i] && stats.counts[POOL_STAT_PERF_OPS] != 0) {
+            printf(", \"%s_per_op\": %.3f", perf_names[i],
+                   (double)stats.counts[POOL_STAT_CYCLES + i] / (double)stats.counts[POOL_STAT_PERF_OPS]);
+        } else {
+            printf(", \"%s_per_op\": null", perf_names[i]);
+        }
+    }
+    printf("}");
+    fflush(stdout);
+
+    destroy_pool_queue(queue);
+    destroy_pool(pool);
+    free(samples);
+    free(workers);
+}
+
+static void bench_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-s size[,size...]] [-b blocks] [-m max_it] [-n ops] [-p]\n"
+            "          [-P count|time|adaptive] [-a max_age_ns]\n"
+            "  -t  run every benchmark with 1, 2, 4, ... up to `threads` threads\n"
+            "  -s  pool sizes, in uint32_t elements\n"
+            "  -b  blocks per pool\n"
+            "  -m  reads on the main block before it is switched\n"
+            "  -n  operations per run, split between the threads\n"
+            "  -p  pin thread i to cpu i\n"
+            "  -P  switch policy\n"
+            "  -a  block age of the time policy\n", name);
+}
+
+static void bench_parse_sizes(bench_config_t *cfg, char *list)
+{
+    cfg->nsizes = 0;
+    for (char *tok = strtok(list, ","); tok != NULL && cfg->nsizes < BENCH_MAX_SIZES;
+         tok = strtok(NULL, ",")) {
+        cfg->sizes[cfg->nsizes++] = (uint32_t)strtoul(tok, NULL, 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_config_t cfg = {
+        .sizes = { POOL_SIZE, 4096, 65536 },
+        .nsizes = 3,
+        .nblocks = POOL_BLOCKS,
+        .max_it = POOL_MAX_IT,
+        .threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN),
+        .ops = 1000000,
+        .pinned = false,
+    };
+    bool first = true;
+    int opt;
+
+    pool_options_init(&cfg.opts);
+    cfg.opts.max_age = 1000 * 1000;
+
+    while ((opt = getopt(argc, argv, "t:s:b:m:n:pP:a:h")) != -1) {
+        switch (opt) {
+        case 't':
+            cfg.threads = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            bench_parse_sizes(&cfg, optarg);
+            break;
+        case 'b':
+            cfg.nblocks = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            cfg.max_it = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg.ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            cfg.pinned = true;
+            break;
+        case 'P':
+            cfg.opts.policy = -1;
+            for (int i = 0; i < 3; i++) {
+                if (strcmp(optarg, policy_names[i]) == 0) {
+                    cfg.opts.policy = i;
+                }
+            }
+            if (cfg.opts.policy < 0) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            cfg.opts.max_age = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            bench_usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (cfg.threads == 0 || cfg.nsizes == 0 || cfg.ops < cfg.threads) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    bench_calibrate();
+    bench_probe_perf();
+
+    printf("{\n  \"config\": {\"blocks\": %u, \"max_it\": %u, \"ops\": %llu, \"threads\": %u, "
+           "\"pinned\": %s, \"policy\": \"%s\", \"max_age_ns\": %llu, \"clock_overhead_ns\": %llu},\n"
+           "  \"results\": [\n",
+           cfg.nblocks, cfg.max_it, (unsigned long long)cfg.ops, cfg.threads,
+           cfg.pinned ? "true" : "false", policy_names[cfg.opts.policy],
+           (unsigned long long)cfg.opts.max_age, (unsigned long long)clock_overhead);
+
+    for (uint32_t s = 0; s < cfg.nsizes; s++) {
+        for (int kind = 0; kind < BENCH_KINDS; kind++) {
+            /* 1, 2, 4, ... threads, always ending with `threads`. */
+            for (uint32_t t = 1; t <= cfg.threads; t = (t < cfg.threads && t * 2 > cfg.threads) ? cfg.threads : t * 2) {
+                bench_run(&cfg, kind, cfg.sizes[s], t, first);
+                first = false;
+            }
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
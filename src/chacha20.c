@@ -0,0 +1,377 @@
+/* * Pool32 - Multi-threaded pools
+ * Copyright (C) 2023, 2023 Murilo Augusto <murilo@bad1337.com>
+ *
+ * This file is part of Pool32.
+ *
+ * Pool32 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pool32 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "include/chacha20.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHACHA20_X86 1
+#include <immintrin.h>
+#endif
+
+#define CHACHA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/* Applies one column round and one diagonal round with the
+ * quarter-round macro `QR`, which operates on `v[a]`...`v[d]`. */
+#define CHACHA20_DOUBLE_ROUND(QR) \
+    QR(0, 4,  8, 12); QR(1, 5,  9, 13); QR(2, 6, 10, 14); QR(3, 7, 11, 15); \
+    QR(0, 5, 10, 15); QR(1, 6, 11, 12); QR(2, 7,  8, 13); QR(3, 4,  9, 14)
+
+#define SCALAR_QR(a, b, c, d) \
+    v[a] += v[b]; v[d] ^= v[a]; v[d] = CHACHA20_ROTL(v[d], 16); \
+    v[c] += v[d]; v[b] ^= v[c]; v[b] = CHACHA20_ROTL(v[b], 12); \
+    v[a] += v[b]; v[d] ^= v[a]; v[d] = CHACHA20_ROTL(v[d], 8);  \
+    v[c] += v[d]; v[b] ^= v[c]; v[b] = CHACHA20_ROTL(v[b], 7)
+
+/**
+ * @brief Build the input state of block `counter`.
+ *
+ * @param s destination state.
+ * @param key 256-bit key as words.
+ * @param nonce 96-bit nonce as words.
+ * @param counter 64-bit block counter.
+ */
+static void chacha20_setup(uint32_t s[16], const uint32_t key[8], const uint32_t nonce[3], uint64_t counter)
+{
+    /* "expand 32-byte k" */
+    s[0] = 0x61707865;
+    s[1] = 0x3320646e;
+    s[2] = 0x79622d32;
+    s[3] = 0x6b206574;
+    memcpy(&s[4], key, 8 * sizeof(uint32_t));
+    s[12] = (uint32_t)counter;
+    s[13] = nonce[0] + (uint32_t)(counter >> 32);
+    s[14] = nonce[1];
+    s[15] = nonce[2];
+}
+
+/**
+ * @brief Reference kernel, one block at a time.
+ */
+static void chacha20_scalar(const uint32_t key[8], const uint32_t nonce[3],
+                            uint64_t counter, uint32_t *out, uint32_t nblocks)
+{
+    uint32_t s[16], v[16];
+
+    for (uint32_t b = 0; b < nblocks; b++, counter++, out += CHACHA20_BLOCK_WORDS) {
+        chacha20_setup(s, key, nonce, counter);
+        memcpy(v, s, sizeof(v));
+
+        for (int r = 0; r < 10; r++) {
+            CHACHA20_DOUBLE_ROUND(SCALAR_QR);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            out[i] = v[i] + s[i];
+        }
+    }
+}
+
+#ifdef CHACHA20_X86
+
+/* The vector kernels keep word `i` of `LANES` consecutive blocks in
+ * `v[i]`, one block per lane. A group of lanes shares the high half
+ * of the counter, so a group that would carry into it is handed to
+ * the scalar kernel instead; that keeps every kernel bit-identical. */
+#define CHACHA20_CROSSES_CARRY(counter, lanes) ((uint32_t)(counter) > UINT32_MAX - ((lanes) - 1))
+
+/* Spreads the lane-major `tmp` into `lanes` serialized blocks. */
+#define CHACHA20_SCATTER(out, tmp, lanes) \
+    for (int b = 0; b < (lanes); b++) { \
+        for (int i = 0; i < 16; i++) { \
+            (out)[b * CHACHA20_BLOCK_WORDS + i] = (tmp)[i][b]; \
+        } \
+    }
+
+#define SSE2_ROTL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define SSE2_QR(a, b, c, d) \
+    v[a] = _mm_add_epi32(v[a], v[b]); v[d] = _mm_xor_si128(v[d], v[a]); v[d] = SSE2_ROTL(v[d], 16); \
+    v[c] = _mm_add_epi32(v[c], v[d]); v[b] = _mm_xor_si128(v[b], v[c]); v[b] = SSE2_ROTL(v[b], 12); \
+    v[a] = _mm_add_epi32(v[a], v[b]); v[d] = _mm_xor_si128(v[d], v[a]); v[d] = SSE2_ROTL(v[d], 8);  \
+    v[c] = _mm_add_epi32(v[c], v[d]); v[b] = _mm_xor_si128(v[b], v[c]); v[b] = SSE2_ROTL(v[b], 7)
+
+/**
+ * @brief SSE2 kernel, four blocks per iteration.
+ */
+__attribute__((target("sse2")))
+static void chacha20_sse2(const uint32_t key[8], const uint32_t nonce[3],
+                          uint64_t counter, uint32_t *out, uint32_t nblocks)
+{
+    uint32_t s[16];
+    uint32_t tmp[16][4] __attribute__((aligned(16)));
+    __m128i x[16], v[16];
+
+    for (; nblocks >= 4; nblocks -= 4, counter += 4, out += 4 * CHACHA20_BLOCK_WORDS) {
+        if (CHACHA20_CROSSES_CARRY(counter, 4)) {
+            chacha20_scalar(key, nonce, counter, out, 4);
+            continue;
+        }
+
+        chacha20_setup(s, key, nonce, counter);
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm_set1_epi32((int)s[i]);
+        }
+        x[12] = _mm_add_epi32(x[12], _mm_setr_epi32(0, 1, 2, 3));
+        memcpy(v, x, sizeof(v));
+
+        for (int r = 0; r < 10; r++) {
+            CHACHA20_DOUBLE_ROUND(SSE2_QR);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            _mm_store_si128((__m128i*)tmp[i], _mm_add_epi32(v[i], x[i]));
+        }
+        CHACHA20_SCATTER(out, tmp, 4);
+    }
+
+    chacha20_scalar(key, nonce, counter, out, nblocks);
+}
+
+#define AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define AVX2_QR(a, b, c, d) \
+    v[a] = _mm256_add_epi32(v[a], v[b]); v[d] = _mm256_xor_si256(v[d], v[a]); v[d] = _mm256_shuffle_epi8(v[d], rot16); \
+    v[c] = _mm256_add_epi32(v[c], v[d]); v[b] = _mm256_xor_si256(v[b], v[c]); v[b] = AVX2_ROTL(v[b], 12); \
+    v[a] = _mm256_add_epi32(v[a], v[b]); v[d] = _mm256_xor_si256(v[d], v[a]); v[d] = _mm256_shuffle_epi8(v[d], rot8); \
+    v[c] = _mm256_add_epi32(v[c], v[d]); v[b] = _mm256_xor_si256(v[b], v[c]); v[b] = AVX2_ROTL(v[b], 7)
+
+/**
+ * @brief AVX2 kernel, eight blocks per iteration. The byte-aligned
+ * rotations are done with a single shuffle.
+ */
+__attribute__((target("avx2")))
+static void chacha20_avx2(const uint32_t key[8], const uint32_t nonce[3],
+                          uint64_t counter, uint32_t *out, uint32_t nblocks)
+{
+    uint32_t s[16];
+    uint32_t tmp[16][8] __attribute__((aligned(32)));
+    __m256i x[16], v[16];
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+    for (; nblocks >= 8; nblocks -= 8, counter += 8, out += 8 * CHACHA20_BLOCK_WORDS) {
+        if (CHACHA20_CROSSES_CARRY(counter, 8)) {
+            chacha20_scalar(key, nonce, counter, out, 8);
+            continue;
+        }
+
+        chacha20_setup(s, key, nonce, counter);
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm256_set1_epi32((int)s[i]);
+        }
+        x[12] = _mm256_add_epi32(x[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        memcpy(v, x, sizeof(v));
+
+        for (int r = 0; r < 10; r++) {
+            CHACHA20_DOUBLE_ROUND(AVX2_QR);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            _mm256_store_si256((__m256i*)tmp[i], _mm256_add_epi32(v[i], x[i]));
+        }
+        CHACHA20_SCATTER(out, tmp, 8);
+    }
+
+    chacha20_sse2(key, nonce, counter, out, nblocks);
+}
+
+#define AVX512_QR(a, b, c, d) \
+    v[a] = _mm512_add_epi32(v[a], v[b]); v[d] = _mm512_xor_si512(v[d], v[a]); v[d] = _mm512_rol_epi32(v[d], 16); \
+    v[c] = _mm512_add_epi32(v[c], v[d]); v[b] = _mm512_xor_si512(v[b], v[c]); v[b] = _mm512_rol_epi32(v[b], 12); \
+    v[a] = _mm512_add_epi32(v[a], v[b]); v[d] = _mm512_xor_si512(v[d], v[a]); v[d] = _mm512_rol_epi32(v[d], 8);  \
+    v[c] = _mm512_add_epi32(v[c], v[d]); v[b] = _mm512_xor_si512(v[b], v[c]); v[b] = _mm512_rol_epi32(v[b], 7)
+
+/**
+ * @brief AVX-512 kernel, sixteen blocks per iteration using the
+ * native vector rotate.
+ */
+__attribute__((target("avx512f")))
+static void chacha20_avx512(const uint32_t key[8], const uint32_t nonce[3],
+                            uint64_t counter, uint32_t *out, uint32_t nblocks)
+{
+    uint32_t s[16];
+    uint32_t tmp[16][16] __attribute__((aligned(64)));
+    __m512i x[16], v[16];
+
+    for (; nblocks >= 16; nblocks -= 16, counter += 16, out += 16 * CHACHA20_BLOCK_WORDS) {
+        if (CHACHA20_CROSSES_CARRY(counter, 16)) {
+            chacha20_scalar(key, nonce, counter, out, 16);
+            continue;
+        }
+
+        chacha20_setup(s, key, nonce, counter);
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm512_set1_epi32((int)s[i]);
+        }
+        x[12] = _mm512_add_epi32(x[12], _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                                          8, 9, 10, 11, 12, 13, 14, 15));
+        memcpy(v, x, sizeof(v));
+
+        for (int r = 0; r < 10; r++) {
+            CHACHA20_DOUBLE_ROUND(AVX512_QR);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            _mm512_store_si512((void*)tmp[i], _mm512_add_epi32(v[i], x[i]));
+        }
+        CHACHA20_SCATTER(out, tmp, 16);
+    }
+
+    chacha20_sse2(key, nonce, counter, out, nblocks);
+}
+
+#endif /* CHACHA20_X86 */
+
+/**
+ * @brief Check whether `kernel` can run on this CPU.
+ *
+ * @param kernel one of the CHACHA20_* kernels.
+ * @return int 1 when supported, 0 otherwise.
+ */
+int chacha20_kernel_supported(int kernel)
+{
+    switch (kernel) {
+    case CHACHA20_SCALAR:
+        return 1;
+#ifdef CHACHA20_X86
+    case CHACHA20_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2") ? 1 : 0;
+    case CHACHA20_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? 1 : 0;
+    case CHACHA20_AVX512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f") ? 1 : 0;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Select the kernel used by `ctx`.
+ *
+ * @param *ctx instance.
+ * @param kernel one of the CHACHA20_* kernels.
+ * @return int 0 on success, -1 when the CPU does not support `kernel`.
+ */
+int chacha20_set_kernel(chacha20_t *ctx, int kernel)
+{
+    if (kernel == CHACHA20_AUTO) {
+        for (kernel = CHACHA20_AVX512; kernel > CHACHA20_SCALAR; kernel--) {
+            if (chacha20_kernel_supported(kernel)) {
+                break;
+            }
+        }
+    }
+
+    if (!chacha20_kernel_supported(kernel)) {
+        return -1;
+    }
+
+    switch (kernel) {
+#ifdef CHACHA20_X86
+    case CHACHA20_SSE2:
+        ctx->generate = &chacha20_sse2;
+        break;
+    case CHACHA20_AVX2:
+        ctx->generate = &chacha20_avx2;
+        break;
+    case CHACHA20_AVX512:
+        ctx->generate = &chacha20_avx512;
+        break;
+#endif
+    default:
+        ctx->generate = &chacha20_scalar;
+        break;
+    }
+    ctx->kernel = kernel;
+
+    return 0;
+}
+
+/**
+ * @brief Initialize a ChaCha20 keystream (RFC 8439 layout).
+ * The 32-bit block counter carries into the first nonce word,
+ * so a stream does not repeat for 2^64 blocks. The fastest
+ * kernel supported by the CPU is selected.
+ *
+ * @param *ctx instance.
+ * @param key 256-bit key.
+ * @param nonce 96-bit nonce.
+ * @param counter initial block counter.
+ */
+void chacha20_init(chacha20_t *ctx, const uint8_t key[32], const uint8_t nonce[12], uint32_t counter)
+{
+    for (int i = 0; i < 8; i++) {
+        ctx->key[i] = (uint32_t)key[4 * i] | (uint32_t)key[4 * i + 1] << 8 |
+                      (uint32_t)key[4 * i + 2] << 16 | (uint32_t)key[4 * i + 3] << 24;
+    }
+    for (int i = 0; i < 3; i++) {
+        ctx->nonce[i] = (uint32_t)nonce[4 * i] | (uint32_t)nonce[4 * i + 1] << 8 |
+                        (uint32_t)nonce[4 * i + 2] << 16 | (uint32_t)nonce[4 * i + 3] << 24;
+    }
+    atomic_init(&ctx->counter, counter);
+    chacha20_set_kernel(ctx, CHACHA20_AUTO);
+}
+
+/**
+ * @brief Write the next `len` keystream words to `out`.
+ * This function is thread-safe: every call reserves its own
+ * range of blocks. A trailing partial block is truncated and
+ * the rest of its words are discarded.
+ *
+ * @param *ctx instance.
+ * @param *out destination.
+ * @param len number of words.
+ */
+void chacha20_keystream(chacha20_t *ctx, uint32_t *out, uint32_t len)
+{
+    uint32_t full = len / CHACHA20_BLOCK_WORDS;
+    uint32_t rest = len % CHACHA20_BLOCK_WORDS;
+    uint64_t counter = atomic_fetch_add_explicit(&ctx->counter, full + (rest != 0),
+                                                 memory_order_relaxed);
+
+    ctx->generate(ctx->key, ctx->nonce, counter, out, full);
+
+    if (rest != 0) {
+        uint32_t last[CHACHA20_BLOCK_WORDS];
+
+        chacha20_scalar(ctx->key, ctx->nonce, counter + full, last, 1);
+        memcpy(out + full * CHACHA20_BLOCK_WORDS, last, rest * sizeof(uint32_t));
+    }
+}
+
+/**
+ * @brief Block producer filling a pool block with keystream.
+ * Pass it to `create_pool_producer` with a `chacha20_t` as
+ * argument.
+ *
+ * @param *data block storage.
+ * @param len number of elements.
+ * @param *arg chacha20_t instance.
+ */
+void chacha20_producer(uint32_t *data, uint32_t len, void *arg)
+{
+    chacha20_keystream((chacha20_t*)arg, data, len);
+}
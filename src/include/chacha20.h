@@ -0,0 +1,103 @@
+/* * Pool32 - Multi-threaded pools
+ * Copyright (C) 2023, 2023 Murilo Augusto <murilo@bad1337.com>
+ *
+ * This file is part of Pool32.
+ *
+ * Pool32 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pool32 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHACHA20_H
+#define CHACHA20_H
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Keystream kernels. Every kernel produces exactly the same words,
+ * CHACHA20_SCALAR is the reference used to validate the others. */
+#define CHACHA20_AUTO       0
+#define CHACHA20_SCALAR     1
+#define CHACHA20_SSE2       2
+#define CHACHA20_AVX2       3
+#define CHACHA20_AVX512     4
+
+/* Words of keystream in one ChaCha20 block. */
+#define CHACHA20_BLOCK_WORDS 16
+
+/* Writes `nblocks` consecutive keystream blocks starting at block
+ * `counter` to `out`. */
+typedef void (*chacha20_kernel_fn)(const uint32_t key[8], const uint32_t nonce[3],
+                                   uint64_t counter, uint32_t *out, uint32_t nblocks);
+
+typedef struct _chacha20 {
+    uint32_t key[8];
+    uint32_t nonce[3];
+    _Atomic uint64_t counter;
+    int kernel;
+    chacha20_kernel_fn generate;
+} chacha20_t;
+
+/**
+ * @brief Initialize a ChaCha20 keystream (RFC 8439 layout).
+ * The 32-bit block counter carries into the first nonce word,
+ * so a stream does not repeat for 2^64 blocks. The fastest
+ * kernel supported by the CPU is selected.
+ *
+ * @param *ctx instance.
+ * @param key 256-bit key.
+ * @param nonce 96-bit nonce.
+ * @param counter initial block counter.
+ */
+void chacha20_init(chacha20_t *ctx, const uint8_t key[32], const uint8_t nonce[12], uint32_t counter);
+
+/**
+ * @brief Select the kernel used by `ctx`.
+ *
+ * @param *ctx instance.
+ * @param kernel one of the CHACHA20_* kernels.
+ * @return int 0 on success, -1 when the CPU does not support `kernel`.
+ */
+int chacha20_set_kernel(chacha20_t *ctx, int kernel);
+
+/**
+ * @brief Check whether `kernel` can run on this CPU.
+ *
+ * @param kernel one of the CHACHA20_* kernels.
+ * @return int 1 when supported, 0 otherwise.
+ */
+int chacha20_kernel_supported(int kernel);
+
+/**
+ * @brief Write the next `len` keystream words to `out`.
+ * This function is thread-safe: every call reserves its own
+ * range of blocks. A trailing partial block is truncated and
+ * the rest of its words are discarded.
+ *
+ * @param *ctx instance.
+ * @param *out destination.
+ * @param len number of words.
+ */
+void chacha20_keystream(chacha20_t *ctx, uint32_t *out, uint32_t len);
+
+/**
+ * @brief Block producer filling a pool block with keystream.
+ * Pass it to `create_pool_producer` with a `chacha20_t` as
+ * argument.
+ *
+ * @param *data block storage.
+ * @param len number of elements.
+ * @param *arg chacha20_t instance.
+ */
+void chacha20_producer(uint32_t *data, uint32_t len, void *arg);
+
+
+#endif /* CHACHA20_H */
@@ -20,24 +20,422 @@
 #ifndef POOL_H
 #define POOL_H
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 
+/* Defaults used by `create_pool`. Pools created with `create_pool_ex`
+ * carry their own geometry in `size`, `nblocks`, `block_size` and
+ * `max_it` and must not be addressed with these constants. */
 #define POOL_SIZE       200
+#define POOL_BLOCKS     2
 #define POOL_BLOCK_A    0
 #define POOL_BLOCK_B    (POOL_SIZE/2)
 #define POOL_BLOCK_SIZE POOL_BLOCK_B
 #define POOL_MAX_IT     50
 
+/* Switch policies, see `pool_options_t`. */
+#define POOL_POLICY_COUNT       0   /* switch after `max_it` reads */
+#define POOL_POLICY_TIME        1   /* switch once the main block is `max_age` ns old */
+#define POOL_POLICY_ADAPTIVE    2   /* switch when the next refill is due to finish */
 
+/* The time policy reads the clock once every POOL_TIME_STRIDE reads. */
+#define POOL_TIME_STRIDE        64
+
+/* The adaptive threshold stays between `max_it / POOL_ADAPTIVE_RANGE`
+ * and `max_it * POOL_ADAPTIVE_RANGE` reads. */
+#define POOL_ADAPTIVE_RANGE     64
+
+/* Events signaled on the eventfds of `pool_event_fd`. */
+#define POOL_EVENT_PUBLISH      0   /* a refilled block was published */
+#define POOL_EVENT_LOW_WATER    1   /* the main block reached its low watermark */
+#define POOL_EVENTS             2
+
+/* Object pools, see `create_pool_objects`. Objects are aligned on
+ * POOL_OBJECT_ALIGN bytes and move between threads and the depot in
+ * magazines of POOL_MAGAZINE_SIZE objects. */
+#define POOL_OBJECT_ALIGN       16
+#define POOL_MAGAZINE_SIZE      64
+
+/* Largest element of a pool, in bytes, see `create_pool_opts`. */
+#define POOL_ELEM_MAX           256
+
+/* Backing storage of the pool data, see `create_pool_opts`. */
+#define POOL_BACKING_HEAP       0
+#define POOL_BACKING_MMAP       1
+#define POOL_BACKING_HUGETLB    2
+
+#define POOL_HUGE_PAGE  (2UL * 1024 * 1024)
+#define POOL_MAX_NODES  64
+
+/* Header of file-backed pools, see `create_pool_mapped`. */
+#define POOL_FILE_MAGIC     0x46323350  /* "P32F" */
+#define POOL_FILE_VERSION   1
+
+/* Shared-memory pools, see `create_pool_shared`. */
+#define POOL_SHM_MAGIC      0x53323350  /* "P32S" */
+#define POOL_SHM_VERSION    2
+#define POOL_SHM_SLOTS      64
+
+/* Alignment used to keep independently written state apart. */
+#define POOL_CACHELINE  64
+
+/* A shard flushes its reads to the pool every `max_it / POOL_SHARD_FLUSH`
+ * reads, so a switch may come up to that many reads late per shard. */
+#define POOL_SHARD_FLUSH 8
+
+/* Block states. A block is only written while it is FILLING and
+ * readers only ever look at the ACTIVE (main) block. STALE blocks
+ * were already consumed and may be claimed for refill or recycled
+ * by a switch when no READY block is available. */
+#define POOL_STATE_STALE    0
+#define POOL_STATE_READY    1
+#define POOL_STATE_ACTIVE   2
+#define POOL_STATE_FILLING  3
+
+/* Counters of `pool_stats_t`. */
+#define POOL_STAT_GETS              0   /* values read */
+#define POOL_STAT_INSERTS           1   /* values inserted */
+#define POOL_STAT_TAKES             2   /* values consumed by `pool_take_many` */
+#define POOL_STAT_READ_RETRIES      3   /* reads retried after racing a switch */
+#define POOL_STAT_EXHAUSTED_READS   4   /* reads past `max_it` with no block to switch to */
+#define POOL_STAT_SWITCHES          5   /* main block switches */
+#define POOL_STAT_SWITCH_PENDING    6   /* `pool_switch_block_s` calls that returned -1 */
+#define POOL_STAT_SWITCH_RACES      7   /* switch attempts lost to another thread */
+#define POOL_STAT_REFILLS           8   /* blocks published by `pool_refill_end` */
+#define POOL_STAT_REFILL_MISSES     9   /* `pool_refill_begin` calls that found no block */
+#define POOL_STAT_PERF_OPS          10  /* operations measured with `pool_perf_end` */
+#define POOL_STAT_CYCLES            11  /* POOL_PERF_* counters, in the same order */
+#define POOL_STAT_INSTRUCTIONS      12
+#define POOL_STAT_CACHE_MISSES      13
+#define POOL_STAT_L1D_MISSES        14
+#define POOL_STAT_BRANCH_MISSES     15
+#define POOL_STAT_TASK_CLOCK        16
+#define POOL_STAT_COUNT             17
+
+/* Counters of a pool group, see `pool_group_stats`. */
+#define POOL_GROUP_STAT_STEALS      0   /* batches stolen from a sibling */
+#define POOL_GROUP_STAT_STOLEN      1   /* values stolen */
+#define POOL_GROUP_STAT_MISSES      2   /* steals that found no sibling with a READY block */
+#define POOL_GROUP_STAT_COUNT       3
+
+/* Values a group member steals from a sibling at once. */
+#define POOL_GROUP_BATCH            32
+
+/* I/O engines of a stream, see `create_pool_stream`. */
+#define POOL_STREAM_AUTO    0   /* io_uring, or pread when it is unavailable */
+#define POOL_STREAM_URING   1   /* one thread driving an io_uring */
+#define POOL_STREAM_PREAD   2   /* `depth` threads calling pread */
+
+/* Counters opened by `pool_perf_open`. Each one is added to the
+ * pool statistic POOL_STAT_CYCLES + counter. */
+#define POOL_PERF_CYCLES            0   /* CPU cycles */
+#define POOL_PERF_INSTRUCTIONS      1   /* retired instructions */
+#define POOL_PERF_CACHE_MISSES      2   /* last-level cache misses */
+#define POOL_PERF_L1D_MISSES        3   /* L1 data cache read misses */
+#define POOL_PERF_BRANCH_MISSES     4   /* mispredicted branches */
+#define POOL_PERF_TASK_CLOCK        5   /* thread CPU time in ns, a software counter */
+#define POOL_PERF_COUNTERS          6
+
+/* Counter groups: the hardware counters are scheduled on the PMU
+ * together, the software ones apart from them. */
+#define POOL_PERF_GROUP_HW          0
+#define POOL_PERF_GROUP_SW          1
+#define POOL_PERF_GROUPS            2
+
+/* Each live thread owns one of this many stripes of counters, so
+ * the read path writes its counters with plain stores on a line no
+ * other reader writes. Threads beyond them share one more stripe. */
+#define POOL_STAT_STRIPES   64
+
+/* Latency histograms, in nanoseconds. Buckets are HDR-style: four
+ * linear sub-buckets per power of two, so a bucket is at most 25%
+ * wide, up to 2^36 ns (about 68 s) where values are clamped. */
+#define POOL_HIST_SWITCH    0   /* successful `pool_switch_block_s` calls */
+#define POOL_HIST_REFILL    1   /* `pool_refill_begin` to `pool_refill_end` */
+#define POOL_HISTS          2
+#define POOL_HIST_SUB_BITS  2
+#define POOL_HIST_BUCKETS   140
+
+struct _pool;
+struct _pool_service;
+struct _pool_stream;
+struct _pool_uring;
+
+/* Refill callback run by a service worker on a block it claimed
+ * with `pool_refill_begin`. The block is published afterwards. */
+typedef void (*pool_refill_fn)(struct _pool *pool, uint32_t block, void *arg);
+
+/* Block producer registered with `create_pool_producer`. It writes
+ * `len` fresh elements in place at `data`. */
+typedef void (*pool_producer_fn)(uint32_t *data, uint32_t len, void *arg);
+
+typedef struct _pool_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t nblocks;
+    uint32_t data_offset;
+    uint32_t cursor;
+    _Atomic uint32_t current_block;
+    uint32_t reserved;
+    _Atomic uint64_t generation;
+    _Atomic uint32_t states[];
+} pool_file_header_t;
+
+/* State every user of a pool must agree on, grouped by who writes
+ * it, one group per cache line. Local pools keep it in `pool_t`,
+ * shared-memory pools in their segment. */
+typedef struct _pool_shared {
+    /* Publication, written once per switch or refill. Waiters of
+     * `pool_switch_block_wait` sleep on `published`. */
+    _Alignas(POOL_CACHELINE) _Atomic uint32_t current_block;
+    atomic_uint epoch;
+    atomic_bool switch_pending;
+    atomic_uint published;
+    atomic_uint waiters;
+
+    /* Reads flushed by the shards since the last switch. */
+    _Alignas(POOL_CACHELINE) atomic_uint shard_reads;
+
+    /* Cursor of the consume-once API. */
+    _Alignas(POOL_CACHELINE) _Atomic uint64_t take;
+
+    /* Guards the attacher table of shared-memory pools. */
+    _Alignas(POOL_CACHELINE) pthread_mutex_t lock;
+} pool_shared_t;
+
+/* Start of a shared-memory segment, see `create_pool_shared`. The
+ * block states follow at `states_offset`, one row of pins per
+ * attacher slot at `pins_offset` and the blocks at `data_offset`.
+ * `slots` holds the pid of every attached process, slot 0 being
+ * the owner; it is guarded by `shared.lock`. */
+typedef struct _pool_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t nblocks;
+    uint32_t states_offset;
+    uint32_t pins_offset;
+    uint32_t data_offset;
+    uint32_t produced;
+    pid_t slots[POOL_SHM_SLOTS];
+    pool_shared_t shared;
+} pool_shm_header_t;
+
+/* Process-local metadata comes first and is only written at creation,
+ * so readers of the main block only touch that line and the
+ * publication line of `shared`. */
 typedef struct _pool {
-    uint32_t pool[POOL_SIZE];
-    uint32_t current_block;
+    /* Geometry and callbacks, written at creation only. */
+    uint32_t *pool;
+    uint32_t size;
+    uint32_t nblocks;
+    uint32_t block_size;
+    uint32_t max_it;
+    uint32_t elem_size;
+    uint32_t elem_words;
+    uint32_t block_elems;
+    _Atomic uint32_t *states;
+    atomic_uint *pins;
+    pool_shared_t *shared;
+    struct _pool_stat_stripe *stats;
+    _Atomic uint64_t *latency;
+    _Atomic uint64_t *refill_started;
+    struct _pool_service *service;
+    pool_refill_fn refill;
+    void *refill_arg;
+    pool_producer_fn producer;
+    void *producer_arg;
+    bool recycle;
+    size_t mapping;
+    int numa_node;
+    pool_file_header_t *file;
+    int fd;
+    pool_shm_header_t *shm;
+    char *name;
+    uint32_t slot;
+    atomic_bool watching;
+    pthread_t watcher;
+    struct _pool_stream *stream;
+    int policy;
+    uint64_t max_age;
+    _Atomic int events[POOL_EVENTS];
+    uint32_t low_water;
+
+    /* Switch policy state, written once per switch. `threshold` is
+     * the read count at which readers consult the policy; the costs
+     * are moving averages in ns (`read_cost` with 8 fractional bits). */
+    _Alignas(POOL_CACHELINE) _Atomic uint32_t threshold;
+    _Atomic uint64_t block_started;
+    _Atomic uint64_t read_cost;
+    _Atomic uint64_t refill_cost;
+    atomic_bool low_signaled;
+
+    /* Cursor and counter of the unsharded API. */
+    _Alignas(POOL_CACHELINE) uint32_t cursor;
+    atomic_uint iterations;
+
+    pool_shared_t local;
+} pool_t;
+
+typedef struct _pool_options {
+    int backing;
+    int numa_node;
+    size_t alignment;
+    int policy;
+    uint64_t max_age;
+    uint32_t elem_size;
+} pool_options_t;
+
+typedef struct _pool_replicas {
+    pool_t **pools;
+    uint32_t nnodes;
+} pool_replicas_t;
+
+/* One stripe of hot-path counters, see `pool_stats_snapshot`. */
+typedef struct _pool_stat_stripe {
+    _Alignas(POOL_CACHELINE) _Atomic uint64_t counts[POOL_STAT_COUNT];
+} pool_stat_stripe_t;
+
+typedef struct _pool_stats {
+    uint64_t counts[POOL_STAT_COUNT];
+    uint64_t latency[POOL_HISTS][POOL_HIST_BUCKETS];
+} pool_stats_t;
+
+/* Performance counters of one thread, see `pool_perf_open`. A
+ * counter the kernel or the CPU does not provide has fd -1, a
+ * group without any counter has leader -1. `enabled` and `running`
+ * are the group times at `pool_perf_begin`. */
+typedef struct _pool_perf {
+    int fds[POOL_PERF_COUNTERS];
+    uint64_t ids[POOL_PERF_COUNTERS];
+    uint64_t begin[POOL_PERF_COUNTERS];
+    int leaders[POOL_PERF_GROUPS];
+    uint64_t enabled[POOL_PERF_GROUPS];
+    uint64_t running[POOL_PERF_GROUPS];
+} pool_perf_t;
+
+/* Fixed-size object allocator, see `create_pool_objects`. The
+ * arena is the storage of `pool`. Each depot block is a lock-free
+ * stack of magazines whose head packs a tag (high 32 bits) and
+ * the name of the first object: `depot_a` is the main block,
+ * which allocations drain, `depot_b` the standby block frees go
+ * to. */
+typedef struct _pool_objects {
+    pool_t *pool;
+    uint8_t *arena;
+    size_t obj_size;
+    uint32_t count;
+
+    _Alignas(POOL_CACHELINE) _Atomic uint64_t depot_a;
+    _Alignas(POOL_CACHELINE) _Atomic uint64_t depot_b;
+} pool_objects_t;
+
+/* Per-thread magazines of an object pool, see
+ * `pool_object_cache_register`. A magazine is a chain of free
+ * objects linked through their first bytes. */
+typedef struct _pool_object_cache {
+    _Alignas(POOL_CACHELINE) pool_objects_t *objects;
+    uint8_t *arena;
+    uint32_t alloc_head;
+    uint32_t nalloc;
+    uint32_t free_head;
+    uint32_t nfree;
+} pool_object_cache_t;
+
+/* Bounded MPMC queue over the storage of a pool, see
+ * `create_pool_queue`. Slot `i` holds `pool->pool[i]` and its
+ * sequence number `seqs[i]`. Producers and consumers each own a
+ * cache line with their position and the futex word they sleep
+ * on when the queue is full or empty. */
+typedef struct _pool_queue {
+    pool_t *pool;
+    uint32_t *slots;
+    _Atomic uint32_t *seqs;
+    uint32_t mask;
+
+    _Alignas(POOL_CACHELINE) _Atomic uint32_t tail;
+    atomic_uint not_full;
+    atomic_uint producers_waiting;
+
+    _Alignas(POOL_CACHELINE) _Atomic uint32_t head;
+    atomic_uint not_empty;
+    atomic_uint consumers_waiting;
+} pool_queue_t;
+
+/* Pools whose readers steal from each other, see
+ * `create_pool_group`. The group does not own its pools. */
+typedef struct _pool_group {
+    pool_t **pools;
+    uint32_t npools;
+
+    _Alignas(POOL_CACHELINE) _Atomic uint64_t counts[POOL_GROUP_STAT_COUNT];
+} pool_group_t;
+
+/* Per-thread reader of a group, see `pool_group_join`. */
+typedef struct _pool_group_member {
+    _Alignas(POOL_CACHELINE) pool_group_t *group;
+    uint32_t home;
+    uint32_t victim;
+    uint32_t next;
+    uint32_t nstolen;
+    uint32_t stolen[POOL_GROUP_BATCH];
+} pool_group_member_t;
+
+/* Refill of a pool from a file or device, see `create_pool_stream`.
+ * `offset` is the next byte to read, wrapped at `size`; devices
+ * have no size and are read sequentially. */
+typedef struct _pool_stream {
+    pool_t *pool;
+    int fd;
+    int mode;
+    uint32_t depth;
+    uint64_t size;
+    _Atomic uint64_t offset;
+    atomic_int error;
+    atomic_bool running;
+    pthread_t *threads;
+    uint32_t nthreads;
+    struct _pool_uring *ring;
+} pool_stream_t;
+
+/* Per-thread view of a pool, see `pool_shard_register`. */
+typedef struct _pool_shard {
+    _Alignas(POOL_CACHELINE) pool_t *pool;
     uint32_t cursor;
     uint32_t iterations;
+    uint32_t quota;
+} pool_shard_t;
+
+typedef struct _pool_span {
+    const uint32_t *data;
+    uint32_t length;
+    uint32_t block;
+} pool_span_t;
+
+typedef struct _pool_refill_job {
+    pool_t *pool;
+    pool_refill_fn fn;
+    void *arg;
+} pool_refill_job_t;
+
+typedef struct _pool_service {
+    pthread_t *workers;
+    uint32_t nworkers;
+    pool_refill_job_t *jobs;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    uint32_t busy;
+    bool stopping;
     pthread_mutex_t lock;
-    atomic_bool locked;
-} pool_t;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+} pool_service_t;
 
 /**
  * @brief Create a pool object
@@ -46,6 +444,106 @@ typedef struct _pool {
  */
 pool_t *create_pool(void);
 
+/**
+ * @brief Create a pool object with a runtime geometry.
+ * The storage holds `size` elements split into a ring of
+ * `nblocks` blocks of `size / nblocks` elements each.
+ * `current_block` is always the offset of the main block
+ * inside `pool`, so `POOL_BLOCK_A` is still the first block.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * `size` is not a non-zero multiple of `nblocks`.
+ */
+pool_t *create_pool_ex(uint32_t size, uint32_t nblocks, uint32_t max_it);
+
+/**
+ * @brief Fill `opts` with the defaults: heap storage, no
+ * NUMA binding, default alignment, count switch policy,
+ * uint32_t elements.
+ * 
+ * @param *opts options to initialize.
+ */
+void pool_options_init(pool_options_t *opts);
+
+/**
+ * @brief Create a pool object with a runtime geometry and
+ * explicit backing storage.
+ * See `create_pool_ex` for the geometry. `opts` selects heap,
+ * anonymous mmap or huge-page storage, its alignment and the
+ * NUMA node it is bound to; a NUMA binding always uses mmap.
+ * Binding is best effort: `numa_node` is -1 in the pool when
+ * the kernel refused it.
+ * 
+ * `policy` decides when readers switch the main block:
+ * POOL_POLICY_COUNT after `max_it` reads; POOL_POLICY_TIME on
+ * the first read once the block is `max_age` ns old; and
+ * POOL_POLICY_ADAPTIVE after a read count derived from the
+ * observed read rate and refill latency, so that the refill
+ * queued by one switch completes shortly before the switch
+ * that needs it. The adaptive count starts at `max_it`.
+ * 
+ * `elem_size` is the size of one element in bytes, a multiple
+ * of 4 up to POOL_ELEM_MAX. `size` counts elements of that
+ * size, which the `pool_*_elem` functions address; the uint32_t
+ * functions, refills and producers keep working on the words.
+ * 
+ * @param size total number of elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage and policy options, or NULL for the defaults.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * `size` is not a non-zero multiple of `nblocks`, `alignment`
+ * is not a power of two, the time policy has no `max_age` or
+ * `elem_size` is invalid.
+ */
+pool_t *create_pool_opts(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                         const pool_options_t *opts);
+
+/**
+ * @brief Create a pool object whose blocks are written
+ * by `producer`.
+ * The main block is produced before this function returns
+ * and every other block is queued on `service`. A block is
+ * only eligible for a switch once the producer has run on
+ * it: STALE blocks are never recycled, and a switch that
+ * finds no READY block is left pending until the next one
+ * is published.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *service refill service running the producer.
+ * @param producer block producer.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid or `service` is NULL.
+ */
+pool_t *create_pool_producer(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                             pool_service_t *service, pool_producer_fn producer, void *arg);
+
+/**
+ * @brief Create a producer pool with explicit options.
+ * Same as `create_pool_producer`, with the storage and switch
+ * policy of `create_pool_opts`. Producer pools are where the
+ * adaptive policy pays off: it learns the producer latency.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage and policy options, or NULL for the defaults.
+ * @param *service refill service running the producer.
+ * @param producer block producer.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry or options are invalid or `service` is NULL.
+ */
+pool_t *create_pool_producer_opts(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                                  const pool_options_t *opts, pool_service_t *service,
+                                  pool_producer_fn producer, void *arg);
+
 /**
  * @brief Deallocate and destroy the pool object.
  * 
@@ -85,6 +583,17 @@ void pool_fill_area(pool_t *pool, uint32_t value, uint32_t index, uint32_t offse
  */
 void pool_insert(pool_t *pool, uint32_t value);
 
+/**
+ * @brief Insert `count` values in the pool using its own cursor.
+ * Equivalent to `count` calls to `pool_insert`, wrapping around
+ * the main block, with a single cursor update.
+ * 
+ * @param *pool instance of pool.
+ * @param *values values to be inserted.
+ * @param count number of values.
+ */
+void pool_insert_many(pool_t *pool, const uint32_t *values, uint32_t count);
+
 /**
  * @brief Insert `value` in the pool at `index` position.
  * This function is thread-safe since the index is translated
@@ -97,7 +606,8 @@ void pool_insert(pool_t *pool, uint32_t value);
 void pool_insert_at(pool_t *pool, uint32_t value, uint32_t index);
 
 /**
- * @brief Switches the main block of pool.
+ * @brief Switches the main block of pool to the next
+ * block of the ring.
  * This function is not thread-safe. It is not
  * possible to guarantee that some thread is performing
  * any operation based on the main block.
@@ -111,6 +621,16 @@ void pool_insert_at(pool_t *pool, uint32_t value, uint32_t index);
  */
 int pool_switch_block(pool_t *pool);
 
+/**
+ * @brief Retrieve the offset of the block that follows
+ * `block` in the ring.
+ * 
+ * @param *pool instance. 
+ * @param block offset of a block.
+ * @return uint32_t offset of the next block.
+ */
+uint32_t pool_next_block(pool_t *pool, uint32_t block);
+
 /**
  * @brief Set the pool cursor to `new_cursor`.
  * 
@@ -133,15 +653,881 @@ void pool_set_cursor(pool_t *pool, uint32_t new_cursor);
 uint32_t pool_get(pool_t *pool, uint32_t index);
 
 /**
- * @brief Swtiches the main block of pool.
- * This function is thread-safe. If the current
- * block is using by some thread the operation is
- * aborted and the function returns -1. This function
- * returns 0 when it can successfully switch the block.
+ * @brief Copy `count` consecutive values of the main block,
+ * starting at `index` and wrapping around the block, into `out`.
+ * The whole batch counts as `count` reads but the switch check
+ * is done once, before the copy. Like `pool_get`, the copy is
+ * retried until no switch raced it, so `out` never mixes
+ * values of two blocks.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first value.
+ * @param *out destination buffer.
+ * @param count number of values.
+ */
+void pool_get_many(pool_t *pool, uint32_t index, uint32_t *out, uint32_t count);
+
+/**
+ * @brief Copy the element at `index` of the main block to `out`.
+ * Same as `pool_get` for pools of any `elem_size`: one read,
+ * retried until no switch raced it. Elements of 4, 8, 16
+ * and 64 bytes are copied with fixed-size moves.
+ * 
+ * @param *pool instance. 
+ * @param index element position.
+ * @param *out destination of `elem_size` bytes.
+ */
+void pool_get_elem(pool_t *pool, uint32_t index, void *out);
+
+/**
+ * @brief Copy `count` consecutive elements of the main block,
+ * starting at `index` and wrapping around the block, into `out`.
+ * Same as `pool_get_many` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first element.
+ * @param *out destination of `count * elem_size` bytes.
+ * @param count number of elements.
+ */
+void pool_get_elems(pool_t *pool, uint32_t index, void *out, uint32_t count);
+
+/**
+ * @brief Insert the element at `value` using the pool cursor.
+ * Same as `pool_insert` for pools of any `elem_size`; do not
+ * mix it with the uint32_t insertions, which move the cursor
+ * by one word.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ */
+void pool_insert_elem(pool_t *pool, const void *value);
+
+/**
+ * @brief Insert `count` elements using the pool cursor.
+ * Same as `pool_insert_many` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param *values `count` elements of `elem_size` bytes.
+ * @param count number of elements.
+ */
+void pool_insert_elems(pool_t *pool, const void *values, uint32_t count);
+
+/**
+ * @brief Insert the element at `value` at `index` position.
+ * Same as `pool_insert_at` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ * @param index element position.
+ */
+void pool_insert_elem_at(pool_t *pool, const void *value, uint32_t index);
+
+/**
+ * @brief Fill the entire pool with copies of the element at
+ * `value`. Like `pool_fill`, this function is not thread-safe.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ */
+void pool_fill_elem(pool_t *pool, const void *value);
+
+/**
+ * @brief Swtiches the main block of pool to the next
+ * block of the ring.
+ * This function is thread-safe. The next READY block
+ * is preferred; when there is none, the next STALE block
+ * is recycled, except in producer pools. The main block
+ * is replaced in a single atomic step and `epoch` is
+ * bumped, so readers that raced the switch retry once on
+ * the new block.
+ * 
+ * When no other block is eligible, the switch is
+ * recorded as pending and the function returns -1; the
+ * pending switch is then performed by `pool_refill_end`.
+ * This function returns 0 when the block was switched.
  * 
  * @param *pool instance. 
  */
 int pool_switch_block_s(pool_t *pool);
 
+/**
+ * @brief Switch the main block, waiting for a standby block
+ * when every one of them is being refilled.
+ * The caller is parked on a futex until `pool_refill_end`
+ * publishes a block, instead of polling `pool_switch_block_s`.
+ * The wait ends as soon as the main block differs from the
+ * one seen on entry, whoever switched it.
+ * 
+ * @param *pool instance. 
+ * @return int 0 once the main block was switched.
+ */
+int pool_switch_block_wait(pool_t *pool);
+
+/**
+ * @brief Same as `pool_switch_block_wait`, giving up at
+ * `abstime`.
+ * After a timeout the switch stays pending, as after
+ * `pool_switch_block_s`, and the next publication performs it.
+ * 
+ * @param *pool instance. 
+ * @param *abstime absolute CLOCK_MONOTONIC deadline, or NULL
+ * to wait without a deadline.
+ * @return int 0 once the main block was switched, -1 when
+ * `abstime` passed first.
+ */
+int pool_switch_block_timedwait(pool_t *pool, const struct timespec *abstime);
+
+/**
+ * @brief Claim a standby block for refill.
+ * The claimed block is FILLING until `pool_refill_end`
+ * publishes it: it is never made the main block and no
+ * other writer can claim it. The caller may write the
+ * `pool->block_size` elements starting at `*block`.
+ * 
+ * @param *pool instance. 
+ * @param *block receives the offset of the claimed block.
+ * @return int 0 on success, -1 when no unpinned STALE block is available.
+ */
+int pool_refill_begin(pool_t *pool, uint32_t *block);
+
+/**
+ * @brief Publish a block claimed with `pool_refill_begin`.
+ * The block becomes READY and is the preferred target of
+ * the next switch. A switch left pending by
+ * `pool_switch_block_s` is performed here.
+ * 
+ * @param *pool instance. 
+ * @param block offset returned by `pool_refill_begin`.
+ */
+void pool_refill_end(pool_t *pool, uint32_t block);
+
+/**
+ * @brief Create a refill service.
+ * `nworkers` long-lived threads are parked on a condition
+ * variable and woken whenever a refill job is queued. A
+ * single service may refill any number of pools.
+ * 
+ * @param nworkers number of worker threads.
+ * @param capacity maximum number of queued jobs.
+ * @return pool_service_t* a heap instance of the service, or
+ * NULL when `nworkers` or `capacity` is zero.
+ */
+pool_service_t *create_pool_service(uint32_t nworkers, uint32_t capacity);
+
+/**
+ * @brief Run every queued job, stop the workers and
+ * deallocate the service.
+ * Destroy the service before the pools it refills.
+ * 
+ * @param *service instance. 
+ */
+void destroy_pool_service(pool_service_t *service);
+
+/**
+ * @brief Queue a refill of `pool`.
+ * A worker claims a STALE block with `pool_refill_begin`,
+ * runs `fn` on it and publishes it with `pool_refill_end`.
+ * The job is dropped when the pool has no STALE block.
+ * 
+ * @param *service instance. 
+ * @param *pool pool to refill.
+ * @param fn refill callback.
+ * @param *arg argument handed to `fn`.
+ * @return int 0 when queued, -1 when the queue is full.
+ */
+int pool_service_submit(pool_service_t *service, pool_t *pool, pool_refill_fn fn, void *arg);
+
+/**
+ * @brief Wait until the queue is empty and no worker
+ * is running a job.
+ * 
+ * @param *service instance. 
+ */
+void pool_service_drain(pool_service_t *service);
+
+/**
+ * @brief Attach `pool` to a refill service.
+ * From now on every successful switch queues a refill of
+ * the block it made STALE. Pass a NULL `service` to detach.
+ * 
+ * @param *pool instance. 
+ * @param *service refill service, or NULL.
+ * @param fn refill callback.
+ * @param *arg argument handed to `fn`.
+ */
+void pool_set_refill(pool_t *pool, pool_service_t *service, pool_refill_fn fn, void *arg);
+
+/**
+ * @brief Reserve up to `count` contiguous values of the main
+ * block, starting at `index`, for reading in place.
+ * The span never wraps, so it is shortened at the end of the
+ * block. Until `pool_release` the block is pinned: it may stop
+ * being the main block, but it is never claimed for refill.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first value.
+ * @param count number of values wanted.
+ * @param *span receives the pointer, length and block.
+ * @return uint32_t number of values reserved.
+ */
+uint32_t pool_reserve(pool_t *pool, uint32_t index, uint32_t count, pool_span_t *span);
+
+/**
+ * @brief Release a span obtained from `pool_reserve`.
+ * The span is accounted as `length` reads of the main block.
+ * When the last pin of a STALE block is dropped, its refill
+ * is queued on the pool service.
+ * 
+ * @param *pool instance. 
+ * @param *span span to be released.
+ */
+void pool_release(pool_t *pool, pool_span_t *span);
+
+/**
+ * @brief Take up to `count` values, each handed out at most once.
+ * Slots of the main block are claimed with a compare-and-swap
+ * on a word holding the block and the slot. Once the
+ * block is exhausted, the cursor moves to the next READY block;
+ * consumed blocks are refilled through the pool service.
+ * 
+ * Take pools must be consumed through `pool_take` and
+ * `pool_take_many` only: `pool_get` and the switch functions
+ * would move the main block behind the take cursor.
+ * 
+ * @param *pool instance. 
+ * @param *out destination buffer.
+ * @param count number of values wanted.
+ * @return uint32_t number of values taken, smaller than `count`
+ * when every fresh block has been consumed.
+ */
+uint32_t pool_take_many(pool_t *pool, uint32_t *out, uint32_t count);
+
+/**
+ * @brief Take one value, handed out at most once.
+ * See `pool_take_many`.
+ * 
+ * @param *pool instance. 
+ * @param *value receives the value.
+ * @return int 0 on success, -1 when every fresh block has been consumed.
+ */
+int pool_take(pool_t *pool, uint32_t *value);
+
+/**
+ * @brief Register a per-thread shard of `pool`.
+ * A shard carries its own cursor and iteration counter on
+ * its own cache line, so readers do not write shared state on
+ * every call. Reads are flushed to `shard_reads` in batches of
+ * `max_it / POOL_SHARD_FLUSH`, and the main block is switched
+ * once the flushed total reaches `max_it`.
+ * 
+ * @param *pool instance. 
+ * @return pool_shard_t* a heap instance of the shard.
+ */
+pool_shard_t *pool_shard_register(pool_t *pool);
+
+/**
+ * @brief Flush the reads of `shard` and deallocate it.
+ * 
+ * @param *shard instance. 
+ */
+void pool_shard_unregister(pool_shard_t *shard);
+
+/**
+ * @brief Retrieve the value at `index` position through a shard.
+ * Same as `pool_get`, with the iteration counter kept in the shard.
+ * 
+ * @param *shard instance. 
+ * @param index position.
+ * @return uint32_t retrieves the value at index.
+ */
+uint32_t pool_shard_get(pool_shard_t *shard, uint32_t index);
+
+/**
+ * @brief Insert `value` at the shard cursor.
+ * Shards do not share their cursor; threads that insert
+ * should give each shard its own range with
+ * `pool_shard_set_cursor`.
+ * 
+ * @param *shard instance. 
+ * @param value uint32_t value to be inserted.
+ */
+void pool_shard_insert(pool_shard_t *shard, uint32_t value);
+
+/**
+ * @brief Set the shard cursor to `new_cursor`.
+ * 
+ * @param *shard instance. 
+ * @param new_cursor new cursor position.
+ */
+void pool_shard_set_cursor(pool_shard_t *shard, uint32_t new_cursor);
+
+/**
+ * @brief Create one pool per NUMA node.
+ * Each replica has its storage bound to its node and, when a
+ * producer is given, is refilled on its own so consumers read a
+ * local copy. `opts` is used for every replica with `numa_node`
+ * replaced by the replica node.
+ * 
+ * @param size total number of uint32_t elements of each replica.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage options, or NULL for anonymous mmap.
+ * @param *service refill service, or NULL for plain pools.
+ * @param producer block producer, or NULL for plain pools.
+ * @param *arg argument handed to `producer`.
+ * @return pool_replicas_t* a heap instance, or NULL when the
+ * geometry is invalid.
+ */
+pool_replicas_t *create_pool_replicas(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                                      const pool_options_t *opts, pool_service_t *service,
+                                      pool_producer_fn producer, void *arg);
+
+/**
+ * @brief Deallocate every replica.
+ * Destroy the refill service first when the replicas have a producer.
+ * 
+ * @param *replicas instance.
+ */
+void destroy_pool_replicas(pool_replicas_t *replicas);
+
+/**
+ * @brief Retrieve the replica of the NUMA node the calling
+ * thread is running on.
+ * 
+ * @param *replicas instance.
+ * @return pool_t* the local replica.
+ */
+pool_t *pool_replica_local(pool_replicas_t *replicas);
+
+/**
+ * @brief Create a pool object stored in the file at `path`,
+ * or reopen it with its blocks and metadata intact.
+ * The file starts with a versioned `pool_file_header_t`
+ * holding the geometry, `current_block`, `cursor`, a
+ * `generation` bumped on every switch and publication, and
+ * the block states; the block storage follows, page aligned.
+ * A new file is sparse, so its blocks start zeroed and READY.
+ * 
+ * On reopen the file is trusted as follows: the block named by
+ * `current_block` is the main block, which the library never
+ * writes, and any other block left ACTIVE or FILLING by a crash
+ * is STALE. READY and STALE blocks are kept as they are.
+ * 
+ * @param *path file backing the pool.
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *service refill service, or NULL for a plain pool.
+ * @param producer block producer, or NULL for a plain pool.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid, the file cannot be mapped or it holds
+ * a pool of another version or geometry.
+ */
+pool_t *create_pool_mapped(const char *path, uint32_t size, uint32_t nblocks, uint32_t max_it,
+                           pool_service_t *service, pool_producer_fn producer, void *arg);
+
+/**
+ * @brief Write the cursor and main block of a file-backed
+ * pool to its header and flush the whole file to disk.
+ * Without it, blocks survive a process restart but not a
+ * power loss. `destroy_pool` calls it.
+ * 
+ * @param *pool instance. 
+ * @return int 0 on success, -1 when the pool is not
+ * file-backed or the flush failed.
+ */
+int pool_sync(pool_t *pool);
+
+/**
+ * @brief Create a pool object in the shared-memory segment
+ * `name`, to be attached to by other processes with
+ * `pool_attach`.
+ * Every process reads and switches the same blocks: the
+ * block states, the main block and the take cursor live in
+ * the segment and are only touched with lock-free atomics.
+ * The segment lock is a process-shared robust mutex guarding
+ * the table of attached processes.
+ * 
+ * With a `producer`, the calling process feeds every attached
+ * consumer: a refill thread waits on the switch epoch, runs
+ * the producer on each STALE block and reaps the slots of
+ * crashed consumers. Attached processes then never recycle
+ * STALE blocks, as in `create_pool_producer`.
+ * 
+ * A segment left behind by a crashed owner is replaced.
+ * 
+ * @param *name segment name, as for `shm_open`.
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param producer block producer, or NULL for a plain pool.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid or the segment exists or cannot be created.
+ */
+pool_t *create_pool_shared(const char *name, uint32_t size, uint32_t nblocks, uint32_t max_it,
+                           pool_producer_fn producer, void *arg);
+
+/**
+ * @brief Attach to the pool created by `create_pool_shared`
+ * under `name`.
+ * The attached pool shares the blocks, their states and the
+ * main block with every other process; its cursor and read
+ * counter are its own. `destroy_pool` detaches it.
+ * 
+ * @param *name segment name.
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the segment does not exist, holds a pool of another version or
+ * has no free slot.
+ */
+pool_t *pool_attach(const char *name, uint32_t max_it);
+
+/**
+ * @brief Release the slots of attached processes that
+ * exited without `destroy_pool`.
+ * Their pins are dropped, so the blocks they were reading
+ * can be refilled again. Producer-fed pools do this in their
+ * refill thread; `pool_attach` does it when the table is full.
+ * 
+ * @param *pool a shared-memory pool.
+ * @return int number of slots released, or -1 when the pool
+ * is not in shared memory.
+ */
+int pool_shared_reap(pool_t *pool);
+
+/**
+ * @brief Aggregate the statistics of `pool` into `stats`.
+ * Counters are kept in cache-line stripes, one per thread, that
+ * only their owner writes and this function sums; latencies are
+ * in shared histograms. All are updated with relaxed atomics, so
+ * readers are never stopped: the snapshot is exact per counter
+ * but not a single cut across counters. Statistics
+ * are per process, also for shared-memory pools.
+ * 
+ * @param *pool instance. 
+ * @param *stats receives the counters and histograms.
+ */
+void pool_stats_snapshot(pool_t *pool, pool_stats_t *stats);
+
+/**
+ * @brief Estimate a latency quantile from a snapshot.
+ * 
+ * @param *stats snapshot taken with `pool_stats_snapshot`.
+ * @param hist one of the POOL_HIST_* histograms.
+ * @param q quantile, between 0 and 1 (0.99 for p99).
+ * @return uint64_t upper bound of the bucket holding the quantile,
+ * in nanoseconds, or 0 when the histogram is empty.
+ */
+uint64_t pool_stats_percentile(const pool_stats_t *stats, int hist, double q);
+
+/**
+ * @brief Open the POOL_PERF_* counters for the calling thread.
+ * User-space events only are counted, so unprivileged processes
+ * can use them with the default `perf_event_paranoid`. Counters
+ * the kernel refuses (no PMU in a VM, seccomp, paranoid level)
+ * are skipped; the others keep working.
+ * 
+ * The hardware counters form one group and the task clock its
+ * own, so a PMU group that cannot be scheduled does not stop the
+ * clock. Each group reports how long it was enabled and running,
+ * which `pool_perf_end` uses to scale multiplexed counts.
+ * 
+ * @param *perf instance, owned by the calling thread.
+ * @return int number of counters opened, 0 when perf events
+ * are unavailable.
+ */
+int pool_perf_open(pool_perf_t *perf);
+
+/**
+ * @brief Start measuring a batch of pool operations.
+ * 
+ * @param *perf instance opened by the calling thread.
+ */
+void pool_perf_begin(pool_perf_t *perf);
+
+/**
+ * @brief End the batch started by `pool_perf_begin` and add
+ * its counts, along with `ops`, to the statistics of `pool`.
+ * Counts per operation are POOL_STAT_CYCLES.. divided by
+ * POOL_STAT_PERF_OPS in a `pool_stats_snapshot`. Each call
+ * reads the counters with a single system call per group, so
+ * measure batches rather than single operations.
+ * 
+ * A group the PMU multiplexed has its counts scaled by the time
+ * it was enabled over the time it ran. When a group did not run
+ * at all, the batch is dropped and `ops` is not counted, so the
+ * counts per operation are never silently low.
+ * 
+ * @param *perf instance opened by the calling thread.
+ * @param *pool pool the batch ran on.
+ * @param ops number of operations in the batch.
+ */
+void pool_perf_end(pool_perf_t *perf, pool_t *pool, uint64_t ops);
+
+/**
+ * @brief Close the counters of `perf`.
+ * 
+ * @param *perf instance. 
+ */
+void pool_perf_close(pool_perf_t *perf);
+
+/**
+ * @brief Write the events recorded by every thread to `path`
+ * as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+ * Switches and refills are spans, pending switches, stalled
+ * reads and read retries are instants; each thread keeps its
+ * last POOL_TRACE_EVENTS events. Events recorded while the dump
+ * runs may be missing or torn, so dump once readers are idle.
+ * 
+ * Events are only recorded when the library is built with
+ * POOL_TRACE (cmake -DPOOL_TRACE=ON); otherwise tracing costs
+ * nothing and this function fails.
+ * 
+ * @param *path output file.
+ * @return int 0 on success, -1 when tracing is compiled out or
+ * the file cannot be written.
+ */
+int pool_trace_dump(const char *path);
+
+/**
+ * @brief Retrieve the eventfd signaled on `event`, for callers
+ * running an event loop instead of blocking.
+ * The fd is created on first use, non-blocking, and stays owned
+ * by the pool: do not close it. Every signal adds 1 to the
+ * eventfd counter, so a read returns the number of events since
+ * the previous read.
+ * 
+ * POOL_EVENT_PUBLISH is signaled by every `pool_refill_end`,
+ * POOL_EVENT_LOW_WATER once per main block, see
+ * `pool_set_low_watermark`. The fds belong to the process: a
+ * pool created with `create_pool_shared` only signals the
+ * events of its own process.
+ * 
+ * @param *pool instance. 
+ * @param event one of the POOL_EVENT_* events.
+ * @return int the eventfd, -1 when `event` is invalid or the
+ * eventfd cannot be created.
+ */
+int pool_event_fd(pool_t *pool, int event);
+
+/**
+ * @brief Signal POOL_EVENT_LOW_WATER when the main block has
+ * `reads` reads left before the switch policy retires it.
+ * The time policy has no read limit, so its event is signaled
+ * once the main block is `max_age` old.
+ * 
+ * @param *pool instance. 
+ * @param reads reads left on the main block, 0 disables the
+ * event.
+ */
+void pool_set_low_watermark(pool_t *pool, uint32_t reads);
+
+/**
+ * @brief Create an allocator of `count` objects of `obj_size`
+ * bytes, carved from the storage of a cache-line aligned pool
+ * of two blocks.
+ * Objects are handed out by `pool_object_alloc` through
+ * per-thread caches. The free objects sit in a depot of two
+ * blocks, like the double blocks of a pool: allocations drain
+ * the main block while frees go to the standby block, and once
+ * the main block is empty the standby block is moved into it.
+ * Frees never touch the main block, so a freed object is never
+ * reused before every object of the main block was.
+ * 
+ * @param obj_size object size, rounded up to POOL_OBJECT_ALIGN.
+ * @param count number of objects.
+ * @return pool_objects_t* a heap instance, or NULL when
+ * `obj_size` or `count` is 0 or too large.
+ */
+pool_objects_t *create_pool_objects(size_t obj_size, uint32_t count);
+
+/**
+ * @brief Deallocate `objects` and its pool. Every cache must
+ * be unregistered first.
+ * 
+ * @param *objects instance. 
+ */
+void destroy_pool_objects(pool_objects_t *objects);
+
+/**
+ * @brief Register a per-thread cache of `objects`.
+ * A cache holds one magazine to allocate from and one
+ * collecting frees, so most calls touch no shared state.
+ * 
+ * @param *objects instance. 
+ * @return pool_object_cache_t* a heap instance of the cache.
+ */
+pool_object_cache_t *pool_object_cache_register(pool_objects_t *objects);
+
+/**
+ * @brief Give the objects held by `cache` back to the depot and
+ * deallocate it.
+ * 
+ * @param *cache instance. 
+ */
+void pool_object_cache_unregister(pool_object_cache_t *cache);
+
+/**
+ * @brief Allocate an object.
+ * The object comes from the allocation magazine of `cache`; an
+ * empty magazine is reloaded with a whole magazine popped from
+ * the main depot block. When that block is empty, the frees of
+ * `cache` are flushed to the standby block and the standby
+ * magazines are moved to the main block. This function never
+ * enters the kernel.
+ * 
+ * @param *cache instance. 
+ * @return void* an object of `obj_size` bytes, or NULL when
+ * every object is allocated or held by another cache.
+ */
+void *pool_object_alloc(pool_object_cache_t *cache);
+
+/**
+ * @brief Free an object allocated from the same pool.
+ * The object is collected by `cache` and pushed to the standby
+ * depot block once a magazine is full. Any cache of the pool
+ * may free it, whichever cache allocated it.
+ * 
+ * @param *cache instance. 
+ * @param *obj object, or NULL.
+ */
+void pool_object_free(pool_object_cache_t *cache, void *obj);
+
+/**
+ * @brief Create a bounded multi-producer multi-consumer queue of
+ * uint32_t items over the storage of `pool`.
+ * Each slot carries a sequence number (D. Vyukov's bounded MPMC
+ * queue): a producer claims a position with one CAS on `tail`,
+ * writes the slot and publishes it by storing position + 1 in
+ * its sequence; a consumer claims it with one CAS on `head` and
+ * frees it by storing position + capacity. No lock is taken;
+ * the blocking calls sleep on a futex only when the queue is
+ * full or empty.
+ * 
+ * The capacity is the largest power of two not above `size`,
+ * so positions are masked. The queue owns the storage until it
+ * is destroyed: do not use the other pool functions meanwhile.
+ * 
+ * @param *pool storage, which the queue does not own.
+ * @return pool_queue_t* a heap instance, or NULL when the pool
+ * has fewer than 2 elements.
+ */
+pool_queue_t *create_pool_queue(pool_t *pool);
+
+/**
+ * @brief Deallocate `queue`, leaving its pool alive.
+ * 
+ * @param *queue instance. 
+ */
+void destroy_pool_queue(pool_queue_t *queue);
+
+/**
+ * @brief Enqueue `value` unless the queue is full.
+ * 
+ * @param *queue instance. 
+ * @param value item.
+ * @return int 0 when enqueued, -1 when the queue is full.
+ */
+int pool_queue_try_enqueue(pool_queue_t *queue, uint32_t value);
+
+/**
+ * @brief Dequeue the oldest item unless the queue is empty.
+ * 
+ * @param *queue instance. 
+ * @param *value destination of the item.
+ * @return int 0 when dequeued, -1 when the queue is empty.
+ */
+int pool_queue_try_dequeue(pool_queue_t *queue, uint32_t *value);
+
+/**
+ * @brief Enqueue up to `count` items with a single claim on the
+ * tail. The items enqueued are consecutive in the queue.
+ * 
+ * @param *queue instance. 
+ * @param *values items.
+ * @param count number of items.
+ * @return uint32_t number of items enqueued, 0 when the queue
+ * is full.
+ */
+uint32_t pool_queue_try_enqueue_many(pool_queue_t *queue, const uint32_t *values, uint32_t count);
+
+/**
+ * @brief Dequeue up to `count` of the oldest items with a single
+ * claim on the head.
+ * 
+ * @param *queue instance. 
+ * @param *out destination of the items.
+ * @param count room in `out`.
+ * @return uint32_t number of items dequeued, 0 when the queue
+ * is empty.
+ */
+uint32_t pool_queue_try_dequeue_many(pool_queue_t *queue, uint32_t *out, uint32_t count);
+
+/**
+ * @brief Enqueue `value`, sleeping while the queue is full.
+ * 
+ * @param *queue instance. 
+ * @param value item.
+ */
+void pool_queue_enqueue(pool_queue_t *queue, uint32_t value);
+
+/**
+ * @brief Dequeue the oldest item, sleeping while the queue is
+ * empty.
+ * 
+ * @param *queue instance. 
+ * @return uint32_t the item.
+ */
+uint32_t pool_queue_dequeue(pool_queue_t *queue);
+
+/**
+ * @brief Enqueue all `count` items, sleeping whenever the queue
+ * is full. Other producers may interleave their items between
+ * the batches this call is split into.
+ * 
+ * @param *queue instance. 
+ * @param *values items.
+ * @param count number of items.
+ */
+void pool_queue_enqueue_many(pool_queue_t *queue, const uint32_t *values, uint32_t count);
+
+/**
+ * @brief Dequeue up to `count` of the oldest items, sleeping
+ * while the queue is empty.
+ * 
+ * @param *queue instance. 
+ * @param *out destination of the items.
+ * @param count room in `out`, at least 1.
+ * @return uint32_t number of items dequeued, at least 1.
+ */
+uint32_t pool_queue_dequeue_many(pool_queue_t *queue, uint32_t *out, uint32_t count);
+
+/**
+ * @brief Group `npools` pools, typically one per shard, so that
+ * the readers of a pool whose refill is late read from the
+ * others instead of an exhausted block.
+ * The pools are not copied nor owned: they must outlive the
+ * group.
+ * 
+ * @param **pools pools of the group.
+ * @param npools number of pools, at least 1.
+ * @return pool_group_t* a heap instance, or NULL when `npools`
+ * is 0.
+ */
+pool_group_t *create_pool_group(pool_t **pools, uint32_t npools);
+
+/**
+ * @brief Deallocate `group`, leaving its pools alive. Every
+ * member must have left first.
+ * 
+ * @param *group instance. 
+ */
+void destroy_pool_group(pool_group_t *group);
+
+/**
+ * @brief Register a reader thread of `group` whose home is pool
+ * number `home`.
+ * 
+ * @param *group instance. 
+ * @param home index of the home pool.
+ * @return pool_group_member_t* a heap instance, or NULL when
+ * `home` is out of range.
+ */
+pool_group_member_t *pool_group_join(pool_group_t *group, uint32_t home);
+
+/**
+ * @brief Deallocate `member`.
+ * 
+ * @param *member instance. 
+ */
+void pool_group_leave(pool_group_member_t *member);
+
+/**
+ * @brief Read a value for `member`.
+ * The value comes from the home pool, through `pool_get`, unless
+ * its main block is exhausted: a switch is pending because no
+ * standby block is READY yet. The member then serves values
+ * stolen from a READY standby block of a sibling, copying
+ * POOL_GROUP_BATCH of them at once. The sibling keeps reading its
+ * main block: its switch policy and statistics are not touched,
+ * and the standby block stays READY for its next switch. Once the
+ * home refill is published, reads go home again. When no sibling
+ * has a READY block, the home pool is read anyway, as `pool_get`
+ * would.
+ * 
+ * @param *member instance. 
+ * @param index position.
+ * @return uint32_t the value.
+ */
+uint32_t pool_group_get(pool_group_member_t *member, uint32_t index);
+
+/**
+ * @brief Copy the steal counters of `group`.
+ * The counters are only written when a member steals, so the
+ * home reads cost nothing. They are kept in the group only: the
+ * statistics of the pools do not count steals.
+ * 
+ * @param *group instance. 
+ * @param *counts receives the POOL_GROUP_STAT_* counters.
+ */
+void pool_group_stats(pool_group_t *group, uint64_t *counts);
+
+/**
+ * @brief Refill `pool` with the contents of `fd`, a regular file
+ * or a device such as `/dev/urandom`.
+ * The main block is read before this function returns and every
+ * other block is marked STALE; from then on each block made STALE
+ * by a switch is read again in place, from the next bytes of
+ * `fd`. A regular file is read from the current position of `fd`,
+ * which is left unchanged, and wraps around to its start at its
+ * end. A non-blocking descriptor without data is waited for, not
+ * polled in a loop. As in `create_pool_producer`, STALE blocks
+ * are never recycled, and a switch that finds no READY block is
+ * left pending until a read completes.
+ * 
+ * With io_uring, a single thread keeps up to `depth` block reads
+ * in flight. The blocks are registered as fixed buffers, so the
+ * kernel writes straight into the pool; when they cannot be
+ * registered (a file-backed pool, or more than 65535 blocks,
+ * which a read cannot name), plain reads into the same
+ * memory are used. The pread engine runs `depth` threads, each
+ * reading one block at a time. Both wait on the switch epoch
+ * while there is nothing to read.
+ * 
+ * A read or io_uring error stops the stream: the blocks being
+ * read go back to STALE and `pool_stream_error` reports the error.
+ * 
+ * @param *pool instance, nothing consumed yet.
+ * @param fd open descriptor, still owned by the caller.
+ * @param depth number of block reads in flight.
+ * @param mode one of the POOL_STREAM_* engines.
+ * @return pool_stream_t* a heap instance of the stream, or NULL when
+ * an argument is invalid, `pool` is already refilled, the main
+ * block cannot be read or POOL_STREAM_URING is unavailable.
+ */
+pool_stream_t *create_pool_stream(pool_t *pool, int fd, uint32_t depth, int mode);
+
+/**
+ * @brief Stop the reads of `stream`, wait for those in flight
+ * and deallocate it.
+ * Destroy the stream before its pool, once its readers are done.
+ * The pool keeps its blocks but is no longer refilled.
+ * 
+ * @param *stream instance. 
+ */
+void destroy_pool_stream(pool_stream_t *stream);
+
+/**
+ * @brief Error that stopped `stream`.
+ * 
+ * @param *stream instance. 
+ * @return int 0 while the stream runs, else the errno value of
+ * the failed read or `io_uring_enter` call (ENODATA when a file
+ * became empty).
+ */
+int pool_stream_error(pool_stream_t *stream);
+
 
 #endif /* POOL_H */
\ No newline at end of file
@@ -0,0 +1,168 @@
+/* * Pool32 - Multi-threaded pools
+ * Copyright (C) 2023, 2023 Murilo Augusto <murilo@bad1337.com>
+ *
+ * This file is part of Pool32.
+ *
+ * Pool32 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pool32 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_TYPED_H
+#define POOL_TYPED_H
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "pool.h"
+
+/*
+ * Header-only pools specialized at compile time.
+ *
+ * POOL_DEFINE(name, T, N) defines `name_t`, a double-block pool of
+ * `T` with N elements per block, and its `static inline` functions.
+ * POOL_DEFINE_RING(name, T, N, B) does the same with a ring of B
+ * blocks. N and B must be powers of two: indices are masked and
+ * block offsets shifted, so no access divides, and the next block
+ * of the ring is `(block + 1) & (B - 1)`.
+ *
+ * The storage is part of `name_t`, which can live in static
+ * storage, on the stack or in `aligned_alloc(POOL_CACHELINE, ...)`
+ * memory. Reads, inserts and switches follow `pool_get`,
+ * `pool_insert` and `pool_switch_block_s`: a read is retried until
+ * no switch raced it, and readers switch after `max_it` reads.
+ * There are no block states, refill service or statistics; a
+ * producer writes the `name_standby` block itself, and must not
+ * write it while a switch may activate it.
+ *
+ *     POOL_DEFINE(ids, uint64_t, 1024)
+ *
+ *     static ids_t pool;
+ *     ids_init(&pool, 512);
+ *     uint64_t id = ids_get(&pool, i);
+ */
+
+#define POOL_DEFINE(name, T, N) POOL_DEFINE_RING(name, T, N, 2)
+
+#define POOL_DEFINE_RING(name, T, N, B)                                                     \
+_Static_assert((N) > 0 && ((N) & ((N) - 1)) == 0, #name ": block size must be a power of two"); \
+_Static_assert((B) >= 2 && ((B) & ((B) - 1)) == 0, #name ": block count must be a power of two"); \
+_Static_assert((uint64_t)(N) * (B) <= UINT32_MAX, #name ": pool too large");               \
+                                                                                            \
+typedef struct name {                                                                       \
+    /* Publication, written once per switch. */                                             \
+    _Alignas(POOL_CACHELINE) _Atomic uint32_t current_block;                                \
+    atomic_uint epoch;                                                                      \
+    uint32_t max_it;                                                                        \
+                                                                                            \
+    /* Cursor and counter, written by every access. */                                      \
+    _Alignas(POOL_CACHELINE) uint32_t cursor;                                               \
+    atomic_uint iterations;                                                                 \
+                                                                                            \
+    _Alignas(POOL_CACHELINE) T pool[(N) * (B)];                                             \
+} name##_t;                                                                                 \
+                                                                                            \
+/* Initialize `p` with zeroed blocks; block 0 is the main block. */                         \
+static inline void name##_init(name##_t *p, uint32_t max_it)                                \
+{                                                                                           \
+    memset(p->pool, 0, sizeof(p->pool));                                                    \
+    atomic_init(&p->current_block, 0);                                                      \
+    atomic_init(&p->epoch, 0);                                                              \
+    p->max_it = max_it;                                                                     \
+    p->cursor = 0;                                                                          \
+    atomic_init(&p->iterations, 0);                                                         \
+}                                                                                           \
+                                                                                            \
+/* Storage of block `block` of the ring. */                                                 \
+static inline T *name##_block(name##_t *p, uint32_t block)                                  \
+{                                                                                           \
+    return p->pool + (size_t)(block & ((B) - 1)) * (N);                                     \
+}                                                                                           \
+                                                                                            \
+/* Block the next switch makes the main block. */                                           \
+static inline uint32_t name##_standby(name##_t *p)                                          \
+{                                                                                           \
+    return (atomic_load_explicit(&p->current_block, memory_order_acquire) + 1) & ((B) - 1); \
+}                                                                                           \
+                                                                                            \
+/* Fill every block with `value`. Not thread-safe. */                                       \
+static inline void name##_fill(name##_t *p, T value)                                        \
+{                                                                                           \
+    for (uint32_t i = 0; i < (N) * (B); i++) {                                              \
+        p->pool[i] = value;                                                                 \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+/* Make the next block of the ring the main block. Returns 0                                \
+ * when switched, 1 when another thread switched it first. Only                             \
+ * the winner resets the read counter. */                                                   \
+static inline int name##_switch(name##_t *p)                                                \
+{                                                                                           \
+    uint32_t block = atomic_load_explicit(&p->current_block, memory_order_acquire);         \
+                                                                                            \
+    if (!atomic_compare_exchange_strong_explicit(&p->current_block, &block,                 \
+                                                 (block + 1) & ((B) - 1),                   \
+                                                 memory_order_acq_rel,                      \
+                                                 memory_order_acquire)) {                   \
+        return 1;                                                                           \
+    }                                                                                       \
+    atomic_store_explicit(&p->iterations, 0, memory_order_relaxed);                         \
+    atomic_fetch_add_explicit(&p->epoch, 1, memory_order_seq_cst);                          \
+    return 0;                                                                               \
+}                                                                                           \
+                                                                                            \
+/* Value at `index` of the main block, see `pool_get`. The read                           \
+ * counter is loaded and stored like `pool_count_reads`; of the                             \
+ * readers reaching `max_it`, the one whose CAS resets it switches. */                      \
+static inline T name##_get(name##_t *p, uint32_t index)                                     \
+{                                                                                           \
+    uint32_t reads = atomic_load_explicit(&p->iterations, memory_order_relaxed) + 1;        \
+                                                                                            \
+    atomic_store_explicit(&p->iterations, reads, memory_order_relaxed);                     \
+    if (__builtin_expect(reads >= p->max_it, 0) &&                                          \
+        atomic_compare_exchange_strong_explicit(&p->iterations, &reads, 0,                  \
+                                                memory_order_relaxed,                       \
+                                                memory_order_relaxed)) {                    \
+        name##_switch(p);                                                                   \
+    }                                                                                       \
+                                                                                            \
+    T value;                                                                                \
+                                                                                            \
+    for (;;) {                                                                              \
+        uint32_t epoch = atomic_load_explicit(&p->epoch, memory_order_acquire);             \
+        uint32_t block = atomic_load_explicit(&p->current_block, memory_order_acquire);     \
+                                                                                            \
+        value = p->pool[block * (N) + (index & ((N) - 1))];                                 \
+        atomic_thread_fence(memory_order_acquire);                                          \
+        if (atomic_load_explicit(&p->epoch, memory_order_relaxed) == epoch) {               \
+            return value;                                                                   \
+        }                                                                                   \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+/* Insert `value` at the cursor of the main block. */                                       \
+static inline void name##_insert(name##_t *p, T value)                                      \
+{                                                                                           \
+    uint32_t block = atomic_load_explicit(&p->current_block, memory_order_acquire);         \
+                                                                                            \
+    p->pool[block * (N) + p->cursor] = value;                                               \
+    p->cursor = (p->cursor + 1) & ((N) - 1);                                                \
+}                                                                                           \
+                                                                                            \
+/* Insert `value` at `index` of the main block. */                                          \
+static inline void name##_insert_at(name##_t *p, T value, uint32_t index)                   \
+{                                                                                           \
+    uint32_t block = atomic_load_explicit(&p->current_block, memory_order_acquire);         \
+                                                                                            \
+    p->pool[block * (N) + (index & ((N) - 1))] = value;                                     \
+}
+
+#endif /* POOL_TYPED_H */
@@ -25,63 +25,38 @@
 #include "include/hexdump.h"
 #include "include/pool.h"
 
-struct thread_args {
-    pool_t *pool;
-    uint32_t block;
-    uint32_t value;
-};
-
-void *thread_routine(void *args)
+void producer_routine(uint32_t *data, uint32_t len, void *args)
 {
-    /* 1. Parse args to get the pool instance.          */
-    struct thread_args *arguments = (struct thread_args*)args;
-    pool_t *pool = (pool_t*)arguments->pool;
-    uint32_t block = arguments->block;
-    uint32_t value = arguments->value;
-
-    /* 2. Atomically set pool->locked to true.          */
-    atomic_exchange_explicit(&pool->locked, true, memory_order_seq_cst);
+    /* 1. Parse args to get the refill counter.           */
+    atomic_uint *refills = (atomic_uint*)args;
+    uint32_t value = atomic_fetch_add(refills, 1);
 
-    /* 3. Perform operation on the specific pool block. */
-    for (uint32_t i = block; i < block + POOL_BLOCK_SIZE; i++) {
-        pool->pool[i] = 0xaaaaaaaa ^ value;
+    /* 2. Produce the standby block in place.             */
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = 0xaaaaaaaa ^ value;
     }
 
-    /* 4. Atomically set pool->locked to false.         */
-    atomic_exchange_explicit(&pool->locked, false, memory_order_seq_cst);
-
-    /* 5. Finish the thread.                            */
-    return NULL;
+    /* 3. Return: the library publishes the block for us. */
 }
 
 
 int main(void)
 {
-    pool_t *pool = create_pool();
-    pthread_t thread;
+    atomic_uint refills = ATOMIC_VAR_INIT(0);
+    pool_service_t *service = create_pool_service(1, 4);
+    pool_t *pool = create_pool_producer(POOL_SIZE, POOL_BLOCKS, POOL_MAX_IT,
+                                        service, &producer_routine, &refills);
 
-    pool_fill_area(pool, 0xffffffff, POOL_BLOCK_A, POOL_BLOCK_B);
-
-    hexdump("Pool (before)", &pool->pool, POOL_SIZE * sizeof(uint32_t), 16);
+    hexdump("Pool (before)", pool->pool, pool->size * sizeof(uint32_t), 16);
 
     for (uint32_t i = 0; i < 500; i++)
     {
-        if (pool->iterations >= POOL_BLOCK_SIZE) {
-            if (atomic_load_explicit(&pool->locked, memory_order_seq_cst) == false)
-            {
-                struct thread_args args = {.pool = pool, .block = pool->current_block, .value = i};
-                if (pthread_create(&thread, NULL, &thread_routine, &args)) {
-                    perror("Cannot create thread");
-                    exit(2);
-                }
-                pthread_detach(thread);
-            }
-            pool->iterations = 0;
-        }
         pool_get(pool, i);
     }
 
-    hexdump("Pool (after)", &pool->pool, POOL_SIZE * sizeof(uint32_t), 16);
+    destroy_pool_service(service);
+
+    hexdump("Pool (after)", pool->pool, pool->size * sizeof(uint32_t), 16);
 
     destroy_pool(pool);
     return 0;
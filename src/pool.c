@@ -17,191 +17,4833 @@
  * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <linux/io_uring.h>
 #include "include/pool.h"
 
+/* Eight uint32_t lanes. GCC and Clang lower stores of this type to
+ * whatever vector registers the target has (two SSE2 stores, one
+ * AVX2 store, ...). */
+typedef uint32_t pool_vec_t __attribute__((vector_size(32)));
+
+/**
+ * @brief Write `count` copies of `value` starting at `dst`.
+ * 
+ * @param *dst first element.
+ * @param value value to be written.
+ * @param count number of elements.
+ */
+static void pool_fill_words(uint32_t *dst, uint32_t value, uint32_t count)
+{
+    uint32_t i = 0;
+
+    if ((value & 0xff) * 0x01010101u == value) {
+        /* Every byte is the same (0, 0xffffffff, 0xcccccccc...). */
+        memset(dst, (int)(value & 0xff), (size_t)count * sizeof(uint32_t));
+        return;
+    }
+
+    pool_vec_t lanes = {value, value, value, value, value, value, value, value};
+
+    for (; i + 8 <= count; i += 8) {
+        memcpy(dst + i, &lanes, sizeof(lanes));
+    }
+    for (; i < count; i++) {
+        dst[i] = value;
+    }
+}
+
+/**
+ * @brief Write copies of the `words`-word element at `pattern`
+ * over `count` words starting at `dst`.
+ * Elements dividing a vector are repeated across its lanes and
+ * elements made of whole vectors are stored vector by vector;
+ * other widths double the filled prefix with memcpy.
+ * 
+ * @param *dst first word.
+ * @param *pattern element to be written.
+ * @param words words per element.
+ * @param count number of words, a multiple of `words`.
+ */
+static void pool_fill_pattern(uint32_t *dst, const uint32_t *pattern, uint32_t words, uint32_t count)
+{
+    const uint32_t lanes = sizeof(pool_vec_t) / sizeof(uint32_t);
+    uint32_t i = 0;
+
+    if (count == 0) {
+        return;
+    }
+    if (words == 1) {
+        pool_fill_words(dst, pattern[0], count);
+        return;
+    }
+
+    if (lanes % words == 0) {
+        pool_vec_t vec;
+
+        for (uint32_t l = 0; l < lanes; l++) {
+            vec[l] = pattern[l % words];
+        }
+        for (; i + lanes <= count; i += lanes) {
+            memcpy(dst + i, &vec, sizeof(vec));
+        }
+        for (; i < count; i++) {
+            dst[i] = pattern[i % words];
+        }
+        return;
+    }
+
+    if (words % lanes == 0) {
+        for (; i < count; i += words) {
+            for (uint32_t v = 0; v < words; v += lanes) {
+                pool_vec_t vec;
+
+                memcpy(&vec, pattern + v, sizeof(vec));
+                memcpy(dst + i + v, &vec, sizeof(vec));
+            }
+        }
+        return;
+    }
+
+    memcpy(dst, pattern, words * sizeof(uint32_t));
+    for (i = words; i < count; i *= 2) {
+        memcpy(dst + i, dst, (size_t)((i <= count - i) ? i : count - i) * sizeof(uint32_t));
+    }
+}
+
+/**
+ * @brief Copy one element of `words` words.
+ * The common widths are constant-size copies, which compilers
+ * lower to register moves instead of a call to memcpy.
+ * 
+ * @param *dst destination.
+ * @param *src source.
+ * @param words words per element.
+ */
+static inline void pool_elem_copy(void *dst, const void *src, uint32_t words)
+{
+    switch (words) {
+    case 1:
+        memcpy(dst, src, 4);
+        break;
+    case 2:
+        memcpy(dst, src, 8);
+        break;
+    case 4:
+        memcpy(dst, src, 16);
+        break;
+    case 16:
+        memcpy(dst, src, 64);
+        break;
+    default:
+        memcpy(dst, src, words * sizeof(uint32_t));
+        break;
+    }
+}
+
+/**
+ * @brief Copy `count` elements between `values` and a block,
+ * starting at `offset` and wrapping around the end of the block.
+ * 
+ * @param *pool instance.
+ * @param block offset of the block.
+ * @param offset first position inside the block.
+ * @param *values caller buffer.
+ * @param count number of elements.
+ * @param store true to write into the block, false to read it.
+ */
+static void pool_copy_wrapped(pool_t *pool, uint32_t block, uint32_t offset,
+                              uint32_t *values, uint32_t count, bool store)
+{
+    while (count > 0) {
+        uint32_t chunk = pool->block_size - offset;
+
+        if (chunk > count) {
+            chunk = count;
+        }
+        if (store) {
+            memcpy(pool->pool + block + offset, values, chunk * sizeof(uint32_t));
+        } else {
+            memcpy(values, pool->pool + block + offset, chunk * sizeof(uint32_t));
+        }
+        values += chunk;
+        count -= chunk;
+        offset = 0;
+    }
+}
+
+/* Stripes owned by a live thread, one bit each; the stripe of the
+ * calling thread (`POOL_STAT_UNSET` until it first counts), and the
+ * key whose destructor hands the stripe back when the thread exits. */
+#define POOL_STAT_UNSET     UINT32_MAX
+static _Atomic uint64_t pool_stripes_owned = ATOMIC_VAR_INIT(0);
+static _Thread_local uint32_t pool_stripe = POOL_STAT_UNSET;
+static pthread_key_t pool_stripe_key;
+static pthread_once_t pool_stripe_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Hand the stripe of an exiting thread back. Its counts stay
+ * in the stripe; the next owner keeps adding to them.
+ * 
+ * @param *value stripe number plus one.
+ */
+static void pool_stripe_release(void *value)
+{
+    uint32_t stripe = (uint32_t)((uintptr_t)value - 1);
+
+    atomic_fetch_and_explicit(&pool_stripes_owned, ~(UINT64_C(1) << stripe),
+                              memory_order_release);
+}
+
+/**
+ * @brief Create the key that releases stripes at thread exit.
+ */
+static void pool_stripe_init(void)
+{
+    if (pthread_key_create(&pool_stripe_key, pool_stripe_release) != 0) {
+        perror("Cannot create thread key");
+        exit(2);
+    }
+}
+
+/**
+ * @brief Claim a stripe for the calling thread. When all of them
+ * are owned, the thread counts in the shared stripe
+ * `POOL_STAT_STRIPES`.
+ * 
+ * @return uint32_t the stripe number.
+ */
+static uint32_t pool_stripe_claim(void)
+{
+    uint64_t owned = atomic_load_explicit(&pool_stripes_owned, memory_order_relaxed);
+
+    pthread_once(&pool_stripe_once, pool_stripe_init);
+    while (~owned != 0) {
+        uint32_t stripe = (uint32_t)__builtin_ctzll(~owned);
+
+        if (atomic_compare_exchange_weak_explicit(&pool_stripes_owned, &owned,
+                                                  owned | (UINT64_C(1) << stripe),
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            pthread_setspecific(pool_stripe_key, (void*)(uintptr_t)(stripe + 1));
+            return stripe;
+        }
+    }
+    return POOL_STAT_STRIPES;
+}
+
+/**
+ * @brief Add `n` to counter `stat` of the calling thread's stripe.
+ * A stripe has a single owner, so it is written with a plain load
+ * and store; only the shared overflow stripe needs an atomic add.
+ * 
+ * @param *pool instance. 
+ * @param stat one of the POOL_STAT_* counters.
+ * @param n amount to add.
+ */
+static inline void pool_count(pool_t *pool, int stat, uint64_t n)
+{
+    if (pool_stripe == POOL_STAT_UNSET) {
+        pool_stripe = pool_stripe_claim();
+    }
+
+    _Atomic uint64_t *count = &pool->stats[pool_stripe].counts[stat];
+
+    if (pool_stripe == POOL_STAT_STRIPES) {
+        atomic_fetch_add_explicit(count, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Read the monotonic clock.
+ * 
+ * @return uint64_t nanoseconds.
+ */
+static uint64_t pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Histogram bucket of a latency.
+ * Below 2^POOL_HIST_SUB_BITS every value has its bucket; above,
+ * each power of two is split in 2^POOL_HIST_SUB_BITS buckets.
+ * 
+ * @param ns latency in nanoseconds.
+ * @return uint32_t bucket index.
+ */
+static uint32_t pool_hist_bucket(uint64_t ns)
+{
+    uint32_t exp;
+
+    if (ns >= (1ull << 36)) {
+        ns = (1ull << 36) - 1;
+    }
+    if (ns < (1u << POOL_HIST_SUB_BITS)) {
+        return (uint32_t)ns;
+    }
+
+    exp = 63 - (uint32_t)__builtin_clzll(ns);
+    return ((exp - POOL_HIST_SUB_BITS + 1) << POOL_HIST_SUB_BITS) |
+           (uint32_t)((ns >> (exp - POOL_HIST_SUB_BITS)) & ((1u << POOL_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * @brief Largest latency that falls in `bucket`.
+ * 
+ * @param bucket bucket index.
+ * @return uint64_t nanoseconds.
+ */
+static uint64_t pool_hist_upper(uint32_t bucket)
+{
+    uint32_t exp, sub;
+
+    if (bucket < (1u << POOL_HIST_SUB_BITS)) {
+        return bucket;
+    }
+
+    exp = (bucket >> POOL_HIST_SUB_BITS) + POOL_HIST_SUB_BITS - 1;
+    sub = bucket & ((1u << POOL_HIST_SUB_BITS) - 1);
+    return ((uint64_t)((1u << POOL_HIST_SUB_BITS) + sub + 1) << (exp - POOL_HIST_SUB_BITS)) - 1;
+}
+
+/**
+ * @brief Record a latency in histogram `hist`.
+ * 
+ * @param *pool instance. 
+ * @param hist one of the POOL_HIST_* histograms.
+ * @param ns latency in nanoseconds.
+ */
+static void pool_record(pool_t *pool, int hist, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&pool->latency[hist * POOL_HIST_BUCKETS + pool_hist_bucket(ns)], 1,
+                              memory_order_relaxed);
+}
+
+/* Events recorded when the library is built with POOL_TRACE. */
+#define POOL_TRACE_SWITCH           0   /* span: a successful switch */
+#define POOL_TRACE_SWITCH_PENDING   1   /* instant: a switch left pending */
+#define POOL_TRACE_STALL            2   /* instant: a read past `max_it` */
+#define POOL_TRACE_READ_RETRY       3   /* instant: a read that raced a switch */
+#define POOL_TRACE_REFILL           4   /* span: claim to publication of a block */
+
+/* Events kept per thread; older ones are overwritten. */
+#define POOL_TRACE_EVENTS           4096
+
+#ifdef POOL_TRACE
+typedef struct _pool_trace_event {
+    uint64_t ts;
+    uint64_t dur;
+    uint32_t type;
+    uint32_t arg;
+} pool_trace_event_t;
+
+/* Written by its thread only. Rings are never freed, so the trace
+ * still holds the events of threads that exited. */
+typedef struct _pool_trace_ring {
+    pool_trace_event_t events[POOL_TRACE_EVENTS];
+    _Atomic uint64_t head;
+    long tid;
+    struct _pool_trace_ring *next;
+} pool_trace_ring_t;
+
+static _Atomic(pool_trace_ring_t*) pool_trace_rings = ATOMIC_VAR_INIT(NULL);
+static _Thread_local pool_trace_ring_t *pool_trace_ring = NULL;
+
+/**
+ * @brief Append an event to the ring of the calling thread,
+ * creating and registering the ring on first use.
+ * 
+ * @param type one of the POOL_TRACE_* events.
+ * @param ts start, in nanoseconds of the monotonic clock.
+ * @param dur duration of span events.
+ * @param arg block number the event is about.
+ */
+static void pool_trace_record(uint32_t type, uint64_t ts, uint64_t dur, uint32_t arg)
+{
+    pool_trace_ring_t *ring = pool_trace_ring;
+
+    if (ring == NULL) {
+        ring = malloc(sizeof(*ring));
+        if (ring == NULL) {
+            perror("Cannot allocate memory!");
+            exit(1);
+        }
+
+        atomic_init(&ring->head, 0);
+        ring->tid = syscall(SYS_gettid);
+        ring->next = atomic_load_explicit(&pool_trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&pool_trace_rings, &ring->next, ring,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+        pool_trace_ring = ring;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    pool_trace_event_t *e = &ring->events[head % POOL_TRACE_EVENTS];
+
+    e->ts = ts;
+    e->dur = dur;
+    e->type = type;
+    e->arg = arg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define POOL_TRACE_EVENT(type, ts, dur, arg) pool_trace_record((type), (ts), (dur), (arg))
+#else
+/* Compiled out: the arguments are not even evaluated. */
+#define POOL_TRACE_EVENT(type, ts, dur, arg) ((void)0)
+#endif
+
+/**
+ * @brief Create a pool object
+ * 
+ * @return pool_t* a heap instance of the pool object.
+ */
+pool_t *create_pool(void)
+{
+    return create_pool_ex(POOL_SIZE, POOL_BLOCKS, POOL_MAX_IT);
+}
+
+/**
+ * @brief Create a pool object with a runtime geometry.
+ * The storage holds `size` elements split into a ring of
+ * `nblocks` blocks of `size / nblocks` elements each.
+ * `current_block` is always the offset of the main block
+ * inside `pool`, so `POOL_BLOCK_A` is still the first block.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * `size` is not a non-zero multiple of `nblocks`.
+ */
+pool_t *create_pool_ex(uint32_t size, uint32_t nblocks, uint32_t max_it)
+{
+    return create_pool_opts(size, nblocks, max_it, NULL);
+}
+
+/**
+ * @brief Allocate a pool object and initialize everything but
+ * its storage and block states, which depend on the backing.
+ * The main block is `POOL_BLOCK_A`.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring.
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @return pool_t* a heap instance of the pool object.
+ */
+static pool_t *pool_new(uint32_t size, uint32_t nblocks, uint32_t max_it)
+{
+    /* sizeof(pool_t) is a multiple of the cache line. */
+    pool_t *p = aligned_alloc(POOL_CACHELINE, sizeof(pool_t));
+    
+    if (p == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    p->pool = NULL;
+    p->size = size;
+    p->nblocks = nblocks;
+    p->block_size = size / nblocks;
+    p->max_it = max_it;
+    p->elem_size = sizeof(uint32_t);
+    p->elem_words = 1;
+    p->block_elems = p->block_size;
+    p->states = NULL;
+    p->mapping = 0;
+    p->numa_node = -1;
+    p->file = NULL;
+    p->fd = -1;
+    p->shm = NULL;
+    p->name = NULL;
+    p->slot = 0;
+    atomic_init(&p->watching, false);
+    p->shared = &p->local;
+
+    p->pins = malloc(nblocks * sizeof(*p->pins));
+
+    if (p->pins == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < nblocks; i++) {
+        atomic_init(&p->pins[i], 0);
+    }
+
+    p->stats = aligned_alloc(POOL_CACHELINE, (POOL_STAT_STRIPES + 1) * sizeof(*p->stats));
+    p->latency = malloc(POOL_HISTS * POOL_HIST_BUCKETS * sizeof(*p->latency));
+    p->refill_started = malloc(nblocks * sizeof(*p->refill_started));
+
+    if (p->stats == NULL || p->latency == NULL || p->refill_started == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i <= POOL_STAT_STRIPES; i++) {
+        for (uint32_t c = 0; c < POOL_STAT_COUNT; c++) {
+            atomic_init(&p->stats[i].counts[c], 0);
+        }
+    }
+    for (uint32_t i = 0; i < POOL_HISTS * POOL_HIST_BUCKETS; i++) {
+        atomic_init(&p->latency[i], 0);
+    }
+    for (uint32_t i = 0; i < nblocks; i++) {
+        atomic_init(&p->refill_started[i], 0);
+    }
+
+    atomic_init(&p->shared->current_block, POOL_BLOCK_A);
+    atomic_init(&p->shared->epoch, 0);
+    atomic_init(&p->shared->switch_pending, false);
+    atomic_init(&p->shared->published, 0);
+    atomic_init(&p->shared->waiters, 0);
+    atomic_init(&p->shared->take, (uint64_t)POOL_BLOCK_A << 32);
+    atomic_init(&p->shared->shard_reads, 0);
+    p->cursor = 0;
+    atomic_init(&p->iterations, 0);
+
+    pthread_mutex_init(&p->shared->lock, NULL);
+    p->service = NULL;
+    p->refill = NULL;
+    p->refill_arg = NULL;
+    p->producer = NULL;
+    p->producer_arg = NULL;
+    p->recycle = true;
+    p->stream = NULL;
+
+    p->policy = POOL_POLICY_COUNT;
+    p->max_age = 0;
+    atomic_init(&p->threshold, max_it);
+    atomic_init(&p->block_started, pool_now());
+    atomic_init(&p->read_cost, 0);
+    atomic_init(&p->refill_cost, 0);
+    atomic_init(&p->low_signaled, false);
+    p->low_water = 0;
+    for (uint32_t i = 0; i < POOL_EVENTS; i++) {
+        atomic_init(&p->events[i], -1);
+    }
+
+    return p;
+}
+
+/**
+ * @brief Fill `opts` with the defaults: heap storage, no
+ * NUMA binding, default alignment, count switch policy,
+ * uint32_t elements.
+ * 
+ * @param *opts options to initialize.
+ */
+void pool_options_init(pool_options_t *opts)
+{
+    opts->backing = POOL_BACKING_HEAP;
+    opts->numa_node = -1;
+    opts->alignment = 0;
+    opts->policy = POOL_POLICY_COUNT;
+    opts->max_age = 0;
+    opts->elem_size = sizeof(uint32_t);
+}
+
+/**
+ * @brief Bind `len` bytes at `addr` to `node`.
+ * Done with the raw system call so that libnuma is not needed.
+ * 
+ * @param *addr page-aligned mapping.
+ * @param len length of the mapping.
+ * @param node NUMA node.
+ * @return int 0 on success, -1 when the kernel refused.
+ */
+static int pool_bind_node(void *addr, size_t len, int node)
+{
+    unsigned long mask[(POOL_MAX_NODES + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))] = {0};
+    const size_t bits = 8 * sizeof(unsigned long);
+
+    if (node < 0 || node >= POOL_MAX_NODES) {
+        return -1;
+    }
+    mask[node / bits] = 1UL << (node % bits);
+
+    return (syscall(SYS_mbind, addr, len, MPOL_BIND, mask, POOL_MAX_NODES + 1, 0) == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Allocate zeroed storage for `p` as described by `opts`.
+ * Heap storage comes from calloc. Mapped storage is anonymous
+ * memory, so it starts on the kernel zero page and is neither
+ * written nor faulted in here. When no huge page is reserved,
+ * POOL_BACKING_HUGETLB falls back to a 2 MiB aligned mapping
+ * with transparent huge pages requested through madvise.
+ * 
+ * @param *p instance being created.
+ * @param *opts storage options.
+ */
+static void pool_alloc_storage(pool_t *p, const pool_options_t *opts)
+{
+    size_t bytes = (size_t)p->size * sizeof(uint32_t);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t align = opts->alignment;
+    size_t len;
+    uint8_t *map;
+
+    if (opts->backing == POOL_BACKING_HEAP && opts->numa_node < 0) {
+        if (align <= sizeof(max_align_t)) {
+            p->pool = calloc(p->size, sizeof(uint32_t));
+        } else {
+            len = (bytes + align - 1) & ~(align - 1);
+            p->pool = aligned_alloc(align, len);
+            if (p->pool != NULL) {
+                memset(p->pool, 0, len);
+            }
+        }
+        if (p->pool == NULL) {
+            perror("Cannot allocate memory!");
+            exit(1);
+        }
+        return;
+    }
+
+    if (opts->backing == POOL_BACKING_HUGETLB) {
+        len = (bytes + POOL_HUGE_PAGE - 1) & ~((size_t)POOL_HUGE_PAGE - 1);
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            p->pool = (uint32_t*)map;
+            p->mapping = len;
+            if (opts->numa_node >= 0 && pool_bind_node(map, len, opts->numa_node) == 0) {
+                p->numa_node = opts->numa_node;
+            }
+            return;
+        }
+        if (align < POOL_HUGE_PAGE) {
+            align = POOL_HUGE_PAGE;
+        }
+    }
+
+    if (align < page) {
+        align = page;
+    }
+    len = (bytes + page - 1) & ~(page - 1);
+
+    /* Over-map by the alignment and trim both ends. */
+    map = mmap(NULL, len + align - page, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    uint8_t *start = (uint8_t*)(((uintptr_t)map + align - 1) & ~((uintptr_t)align - 1));
+
+    if (start != map) {
+        munmap(map, (size_t)(start - map));
+    }
+    if (start + len != map + len + align - page) {
+        munmap(start + len, (size_t)((map + len + align - page) - (start + len)));
+    }
+
+    if (opts->backing == POOL_BACKING_HUGETLB) {
+        madvise(start, len, MADV_HUGEPAGE);
+    }
+    if (opts->numa_node >= 0 && pool_bind_node(start, len, opts->numa_node) == 0) {
+        p->numa_node = opts->numa_node;
+    }
+
+    p->pool = (uint32_t*)start;
+    p->mapping = len;
+}
+
+/**
+ * @brief Check the alignment, policy and element size of `opts`.
+ * An `elem_size` of 0 stands for uint32_t elements.
+ * 
+ * @param *opts options. 
+ * @return bool whether the alignment is 0 or a power of two, the
+ * policy known and complete and the element size usable.
+ */
+static bool pool_options_valid(const pool_options_t *opts)
+{
+    if ((opts->alignment & (opts->alignment - 1)) != 0) {
+        return false;
+    }
+    if (opts->elem_size % sizeof(uint32_t) != 0 || opts->elem_size > POOL_ELEM_MAX) {
+        return false;
+    }
+
+    switch (opts->policy) {
+    case POOL_POLICY_COUNT:
+    case POOL_POLICY_ADAPTIVE:
+        return true;
+    case POOL_POLICY_TIME:
+        return opts->max_age != 0;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Create a pool object with a runtime geometry and
+ * explicit backing storage.
+ * See `create_pool_ex` for the geometry. `opts` selects heap,
+ * anonymous mmap or huge-page storage, its alignment and the
+ * NUMA node it is bound to; a NUMA binding always uses mmap.
+ * Binding is best effort: `numa_node` is -1 in the pool when
+ * the kernel refused it.
+ * 
+ * `policy` decides when readers switch the main block:
+ * POOL_POLICY_COUNT after `max_it` reads; POOL_POLICY_TIME on
+ * the first read once the block is `max_age` ns old; and
+ * POOL_POLICY_ADAPTIVE after a read count derived from the
+ * observed read rate and refill latency, so that the refill
+ * queued by one switch completes shortly before the switch
+ * that needs it. The adaptive count starts at `max_it`.
+ * 
+ * `elem_size` is the size of one element in bytes, a multiple
+ * of 4 up to POOL_ELEM_MAX. `size` counts elements of that
+ * size, which the `pool_*_elem` functions address; the uint32_t
+ * functions, refills and producers keep working on the words.
+ * 
+ * @param size total number of elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage and policy options, or NULL for the defaults.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * `size` is not a non-zero multiple of `nblocks`, `alignment`
+ * is not a power of two, the time policy has no `max_age` or
+ * `elem_size` is invalid.
+ */
+pool_t *create_pool_opts(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                         const pool_options_t *opts)
+{
+    pool_options_t defaults;
+
+    if (opts == NULL) {
+        pool_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    if (nblocks < 2 || size < nblocks || size % nblocks != 0 || !pool_options_valid(opts)) {
+        return NULL;
+    }
+
+    uint32_t words = (opts->elem_size == 0) ? 1 : opts->elem_size / sizeof(uint32_t);
+
+    if ((uint64_t)size * words > UINT32_MAX) {
+        return NULL;
+    }
+
+    pool_t *p = pool_new(size * words, nblocks, max_it);
+
+    p->elem_words = words;
+    p->elem_size = words * sizeof(uint32_t);
+    p->block_elems = p->block_size / words;
+    pool_alloc_storage(p, opts);
+    p->policy = opts->policy;
+    p->max_age = opts->max_age;
+    if (p->policy == POOL_POLICY_TIME) {
+        atomic_store_explicit(&p->threshold, POOL_TIME_STRIDE, memory_order_relaxed);
+    }
+
+    p->states = malloc(nblocks * sizeof(*p->states));
+
+    if (p->states == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    /* The zeroed blocks are valid data, so every standby block
+     * starts READY and the first switch needs no refill. */
+    atomic_init(&p->states[0], POOL_STATE_ACTIVE);
+    for (uint32_t i = 1; i < nblocks; i++) {
+        atomic_init(&p->states[i], POOL_STATE_READY);
+    }
+
+    return p;
+}
+
+/**
+ * @brief Refill callback of producer pools.
+ * 
+ * @param *pool instance.
+ * @param block offset of the claimed block.
+ * @param *arg unused.
+ */
+static void pool_produce(pool_t *pool, uint32_t block, void *arg)
+{
+    (void)arg;
+    pool->producer(pool->pool + block, pool->block_size, pool->producer_arg);
+}
+
+/**
+ * @brief Turn a pool into a producer pool.
+ * A fresh pool has its main block produced here and every
+ * other block queued. A warm pool (reopened from a file) keeps
+ * its blocks and only gets its STALE ones queued.
+ * 
+ * @param *p instance, nothing consumed yet.
+ * @param *service refill service running the producer.
+ * @param producer block producer.
+ * @param *arg argument handed to `producer`.
+ * @param fresh whether the blocks hold no produced data yet.
+ */
+static void pool_attach_producer(pool_t *p, pool_service_t *service,
+                                 pool_producer_fn producer, void *arg, bool fresh)
+{
+    uint32_t current = atomic_load_explicit(&p->shared->current_block, memory_order_relaxed);
+
+    p->producer = producer;
+    p->producer_arg = arg;
+    p->recycle = false;
+    if (fresh) {
+        producer(p->pool + current, p->block_size, arg);
+    }
+
+    pool_set_refill(p, service, &pool_produce, NULL);
+    for (uint32_t i = 0; i < p->nblocks; i++) {
+        if (i * p->block_size == current) {
+            continue;
+        }
+        if (fresh) {
+            atomic_store_explicit(&p->states[i], POOL_STATE_STALE, memory_order_release);
+        }
+        if (atomic_load_explicit(&p->states[i], memory_order_acquire) == POOL_STATE_STALE) {
+            pool_service_submit(service, p, &pool_produce, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Create a pool object whose blocks are written
+ * by `producer`.
+ * The main block is produced before this function returns
+ * and every other block is queued on `service`. A block is
+ * only eligible for a switch once the producer has run on
+ * it: STALE blocks are never recycled, and a switch that
+ * finds no READY block is left pending until the next one
+ * is published.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *service refill service running the producer.
+ * @param producer block producer.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid or `service` is NULL.
+ */
+pool_t *create_pool_producer(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                             pool_service_t *service, pool_producer_fn producer, void *arg)
+{
+    return create_pool_producer_opts(size, nblocks, max_it, NULL, service, producer, arg);
+}
+
+/**
+ * @brief Create a producer pool with explicit options.
+ * Same as `create_pool_producer`, with the storage and switch
+ * policy of `create_pool_opts`. Producer pools are where the
+ * adaptive policy pays off: it learns the producer latency.
+ * 
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage and policy options, or NULL for the defaults.
+ * @param *service refill service running the producer.
+ * @param producer block producer.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry or options are invalid or `service` is NULL.
+ */
+pool_t *create_pool_producer_opts(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                                  const pool_options_t *opts, pool_service_t *service,
+                                  pool_producer_fn producer, void *arg)
+{
+    if (service == NULL || producer == NULL) {
+        return NULL;
+    }
+
+    pool_t *p = create_pool_opts(size, nblocks, max_it, opts);
+
+    if (p != NULL) {
+        pool_attach_producer(p, service, producer, arg, true);
+    }
+
+    return p;
+}
+
+/**
+ * @brief Wake the refill thread of a shared-memory pool, or the
+ * threads of a stream, which wait on `epoch`. Does nothing for
+ * other pools.
+ * 
+ * @param *pool instance. 
+ */
+static void pool_shared_wake(pool_t *pool)
+{
+    if (pool->shm != NULL) {
+        syscall(SYS_futex, &pool->shared->epoch, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    } else if (pool->stream != NULL) {
+        syscall(SYS_futex, &pool->shared->epoch, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+                NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Take the segment lock of a shared-memory pool.
+ * A process that died holding it left the attacher table
+ * consistent, since the table is only updated with single
+ * stores, so the lock is simply marked consistent again.
+ * 
+ * @param *pool instance. 
+ */
+static void pool_shared_lock(pool_t *pool)
+{
+    if (pthread_mutex_lock(&pool->shared->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&pool->shared->lock);
+    }
+}
+
+/**
+ * @brief Detach from a shared-memory pool and unmap it.
+ * The owner also stops its refill thread and removes the
+ * segment name; attached processes keep their mapping.
+ * 
+ * @param *pool instance. 
+ */
+static void pool_shared_detach(pool_t *pool)
+{
+    if (atomic_exchange_explicit(&pool->watching, false, memory_order_acq_rel)) {
+        pool_shared_wake(pool);
+        pthread_join(pool->watcher, NULL);
+    }
+
+    pool_shared_lock(pool);
+    for (uint32_t i = 0; i < pool->nblocks; i++) {
+        atomic_store_explicit(&pool->pins[i], 0, memory_order_release);
+    }
+    pool->shm->slots[pool->slot] = 0;
+    pthread_mutex_unlock(&pool->shared->lock);
+
+    munmap(pool->shm, pool->mapping);
+    if (pool->name != NULL) {
+        shm_unlink(pool->name);
+        free(pool->name);
+    }
+}
+
+/**
+ * @brief Deallocate the metadata `pool_new` allocated, then
+ * the pool object itself. The storage must be released first.
+ * 
+ * @param *pool instance. 
+ */
+static void pool_free(pool_t *pool)
+{
+    pthread_mutex_destroy(&pool->local.lock);
+    free(pool->stats);
+    free(pool->latency);
+    free(pool->refill_started);
+    for (uint32_t i = 0; i < POOL_EVENTS; i++) {
+        if (pool->events[i] >= 0) {
+            close(pool->events[i]);
+        }
+    }
+    free(pool);
+}
+
+/**
+ * @brief Deallocate and destroy the pool object.
+ * 
+ * @param *pool instance. 
+ */
+void destroy_pool(pool_t *pool) {
+    if (pool != NULL) {
+        if (pool->shm != NULL) {
+            pool_shared_detach(pool);
+        } else if (pool->file != NULL) {
+            free(pool->pins);
+            pool_sync(pool);
+            munmap(pool->file, pool->mapping);
+            close(pool->fd);
+        } else if (pool->mapping != 0) {
+            free(pool->pins);
+            free(pool->states);
+            munmap(pool->pool, pool->mapping);
+        } else {
+            free(pool->pins);
+            free(pool->states);
+            free(pool->pool);
+        }
+        pool_free(pool);
+        pool = NULL;
+    }
+}
+
+/**
+ * @brief Fill the entire pool with the `value`.
+ * Avoid use this function since it's not thread-safe.
+ * Prefer using `pool_fill_area` instead.
+ * 
+ * @param *pool instance 
+ * @param value value to be filled
+ */
+void pool_fill(pool_t *pool, uint32_t value)
+{
+    pool_fill_words(pool->pool, value, pool->size);
+}
+
+/**
+ * @brief Fill an specific area of the pool with `value`.
+ * Use this with care, since it may not be thread-safe
+ * depending of the `index` and the `offset`.
+ * 
+ * @param *pool instance 
+ * @param value value to fill
+ * @param index initial index position
+ * @param offset length of position
+ */
+void pool_fill_area(pool_t *pool, uint32_t value, uint32_t index, uint32_t offset)
+{
+    pool_fill_words(pool->pool + index, value, offset);
+}
+
+/**
+ * @brief Insert `value` in the pool using its own cursor.
+ * This function is thread-safe, since the cursor always point
+ * to the main block.
+ * 
+ * @param *pool instance of pool.
+ * @param value uint32_t value to be inserted.
+ */
+void pool_insert(pool_t *pool, uint32_t value)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    pool->pool[pool->cursor + block] = value;
+    pool->cursor = (pool->cursor + 1) % pool->block_size;
+    pool_count(pool, POOL_STAT_INSERTS, 1);
+}
+
+/**
+ * @brief Write `count` words at the cursor of the main block,
+ * wrapping around it, and advance the cursor past them.
+ * 
+ * @param *pool instance of pool.
+ * @param *values words to be written.
+ * @param count number of words.
+ */
+static void pool_store_cursor(pool_t *pool, const uint32_t *values, uint32_t count)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    if (count > pool->block_size) {
+        /* Only the last `block_size` values survive the wrap. */
+        values += count - pool->block_size;
+        pool->cursor = (pool->cursor + count - pool->block_size) % pool->block_size;
+        count = pool->block_size;
+    }
+
+    pool_copy_wrapped(pool, block, pool->cursor, (uint32_t*)values, count, true);
+    pool->cursor = (pool->cursor + count) % pool->block_size;
+}
+
+/**
+ * @brief Insert `count` values in the pool using its own cursor.
+ * Equivalent to `count` calls to `pool_insert`, wrapping around
+ * the main block, with a single cursor update.
+ * 
+ * @param *pool instance of pool.
+ * @param *values values to be inserted.
+ * @param count number of values.
+ */
+void pool_insert_many(pool_t *pool, const uint32_t *values, uint32_t count)
+{
+    pool_store_cursor(pool, values, count);
+    pool_count(pool, POOL_STAT_INSERTS, count);
+}
+
+/**
+ * @brief Insert `value` in the pool at `index` position.
+ * This function is thread-safe since the index is translated
+ * to the main block.
+ * 
+ * @param *pool instance. 
+ * @param value uint32_t value to be inserted.
+ * @param index position on the pool.
+ */
+void pool_insert_at(pool_t *pool, uint32_t value, uint32_t index)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    pool->pool[(index % pool->block_size) + block] = value;
+    pool_count(pool, POOL_STAT_INSERTS, 1);
+}
+
+/**
+ * @brief Add 1 to the eventfd of `event`, if it was created.
+ * The eventfd is non-blocking: a signal lost to a full counter
+ * leaves the fd readable anyway.
+ * 
+ * @param *pool instance. 
+ * @param event one of the POOL_EVENT_* events.
+ */
+static void pool_event_signal(pool_t *pool, int event)
+{
+    int fd = atomic_load_explicit(&pool->events[event], memory_order_acquire);
+
+    if (fd >= 0) {
+        (void)eventfd_write(fd, 1);
+    }
+}
+
+/**
+ * @brief Signal POOL_EVENT_LOW_WATER, once per main block.
+ * 
+ * @param *pool instance. 
+ */
+static void pool_low_water(pool_t *pool)
+{
+    if (!atomic_load_explicit(&pool->low_signaled, memory_order_relaxed) &&
+        !atomic_exchange_explicit(&pool->low_signaled, true, memory_order_relaxed)) {
+        pool_event_signal(pool, POOL_EVENT_LOW_WATER);
+    }
+}
+
+/**
+ * @brief Time policy: switch once the main block is `max_age`
+ * old, otherwise look at the clock again POOL_TIME_STRIDE reads
+ * later.
+ * 
+ * @param *pool instance. 
+ * @param reads reads made on the main block.
+ * @return bool whether the main block must be switched.
+ */
+static bool pool_time_due(pool_t *pool, uint32_t reads)
+{
+    uint64_t age = pool_now() - atomic_load_explicit(&pool->block_started, memory_order_relaxed);
+
+    if (age >= pool->max_age) {
+        if (pool->low_water != 0) {
+            pool_low_water(pool);
+        }
+        return true;
+    }
+
+    atomic_store_explicit(&pool->threshold, reads + POOL_TIME_STRIDE, memory_order_relaxed);
+    return false;
+}
+
+/**
+ * @brief Ask the switch policy whether the main block must be
+ * switched after `reads` reads on it.
+ * The count policy compares with `max_it`, which may be changed
+ * at any time; the other policies keep their own `threshold`.
+ * 
+ * @param *pool instance. 
+ * @param reads reads made on the main block.
+ * @return bool whether the main block must be switched.
+ */
+static inline bool pool_switch_due(pool_t *pool, uint32_t reads)
+{
+    uint32_t threshold;
+
+    if (pool->policy == POOL_POLICY_COUNT) {
+        if (pool->low_water != 0 && (uint64_t)reads + pool->low_water >= pool->max_it) {
+            pool_low_water(pool);
+        }
+        return reads >= pool->max_it;
+    }
+
+    threshold = atomic_load_explicit(&pool->threshold, memory_order_relaxed);
+    if (pool->low_water != 0 && pool->policy == POOL_POLICY_ADAPTIVE &&
+        (uint64_t)reads + pool->low_water >= threshold) {
+        pool_low_water(pool);
+    }
+    if (reads < threshold) {
+        return false;
+    }
+    return pool->policy != POOL_POLICY_TIME || pool_time_due(pool, reads);
+}
+
+/**
+ * @brief Read the value at `index` of the main block.
+ * 
+ * @param *pool instance. 
+ * @param index position.
+ * @return uint32_t value at index.
+ */
+static uint32_t pool_read(pool_t *pool, uint32_t index)
+{
+    index %= pool->block_size;
+
+    /* Seqlock-style read: a block can only be refilled after it
+     * stopped being the main block, and every switch bumps `epoch`
+     * before the old block becomes STALE. If `epoch` moved while we
+     * were reading, the value may come from a block under refill,
+     * so read again from the block that replaced it, until no
+     * switch raced the read. */
+    for (;;) {
+        uint32_t epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+        uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+        uint32_t value = pool->pool[index + block];
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&pool->shared->epoch, memory_order_relaxed) == epoch) {
+            pool_count(pool, POOL_STAT_GETS, 1);
+            return value;
+        }
+        pool_count(pool, POOL_STAT_READ_RETRIES, 1);
+        POOL_TRACE_EVENT(POOL_TRACE_READ_RETRY, pool_now(), 0, block / pool->block_size);
+    }
+}
+
+/**
+ * @brief Count `count` reads of the unsharded API.
+ * The counter is reset by whichever thread switches, a refill
+ * worker included, so it is atomic. Readers still load and
+ * store it instead of paying for a locked add: a concurrent
+ * increment may be lost, as before.
+ * 
+ * @param *pool instance. 
+ * @param count number of reads.
+ * @return uint32_t reads of the main block so far.
+ */
+static inline uint32_t pool_count_reads(pool_t *pool, uint32_t count)
+{
+    uint32_t reads = atomic_load_explicit(&pool->iterations, memory_order_relaxed) + count;
+
+    atomic_store_explicit(&pool->iterations, reads, memory_order_relaxed);
+    return reads;
+}
+
+/**
+ * @brief Retrieve the value at `index` position.
+ * This function is thread-safe since the index is translated
+ * to a valid main block position. It is recommended to use
+ * this function instead of accessing the pool object directly
+ * since it may lead to inconsistent values.
+ * 
+ * @param *pool instance. 
+ * @param index position.
+ * @return uint32_t retrieves the value at index.
+ */
+uint32_t pool_get(pool_t *pool, uint32_t index)
+{
+    uint32_t reads = pool_count_reads(pool, 1);
+
+    if (pool_switch_due(pool, reads) && pool_switch_block_s(pool) != 0) {
+        pool_count(pool, POOL_STAT_EXHAUSTED_READS, 1);
+        POOL_TRACE_EVENT(POOL_TRACE_STALL, pool_now(), 0, reads);
+    }
+
+    return pool_read(pool, index);
+}
+
+/**
+ * @brief Copy `count` words of the main block, starting at
+ * `index` and wrapping around the block, into `out`. The copy
+ * is retried until no switch raced it, so `out` never mixes
+ * values of two blocks.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first word inside the block.
+ * @param *out destination buffer.
+ * @param count number of words.
+ */
+static void pool_load_wrapped(pool_t *pool, uint32_t index, uint32_t *out, uint32_t count)
+{
+    for (;;) {
+        uint32_t epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+        uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+        pool_copy_wrapped(pool, block, index, out, count, false);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&pool->shared->epoch, memory_order_relaxed) == epoch) {
+            return;
+        }
+        pool_count(pool, POOL_STAT_READ_RETRIES, 1);
+        POOL_TRACE_EVENT(POOL_TRACE_READ_RETRY, pool_now(), 0, block / pool->block_size);
+    }
+}
+
+/**
+ * @brief Copy `count` consecutive values of the main block,
+ * starting at `index` and wrapping around the block, into `out`.
+ * The whole batch counts as `count` reads but the switch check
+ * is done once, before the copy. Like `pool_get`, the copy is
+ * retried until no switch raced it, so `out` never mixes
+ * values of two blocks.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first value.
+ * @param *out destination buffer.
+ * @param count number of values.
+ */
+void pool_get_many(pool_t *pool, uint32_t index, uint32_t *out, uint32_t count)
+{
+    uint32_t reads = pool_count_reads(pool, count);
+
+    if (pool_switch_due(pool, reads) && pool_switch_block_s(pool) != 0) {
+        pool_count(pool, POOL_STAT_EXHAUSTED_READS, count);
+        POOL_TRACE_EVENT(POOL_TRACE_STALL, pool_now(), 0, reads);
+    }
+    pool_count(pool, POOL_STAT_GETS, count);
+    pool_load_wrapped(pool, index % pool->block_size, out, count);
+}
+
+/**
+ * @brief Copy the element at `index` of the main block to `out`.
+ * Same as `pool_get` for pools of any `elem_size`: one read,
+ * retried until no switch raced it. Elements of 4, 8, 16
+ * and 64 bytes are copied with fixed-size moves.
+ * 
+ * @param *pool instance. 
+ * @param index element position.
+ * @param *out destination of `elem_size` bytes.
+ */
+void pool_get_elem(pool_t *pool, uint32_t index, void *out)
+{
+    uint32_t words = pool->elem_words;
+
+    uint32_t reads = pool_count_reads(pool, 1);
+
+    if (pool_switch_due(pool, reads) && pool_switch_block_s(pool) != 0) {
+        pool_count(pool, POOL_STAT_EXHAUSTED_READS, 1);
+        POOL_TRACE_EVENT(POOL_TRACE_STALL, pool_now(), 0, reads);
+    }
+
+    index = (index % pool->block_elems) * words;
+
+    for (;;) {
+        uint32_t epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+        uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+        pool_elem_copy(out, pool->pool + block + index, words);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&pool->shared->epoch, memory_order_relaxed) == epoch) {
+            break;
+        }
+        pool_count(pool, POOL_STAT_READ_RETRIES, 1);
+        POOL_TRACE_EVENT(POOL_TRACE_READ_RETRY, pool_now(), 0, block / pool->block_size);
+    }
+
+    pool_count(pool, POOL_STAT_GETS, 1);
+}
+
+/**
+ * @brief Copy `count` consecutive elements of the main block,
+ * starting at `index` and wrapping around the block, into `out`.
+ * Same as `pool_get_many` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first element.
+ * @param *out destination of `count * elem_size` bytes.
+ * @param count number of elements.
+ */
+void pool_get_elems(pool_t *pool, uint32_t index, void *out, uint32_t count)
+{
+    uint32_t reads = pool_count_reads(pool, count);
+
+    if (pool_switch_due(pool, reads) && pool_switch_block_s(pool) != 0) {
+        pool_count(pool, POOL_STAT_EXHAUSTED_READS, count);
+        POOL_TRACE_EVENT(POOL_TRACE_STALL, pool_now(), 0, reads);
+    }
+    pool_count(pool, POOL_STAT_GETS, count);
+    pool_load_wrapped(pool, (index % pool->block_elems) * pool->elem_words, (uint32_t*)out,
+                      count * pool->elem_words);
+}
+
+/**
+ * @brief Insert the element at `value` using the pool cursor.
+ * Same as `pool_insert` for pools of any `elem_size`; do not
+ * mix it with the uint32_t insertions, which move the cursor
+ * by one word.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ */
+void pool_insert_elem(pool_t *pool, const void *value)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    pool_elem_copy(pool->pool + pool->cursor + block, value, pool->elem_words);
+    pool->cursor = (pool->cursor + pool->elem_words) % pool->block_size;
+    pool_count(pool, POOL_STAT_INSERTS, 1);
+}
+
+/**
+ * @brief Insert `count` elements using the pool cursor.
+ * Same as `pool_insert_many` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param *values `count` elements of `elem_size` bytes.
+ * @param count number of elements.
+ */
+void pool_insert_elems(pool_t *pool, const void *values, uint32_t count)
+{
+    pool_store_cursor(pool, (const uint32_t*)values, count * pool->elem_words);
+    pool_count(pool, POOL_STAT_INSERTS, count);
+}
+
+/**
+ * @brief Insert the element at `value` at `index` position.
+ * Same as `pool_insert_at` for pools of any `elem_size`.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ * @param index element position.
+ */
+void pool_insert_elem_at(pool_t *pool, const void *value, uint32_t index)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    pool_elem_copy(pool->pool + (index % pool->block_elems) * pool->elem_words + block, value,
+                   pool->elem_words);
+    pool_count(pool, POOL_STAT_INSERTS, 1);
+}
+
+/**
+ * @brief Fill the entire pool with copies of the element at
+ * `value`. Like `pool_fill`, this function is not thread-safe.
+ * 
+ * @param *pool instance. 
+ * @param *value element of `elem_size` bytes.
+ */
+void pool_fill_elem(pool_t *pool, const void *value)
+{
+    pool_fill_pattern(pool->pool, (const uint32_t*)value, pool->elem_words, pool->size);
+}
+
+/**
+ * @brief Switches the main block of pool to the next
+ * block of the ring.
+ * This function is not thread-safe. It is not
+ * possible to guarantee that some thread is performing
+ * any operation based on the main block.
+ * 
+ * It is highly recommended to use pool_switch_block_s
+ * instead.
+ * 
+ * This function always succeed.
+ * 
+ * @param *pool instance. 
+ */
+int pool_switch_block(pool_t *pool)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_relaxed);
+    uint32_t next = pool_next_block(pool, block);
+
+    atomic_store_explicit(&pool->states[next / pool->block_size], POOL_STATE_ACTIVE, memory_order_relaxed);
+    atomic_store_explicit(&pool->shared->current_block, next, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->shared->epoch, 1, memory_order_relaxed);
+    atomic_store_explicit(&pool->states[block / pool->block_size], POOL_STATE_STALE, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * @brief Find the block a switch away from `block` should use.
+ * The first READY block in ring order wins, otherwise the first
+ * STALE one is recycled when `recycle` is set. FILLING blocks
+ * belong to a writer and are never switched to.
+ * 
+ * @param *pool instance. 
+ * @param block offset of the main block.
+ * @param recycle whether a STALE block may be used.
+ * @param *state receives the state the candidate was seen in.
+ * @return uint32_t offset of the candidate, or `block` when there is none.
+ */
+static uint32_t pool_find_standby(pool_t *pool, uint32_t block, bool recycle, uint32_t *state)
+{
+    uint32_t candidate = block;
+
+    for (uint32_t next = pool_next_block(pool, block); next != block;
+         next = pool_next_block(pool, next)) {
+        uint32_t seen = atomic_load_explicit(&pool->states[next / pool->block_size],
+                                             memory_order_seq_cst);
+
+        if (seen == POOL_STATE_READY) {
+            *state = seen;
+            return next;
+        }
+        if (seen == POOL_STATE_STALE && candidate == block && recycle) {
+            candidate = next;
+            *state = seen;
+        }
+    }
+    return candidate;
+}
+
+/**
+ * @brief Check whether a span still reads block number `n`.
+ * The pins of a shared-memory pool are summed over every
+ * attacher slot.
+ * 
+ * @param *pool instance. 
+ * @param n block number.
+ * @return bool whether the block is pinned.
+ */
+static bool pool_pinned(pool_t *pool, uint32_t n)
+{
+    if (pool->shm == NULL) {
+        return atomic_load_explicit(&pool->pins[n], memory_order_seq_cst) != 0;
+    }
+
+    atomic_uint *pins = (atomic_uint*)((uint8_t*)pool->shm + pool->shm->pins_offset);
+
+    for (uint32_t slot = 0; slot < POOL_SHM_SLOTS; slot++) {
+        if (atomic_load_explicit(&pins[slot * pool->nblocks + n], memory_order_seq_cst) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Start the policy period of a new main block.
+ * The adaptive policy folds the read cost of the block that was
+ * just left into its average and sets the next threshold so that
+ * reading `nblocks - 1` blocks takes 25% longer than a refill:
+ * the block refilled after this switch is then ready just before
+ * a switch needs it.
+ * 
+ * @param *pool instance. 
+ * @param reads reads made on the block that was left.
+ */
+static void pool_policy_switched(pool_t *pool, uint32_t reads)
+{
+    uint64_t now = pool_now();
+    uint64_t age = now - atomic_exchange_explicit(&pool->block_started, now, memory_order_relaxed);
+    uint64_t read_cost, refill_cost, threshold;
+
+    if (pool->policy == POOL_POLICY_TIME) {
+        atomic_store_explicit(&pool->threshold, POOL_TIME_STRIDE, memory_order_relaxed);
+        return;
+    }
+    if (pool->policy != POOL_POLICY_ADAPTIVE || reads == 0) {
+        return;
+    }
+
+    read_cost = atomic_load_explicit(&pool->read_cost, memory_order_relaxed);
+    read_cost = (read_cost == 0) ? (age << 8) / reads : (read_cost * 7 + (age << 8) / reads) / 8;
+    atomic_store_explicit(&pool->read_cost, read_cost, memory_order_relaxed);
+
+    refill_cost = atomic_load_explicit(&pool->refill_cost, memory_order_relaxed);
+    if (read_cost == 0 || refill_cost == 0) {
+        return;
+    }
+
+    threshold = ((refill_cost << 8) / read_cost) * 5 / 4 / (pool->nblocks - 1);
+    if (threshold < pool->max_it / POOL_ADAPTIVE_RANGE) {
+        threshold = pool->max_it / POOL_ADAPTIVE_RANGE;
+    }
+    if (threshold > (uint64_t)pool->max_it * POOL_ADAPTIVE_RANGE) {
+        threshold = (uint64_t)pool->max_it * POOL_ADAPTIVE_RANGE;
+    }
+    if (threshold == 0) {
+        threshold = 1;
+    }
+    atomic_store_explicit(&pool->threshold, (uint32_t)threshold, memory_order_relaxed);
+}
+
+/**
+ * @brief Make `candidate` the main block in place of `block`.
+ * 
+ * @param *pool instance. 
+ * @param block offset of the main block.
+ * @param candidate offset returned by `pool_find_standby`.
+ * @param expected state `candidate` was seen in.
+ * @return int 0 when switched, 1 when another thread switched
+ * away from `block` first, -1 when a writer claimed `candidate`.
+ */
+static int pool_switch_from(pool_t *pool, uint32_t block, uint32_t candidate, uint32_t expected)
+{
+    if (!atomic_compare_exchange_strong_explicit(&pool->states[candidate / pool->block_size],
+                                                 &expected, POOL_STATE_ACTIVE,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        return -1;
+    }
+
+    if (!atomic_compare_exchange_strong_explicit(&pool->shared->current_block, &block, candidate,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        /* Another thread switched the main block in the meantime,
+         * which is what we were asked for. Give the candidate back. */
+        atomic_store_explicit(&pool->states[candidate / pool->block_size], expected,
+                              memory_order_release);
+        return 1;
+    }
+
+    /* A file-backed pool records the new main block before the
+     * old one can be claimed, so the file never names a block
+     * that is being refilled. */
+    if (pool->file != NULL) {
+        atomic_store_explicit(&pool->file->current_block, candidate, memory_order_release);
+        atomic_fetch_add_explicit(&pool->file->generation, 1, memory_order_relaxed);
+    }
+
+    /* The epoch must move before the old block becomes claimable,
+     * so that readers still on it notice the switch. */
+    atomic_fetch_add_explicit(&pool->shared->epoch, 1, memory_order_seq_cst);
+    atomic_store_explicit(&pool->states[block / pool->block_size], POOL_STATE_STALE,
+                          memory_order_seq_cst);
+    atomic_store_explicit(&pool->shared->switch_pending, false, memory_order_relaxed);
+    pool_policy_switched(pool, atomic_exchange_explicit(&pool->iterations, 0, memory_order_relaxed) +
+                         atomic_exchange_explicit(&pool->shared->shard_reads, 0, memory_order_relaxed));
+    atomic_store_explicit(&pool->low_signaled, false, memory_order_relaxed);
+    pool_count(pool, POOL_STAT_SWITCHES, 1);
+
+    if (pool->service != NULL) {
+        pool_service_submit(pool->service, pool, pool->refill, pool->refill_arg);
+    }
+    pool_shared_wake(pool);
+    return 0;
+}
+
+/**
+ * @brief Swtiches the main block of pool to the next
+ * block of the ring.
+ * This function is thread-safe. The next READY block
+ * is preferred; when there is none, the next STALE block
+ * is recycled, except in producer pools. The main block
+ * is replaced in a single atomic step and `epoch` is
+ * bumped, so readers that raced the switch retry once on
+ * the new block.
+ * 
+ * When no other block is eligible, the switch is
+ * recorded as pending and the function returns -1; the
+ * pending switch is then performed by `pool_refill_end`.
+ * This function returns 0 when the block was switched.
+ * 
+ * @param *pool instance. 
+ */
+int pool_switch_block_s(pool_t *pool)
+{
+    uint64_t start = pool_now();
+
+    for (;;) {
+        uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+        uint32_t expected;
+        uint32_t candidate = pool_find_standby(pool, block, pool->recycle, &expected);
+
+        if (candidate == block) {
+            /* Every standby block is being refilled. Remember the
+             * request so the next `pool_refill_end` performs it, then
+             * look once more in case that publication already ran. A
+             * producer pool also asks for one more refill, in case a
+             * job was lost to a full service queue. */
+            if (!atomic_exchange_explicit(&pool->shared->switch_pending, true, memory_order_seq_cst) &&
+                !pool->recycle) {
+                if (pool->service != NULL) {
+                    pool_service_submit(pool->service, pool, pool->refill, pool->refill_arg);
+                }
+                pool_shared_wake(pool);
+            }
+            if (pool_find_standby(pool, block, pool->recycle, &expected) == block ||
+                !atomic_exchange_explicit(&pool->shared->switch_pending, false, memory_order_seq_cst)) {
+                pool_count(pool, POOL_STAT_SWITCH_PENDING, 1);
+                POOL_TRACE_EVENT(POOL_TRACE_SWITCH_PENDING, pool_now(), 0, block / pool->block_size);
+                return -1;
+            }
+            continue;
+        }
+
+        int switched = pool_switch_from(pool, block, candidate, expected);
+
+        if (switched != 0) {
+            pool_count(pool, POOL_STAT_SWITCH_RACES, 1);
+        }
+        if (switched >= 0) {
+            uint64_t end = pool_now();
+
+            pool_record(pool, POOL_HIST_SWITCH, end - start);
+            POOL_TRACE_EVENT(POOL_TRACE_SWITCH, start, end - start, candidate / pool->block_size);
+            return 0;
+        }
+        /* A writer claimed the candidate first; look again. */
+    }
+}
+
+/**
+ * @brief Switch the main block, waiting for a standby block
+ * when every one of them is being refilled.
+ * The caller is parked on a futex until `pool_refill_end`
+ * publishes a block, instead of polling `pool_switch_block_s`.
+ * The wait ends as soon as the main block differs from the
+ * one seen on entry, whoever switched it.
+ * 
+ * @param *pool instance. 
+ * @return int 0 once the main block was switched.
+ */
+int pool_switch_block_wait(pool_t *pool)
+{
+    return pool_switch_block_timedwait(pool, NULL);
+}
+
+/**
+ * @brief Same as `pool_switch_block_wait`, giving up at
+ * `abstime`.
+ * After a timeout the switch stays pending, as after
+ * `pool_switch_block_s`, and the next publication performs it.
+ * 
+ * @param *pool instance. 
+ * @param *abstime absolute CLOCK_MONOTONIC deadline, or NULL
+ * to wait without a deadline.
+ * @return int 0 once the main block was switched, -1 when
+ * `abstime` passed first.
+ */
+int pool_switch_block_timedwait(pool_t *pool, const struct timespec *abstime)
+{
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+    int op = FUTEX_WAIT_BITSET | ((pool->shm == NULL) ? FUTEX_PRIVATE_FLAG : 0);
+
+    for (;;) {
+        uint32_t published = atomic_load_explicit(&pool->shared->published, memory_order_seq_cst);
+        long ret;
+
+        /* A failed switch is left pending, so the publication that
+         * wakes us may already have switched on our behalf. */
+        if (atomic_load_explicit(&pool->shared->current_block, memory_order_acquire) != block ||
+            pool_switch_block_s(pool) == 0) {
+            return 0;
+        }
+
+        atomic_fetch_add_explicit(&pool->shared->waiters, 1, memory_order_seq_cst);
+        ret = syscall(SYS_futex, &pool->shared->published, op, published, abstime, NULL,
+                      FUTEX_BITSET_MATCH_ANY);
+        atomic_fetch_sub_explicit(&pool->shared->waiters, 1, memory_order_relaxed);
+
+        if (ret != 0 && errno == ETIMEDOUT) {
+            return (atomic_load_explicit(&pool->shared->current_block, memory_order_acquire) != block) ? 0 : -1;
+        }
+    }
+}
+
+/**
+ * @brief Claim a standby block for refill.
+ * The claimed block is FILLING until `pool_refill_end`
+ * publishes it: it is never made the main block and no
+ * other writer can claim it. The caller may write the
+ * `pool->block_size` elements starting at `*block`.
+ * 
+ * @param *pool instance. 
+ * @param *block receives the offset of the claimed block.
+ * @return int 0 on success, -1 when no unpinned STALE block is available.
+ */
+int pool_refill_begin(pool_t *pool, uint32_t *block)
+{
+    uint32_t current = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    /* Start right after the main block: in ring order that is the
+     * block which has been STALE the longest. */
+    for (uint32_t next = pool_next_block(pool, current); next != current;
+         next = pool_next_block(pool, next)) {
+        uint32_t expected = POOL_STATE_STALE;
+
+        if (!atomic_compare_exchange_strong_explicit(&pool->states[next / pool->block_size],
+                                                     &expected, POOL_STATE_FILLING,
+                                                     memory_order_seq_cst, memory_order_acquire)) {
+            continue;
+        }
+
+        /* A span may still be reading the block; `pool_release`
+         * queues the refill again once the last pin is gone. */
+        if (pool_pinned(pool, next / pool->block_size)) {
+            atomic_store_explicit(&pool->states[next / pool->block_size], POOL_STATE_STALE,
+                                  memory_order_release);
+            continue;
+        }
+
+        atomic_store_explicit(&pool->refill_started[next / pool->block_size], pool_now(),
+                              memory_order_relaxed);
+        *block = next;
+        return 0;
+    }
+
+    pool_count(pool, POOL_STAT_REFILL_MISSES, 1);
+    return -1;
+}
+
+/**
+ * @brief Publish a block claimed with `pool_refill_begin`.
+ * The block becomes READY and is the preferred target of
+ * the next switch. A switch left pending by
+ * `pool_switch_block_s` is performed here.
+ * 
+ * @param *pool instance. 
+ * @param block offset returned by `pool_refill_begin`.
+ */
+void pool_refill_end(pool_t *pool, uint32_t block)
+{
+    uint64_t started = atomic_load_explicit(&pool->refill_started[block / pool->block_size],
+                                            memory_order_relaxed);
+    uint64_t end = pool_now();
+
+    uint64_t cost = atomic_load_explicit(&pool->refill_cost, memory_order_relaxed);
+
+    pool_record(pool, POOL_HIST_REFILL, end - started);
+    pool_count(pool, POOL_STAT_REFILLS, 1);
+    atomic_store_explicit(&pool->refill_cost,
+                          (cost == 0) ? end - started : (cost * 7 + (end - started)) / 8,
+                          memory_order_relaxed);
+    POOL_TRACE_EVENT(POOL_TRACE_REFILL, started, end - started, block / pool->block_size);
+
+    atomic_store_explicit(&pool->states[block / pool->block_size], POOL_STATE_READY,
+                          memory_order_seq_cst);
+    if (pool->file != NULL) {
+        atomic_fetch_add_explicit(&pool->file->generation, 1, memory_order_relaxed);
+    }
+
+    if (atomic_exchange_explicit(&pool->shared->switch_pending, false, memory_order_seq_cst)) {
+        pool_switch_block_s(pool);
+    }
+
+    /* Waiters register before sleeping on `published`, so either
+     * they see the new count or we see them. */
+    atomic_fetch_add_explicit(&pool->shared->published, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->shared->waiters, memory_order_seq_cst) != 0) {
+        syscall(SYS_futex, &pool->shared->published,
+                FUTEX_WAKE | ((pool->shm == NULL) ? FUTEX_PRIVATE_FLAG : 0), INT_MAX, NULL, NULL, 0);
+    }
+    pool_event_signal(pool, POOL_EVENT_PUBLISH);
+}
+
+/**
+ * @brief Retrieve the offset of the block that follows
+ * `block` in the ring.
+ * 
+ * @param *pool instance. 
+ * @param block offset of a block.
+ * @return uint32_t offset of the next block.
+ */
+uint32_t pool_next_block(pool_t *pool, uint32_t block)
+{
+    block += pool->block_size;
+    return (block >= pool->size) ? POOL_BLOCK_A : block;
+}
+
+/**
+ * @brief Set the pool cursor to `new_cursor`.
+ * 
+ * @param *pool instance. 
+ * @param new_cursor new cursor position.
+ */
+void pool_set_cursor(pool_t *pool, uint32_t new_cursor)
+{
+    pool->cursor = new_cursor % pool->block_size;
+}
+
+/**
+ * @brief Body of a refill service worker.
+ * Parks on `wake` until a job is queued, runs it outside
+ * the service lock and goes back to sleep.
+ * 
+ * @param *args service instance.
+ */
+static void *pool_service_worker(void *args)
+{
+    pool_service_t *service = (pool_service_t*)args;
+    pool_refill_job_t job;
+    uint32_t block;
+
+    pthread_mutex_lock(&service->lock);
+    for (;;) {
+        while (service->count == 0 && !service->stopping) {
+            pthread_cond_wait(&service->wake, &service->lock);
+        }
+        if (service->count == 0) {
+            break;
+        }
+
+        job = service->jobs[service->head];
+        service->head = (service->head + 1) % service->capacity;
+        service->count--;
+        service->busy++;
+        pthread_mutex_unlock(&service->lock);
+
+        if (pool_refill_begin(job.pool, &block) == 0) {
+            job.fn(job.pool, block, job.arg);
+            pool_refill_end(job.pool, block);
+        }
+
+        pthread_mutex_lock(&service->lock);
+        service->busy--;
+        if (service->count == 0 && service->busy == 0) {
+            pthread_cond_broadcast(&service->idle);
+        }
+    }
+    pthread_mutex_unlock(&service->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Create a refill service.
+ * `nworkers` long-lived threads are parked on a condition
+ * variable and woken whenever a refill job is queued. A
+ * single service may refill any number of pools.
+ * 
+ * @param nworkers number of worker threads.
+ * @param capacity maximum number of queued jobs.
+ * @return pool_service_t* a heap instance of the service, or
+ * NULL when `nworkers` or `capacity` is zero.
+ */
+pool_service_t *create_pool_service(uint32_t nworkers, uint32_t capacity)
+{
+    if (nworkers == 0 || capacity == 0) {
+        return NULL;
+    }
+
+    pool_service_t *s = malloc(sizeof(pool_service_t));
+
+    if (s == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    s->workers = malloc(nworkers * sizeof(pthread_t));
+    s->jobs = malloc(capacity * sizeof(pool_refill_job_t));
+
+    if (s->workers == NULL || s->jobs == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    s->nworkers = nworkers;
+    s->capacity = capacity;
+    s->head = 0;
+    s->count = 0;
+    s->busy = 0;
+    s->stopping = false;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->idle, NULL);
+
+    for (uint32_t i = 0; i < nworkers; i++) {
+        if (pthread_create(&s->workers[i], NULL, &pool_service_worker, s)) {
+            perror("Cannot create thread");
+            exit(2);
+        }
+    }
+
+    return s;
+}
+
+/**
+ * @brief Run every queued job, stop the workers and
+ * deallocate the service.
+ * Destroy the service before the pools it refills.
+ * 
+ * @param *service instance. 
+ */
+void destroy_pool_service(pool_service_t *service)
+{
+    if (service != NULL) {
+        pthread_mutex_lock(&service->lock);
+        service->stopping = true;
+        pthread_cond_broadcast(&service->wake);
+        pthread_mutex_unlock(&service->lock);
+
+        for (uint32_t i = 0; i < service->nworkers; i++) {
+            pthread_join(service->workers[i], NULL);
+        }
+
+        pthread_cond_destroy(&service->idle);
+        pthread_cond_destroy(&service->wake);
+        pthread_mutex_destroy(&service->lock);
+        free(service->jobs);
+        free(service->workers);
+        free(service);
+    }
+}
+
+/**
+ * @brief Queue a refill of `pool`.
+ * A worker claims a STALE block with `pool_refill_begin`,
+ * runs `fn` on it and publishes it with `pool_refill_end`.
+ * The job is dropped when the pool has no STALE block.
+ * 
+ * @param *service instance. 
+ * @param *pool pool to refill.
+ * @param fn refill callback.
+ * @param *arg argument handed to `fn`.
+ * @return int 0 when queued, -1 when the queue is full.
+ */
+int pool_service_submit(pool_service_t *service, pool_t *pool, pool_refill_fn fn, void *arg)
+{
+    pthread_mutex_lock(&service->lock);
+    if (service->count == service->capacity || service->stopping) {
+        pthread_mutex_unlock(&service->lock);
+        return -1;
+    }
+
+    service->jobs[(service->head + service->count) % service->capacity] =
+        (pool_refill_job_t){.pool = pool, .fn = fn, .arg = arg};
+    service->count++;
+    pthread_cond_signal(&service->wake);
+    pthread_mutex_unlock(&service->lock);
+
+    return 0;
+}
+
+/**
+ * @brief Wait until the queue is empty and no worker
+ * is running a job.
+ * 
+ * @param *service instance. 
+ */
+void pool_service_drain(pool_service_t *service)
+{
+    pthread_mutex_lock(&service->lock);
+    while (service->count != 0 || service->busy != 0) {
+        pthread_cond_wait(&service->idle, &service->lock);
+    }
+    pthread_mutex_unlock(&service->lock);
+}
+
+/**
+ * @brief Attach `pool` to a refill service.
+ * From now on every successful switch queues a refill of
+ * the block it made STALE. Pass a NULL `service` to detach.
+ * 
+ * @param *pool instance. 
+ * @param *service refill service, or NULL.
+ * @param fn refill callback.
+ * @param *arg argument handed to `fn`.
+ */
+void pool_set_refill(pool_t *pool, pool_service_t *service, pool_refill_fn fn, void *arg)
+{
+    pool->refill = fn;
+    pool->refill_arg = arg;
+    pool->service = service;
+}
+
+/**
+ * @brief Drop one pin of `block`. When the last pin of a STALE
+ * block is dropped, its refill is queued on the pool service.
+ * 
+ * @param *pool instance. 
+ * @param block offset of the pinned block.
+ */
+static void pool_unpin(pool_t *pool, uint32_t block)
+{
+    uint32_t n = block / pool->block_size;
+
+    if (atomic_fetch_sub_explicit(&pool->pins[n], 1, memory_order_seq_cst) == 1 &&
+        atomic_load_explicit(&pool->states[n], memory_order_acquire) == POOL_STATE_STALE) {
+        if (pool->service != NULL) {
+            pool_service_submit(pool->service, pool, pool->refill, pool->refill_arg);
+        }
+        pool_shared_wake(pool);
+    }
+}
+
+/**
+ * @brief Reserve up to `count` contiguous values of the main
+ * block, starting at `index`, for reading in place.
+ * The span never wraps, so it is shortened at the end of the
+ * block. Until `pool_release` the block is pinned: it may stop
+ * being the main block, but it is never claimed for refill.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first value.
+ * @param count number of values wanted.
+ * @param *span receives the pointer, length and block.
+ * @return uint32_t number of values reserved.
+ */
+uint32_t pool_reserve(pool_t *pool, uint32_t index, uint32_t count, pool_span_t *span)
+{
+    uint32_t block;
+
+    index %= pool->block_size;
+    if (count > pool->block_size - index) {
+        count = pool->block_size - index;
+    }
+
+    /* Pin, then make sure the block is still the main one. If it
+     * is, any later refill claim will see the pin. */
+    for (;;) {
+        block = atomic_load_explicit(&pool->shared->current_block, memory_order_seq_cst);
+        atomic_fetch_add_explicit(&pool->pins[block / pool->block_size], 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&pool->shared->current_block, memory_order_seq_cst) == block) {
+            break;
+        }
+        atomic_fetch_sub_explicit(&pool->pins[block / pool->block_size], 1, memory_order_release);
+    }
+
+    span->data = pool->pool + block + index;
+    span->length = count;
+    span->block = block;
+
+    return count;
+}
+
+/**
+ * @brief Release a span obtained from `pool_reserve`.
+ * The span is accounted as `length` reads of the main block.
+ * When the last pin of a STALE block is dropped, its refill
+ * is queued on the pool service.
+ * 
+ * @param *pool instance. 
+ * @param *span span to be released.
+ */
+void pool_release(pool_t *pool, pool_span_t *span)
+{
+    pool_unpin(pool, span->block);
+
+    uint32_t reads = pool_count_reads(pool, span->length);
+
+    pool_count(pool, POOL_STAT_GETS, span->length);
+    span->data = NULL;
+    span->length = 0;
+
+    if (pool_switch_due(pool, reads)) {
+        pool_switch_block_s(pool);
+    }
+}
+
+/**
+ * @brief Move the take cursor off the exhausted `block`.
+ * Only READY blocks are taken over, since a recycled block
+ * would hand out its values a second time.
+ * 
+ * @param *pool instance. 
+ * @param block offset of the exhausted block.
+ * @return int 0 when the cursor moved (here or in another
+ * thread), -1 when no READY block is available.
+ */
+static int pool_take_advance(pool_t *pool, uint32_t block)
+{
+    for (;;) {
+        uint32_t expected;
+        uint32_t candidate;
+        int switched;
+
+        if ((uint32_t)(atomic_load_explicit(&pool->shared->take, memory_order_acquire) >> 32) != block) {
+            return 0;
+        }
+
+        candidate = pool_find_standby(pool, block, false, &expected);
+        if (candidate == block) {
+            return -1;
+        }
+
+        switched = pool_switch_from(pool, block, candidate, expected);
+        if (switched == 0) {
+            atomic_store_explicit(&pool->shared->take, (uint64_t)candidate << 32, memory_order_release);
+            return 0;
+        }
+        if (switched == 1) {
+            /* The winner is about to publish its cursor. */
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Take up to `count` values, each handed out at most once.
+ * Slots of the main block are claimed with a compare-and-swap
+ * on a word holding the block and the slot. Once the
+ * block is exhausted, the cursor moves to the next READY block;
+ * consumed blocks are refilled through the pool service.
+ * 
+ * Take pools must be consumed through `pool_take` and
+ * `pool_take_many` only: `pool_get` and the switch functions
+ * would move the main block behind the take cursor.
+ * 
+ * @param *pool instance. 
+ * @param *out destination buffer.
+ * @param count number of values wanted.
+ * @return uint32_t number of values taken, smaller than `count`
+ * when every fresh block has been consumed.
+ */
+uint32_t pool_take_many(pool_t *pool, uint32_t *out, uint32_t count)
+{
+    uint32_t taken = 0;
+
+    while (taken < count) {
+        uint64_t t = atomic_load_explicit(&pool->shared->take, memory_order_acquire);
+        uint32_t block = (uint32_t)(t >> 32);
+        uint32_t slot = (uint32_t)t;
+        uint32_t want = count - taken;
+
+        if (slot >= pool->block_size) {
+            if (pool_take_advance(pool, block) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        /* Never claim past the slots left in the block: the CAS
+         * checks them in the same step, so the slot half of `take`
+         * cannot carry into the block half, and a claim racing an
+         * advance fails and is retried on the new block. */
+        if (want > pool->block_size - slot) {
+            want = pool->block_size - slot;
+        }
+
+        /* Pin before claiming: the block can only be refilled after
+         * it is exhausted, which is after our claim, so the refill
+         * will see the pin. */
+        atomic_fetch_add_explicit(&pool->pins[block / pool->block_size], 1, memory_order_seq_cst);
+        if (atomic_compare_exchange_strong_explicit(&pool->shared->take, &t, t + want,
+                                                    memory_order_seq_cst, memory_order_relaxed)) {
+            memcpy(out + taken, pool->pool + block + slot, want * sizeof(uint32_t));
+            taken += want;
+        }
+        pool_unpin(pool, block);
+    }
+
+    pool_count(pool, POOL_STAT_TAKES, taken);
+    return taken;
+}
+
+/**
+ * @brief Take one value, handed out at most once.
+ * See `pool_take_many`.
+ * 
+ * @param *pool instance. 
+ * @param *value receives the value.
+ * @return int 0 on success, -1 when every fresh block has been consumed.
+ */
+int pool_take(pool_t *pool, uint32_t *value)
+{
+    return (pool_take_many(pool, value, 1) == 1) ? 0 : -1;
+}
+
+/**
+ * @brief Register a per-thread shard of `pool`.
+ * A shard carries its own cursor and iteration counter on
+ * its own cache line, so readers do not write shared state on
+ * every call. Reads are flushed to `shard_reads` in batches of
+ * `max_it / POOL_SHARD_FLUSH`, and the main block is switched
+ * once the flushed total reaches `max_it`.
+ * 
+ * @param *pool instance. 
+ * @return pool_shard_t* a heap instance of the shard.
+ */
+pool_shard_t *pool_shard_register(pool_t *pool)
+{
+    pool_shard_t *shard = aligned_alloc(POOL_CACHELINE, sizeof(pool_shard_t));
+
+    if (shard == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    shard->pool = pool;
+    shard->cursor = 0;
+    shard->iterations = 0;
+    shard->quota = pool->max_it / POOL_SHARD_FLUSH;
+    if (shard->quota == 0) {
+        shard->quota = 1;
+    }
+
+    return shard;
+}
+
+/**
+ * @brief Add the reads counted by `shard` to the pool total and
+ * switch the main block once the total reaches `max_it`.
+ * 
+ * @param *shard instance. 
+ */
+static void pool_shard_flush(pool_shard_t *shard)
+{
+    pool_t *pool = shard->pool;
+    uint32_t reads = shard->iterations;
+    uint32_t total = atomic_fetch_add_explicit(&pool->shared->shard_reads, reads,
+                                               memory_order_relaxed) + reads;
+
+    shard->iterations = 0;
+    if (pool_switch_due(pool, total) && pool_switch_block_s(pool) != 0) {
+        pool_count(pool, POOL_STAT_EXHAUSTED_READS, reads);
+        POOL_TRACE_EVENT(POOL_TRACE_STALL, pool_now(), 0, total);
+    }
+}
+
+/**
+ * @brief Flush the reads of `shard` and deallocate it.
+ * 
+ * @param *shard instance. 
+ */
+void pool_shard_unregister(pool_shard_t *shard)
+{
+    if (shard != NULL) {
+        pool_shard_flush(shard);
+        free(shard);
+    }
+}
+
+/**
+ * @brief Retrieve the value at `index` position through a shard.
+ * Same as `pool_get`, with the iteration counter kept in the shard.
+ * 
+ * @param *shard instance. 
+ * @param index position.
+ * @return uint32_t retrieves the value at index.
+ */
+uint32_t pool_shard_get(pool_shard_t *shard, uint32_t index)
+{
+    if (++shard->iterations >= shard->quota) {
+        pool_shard_flush(shard);
+    }
+
+    return pool_read(shard->pool, index);
+}
+
+/**
+ * @brief Insert `value` at the shard cursor.
+ * Shards do not share their cursor; threads that insert
+ * should give each shard its own range with
+ * `pool_shard_set_cursor`.
+ * 
+ * @param *shard instance. 
+ * @param value uint32_t value to be inserted.
+ */
+void pool_shard_insert(pool_shard_t *shard, uint32_t value)
+{
+    pool_t *pool = shard->pool;
+    uint32_t block = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
+
+    pool->pool[shard->cursor + block] = value;
+    shard->cursor = (shard->cursor + 1) % pool->block_size;
+    pool_count(pool, POOL_STAT_INSERTS, 1);
+}
+
+/**
+ * @brief Set the shard cursor to `new_cursor`.
+ * 
+ * @param *shard instance. 
+ * @param new_cursor new cursor position.
+ */
+void pool_shard_set_cursor(pool_shard_t *shard, uint32_t new_cursor)
+{
+    shard->cursor = new_cursor % shard->pool->block_size;
+}
+
+/**
+ * @brief Number of NUMA node ids on this machine, read from
+ * sysfs. Machines without NUMA report a single node.
+ * 
+ * @return uint32_t highest online node id plus one.
+ */
+static uint32_t pool_numa_nodes(void)
+{
+    FILE *online = fopen("/sys/devices/system/node/online", "r");
+    uint32_t nodes = 1;
+    unsigned int first, last;
+    int c;
+
+    if (online == NULL) {
+        return 1;
+    }
+
+    /* The list looks like "0", "0-3" or "0,2-3". */
+    while (fscanf(online, "%u", &first) == 1) {
+        last = first;
+        c = fgetc(online);
+        if (c == '-' && fscanf(online, "%u", &last) == 1) {
+            c = fgetc(online);
+        }
+        if (last + 1 > nodes) {
+            nodes = last + 1;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(online);
+
+    return (nodes > POOL_MAX_NODES) ? POOL_MAX_NODES : nodes;
+}
+
+/**
+ * @brief Create one pool per NUMA node.
+ * Each replica has its storage bound to its node and, when a
+ * producer is given, is refilled on its own so consumers read a
+ * local copy. `opts` is used for every replica with `numa_node`
+ * replaced by the replica node.
+ * 
+ * @param size total number of uint32_t elements of each replica.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *opts storage options, or NULL for anonymous mmap.
+ * @param *service refill service, or NULL for plain pools.
+ * @param producer block producer, or NULL for plain pools.
+ * @param *arg argument handed to `producer`.
+ * @return pool_replicas_t* a heap instance, or NULL when the
+ * geometry is invalid.
+ */
+pool_replicas_t *create_pool_replicas(uint32_t size, uint32_t nblocks, uint32_t max_it,
+                                      const pool_options_t *opts, pool_service_t *service,
+                                      pool_producer_fn producer, void *arg)
+{
+    pool_options_t node_opts;
+
+    if (nblocks < 2 || size < nblocks || size % nblocks != 0 ||
+        (opts != NULL && !pool_options_valid(opts))) {
+        return NULL;
+    }
+
+    if (opts != NULL) {
+        node_opts = *opts;
+    } else {
+        pool_options_init(&node_opts);
+        node_opts.backing = POOL_BACKING_MMAP;
+    }
+
+    pool_replicas_t *r = malloc(sizeof(pool_replicas_t));
+
+    if (r == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    r->nnodes = pool_numa_nodes();
+    r->pools = malloc(r->nnodes * sizeof(pool_t*));
+
+    if (r->pools == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < r->nnodes; i++) {
+        node_opts.numa_node = (int)i;
+        r->pools[i] = create_pool_opts(size, nblocks, max_it, &node_opts);
+        if (service != NULL && producer != NULL) {
+            pool_attach_producer(r->pools[i], service, producer, arg, true);
+        }
+    }
+
+    return r;
+}
+
+/**
+ * @brief Deallocate every replica.
+ * Destroy the refill service first when the replicas have a producer.
+ * 
+ * @param *replicas instance.
+ */
+void destroy_pool_replicas(pool_replicas_t *replicas)
+{
+    if (replicas != NULL) {
+        for (uint32_t i = 0; i < replicas->nnodes; i++) {
+            destroy_pool(replicas->pools[i]);
+        }
+        free(replicas->pools);
+        free(replicas);
+    }
+}
+
+/**
+ * @brief Retrieve the replica of the NUMA node the calling
+ * thread is running on.
+ * 
+ * @param *replicas instance.
+ * @return pool_t* the local replica.
+ */
+pool_t *pool_replica_local(pool_replicas_t *replicas)
+{
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        node = 0;
+    }
+
+    return replicas->pools[node % replicas->nnodes];
+}
+
+/**
+ * @brief Create a pool object stored in the file at `path`,
+ * or reopen it with its blocks and metadata intact.
+ * The file starts with a versioned `pool_file_header_t`
+ * holding the geometry, `current_block`, `cursor`, a
+ * `generation` bumped on every switch and publication, and
+ * the block states; the block storage follows, page aligned.
+ * A new file is sparse, so its blocks start zeroed and READY.
+ * 
+ * On reopen the file is trusted as follows: the block named by
+ * `current_block` is the main block, which the library never
+ * writes, and any other block left ACTIVE or FILLING by a crash
+ * is STALE. READY and STALE blocks are kept as they are.
+ * 
+ * @param *path file backing the pool.
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param *service refill service, or NULL for a plain pool.
+ * @param producer block producer, or NULL for a plain pool.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid, the file cannot be mapped or it holds
+ * a pool of another version or geometry.
+ */
+pool_t *create_pool_mapped(const char *path, uint32_t size, uint32_t nblocks, uint32_t max_it,
+                           pool_service_t *service, pool_producer_fn producer, void *arg)
+{
+    struct stat st;
+    pool_file_header_t *hdr;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t data_offset, total;
+    bool fresh;
+    int fd;
+
+    if (nblocks < 2 || size < nblocks || size % nblocks != 0) {
+        return NULL;
+    }
+
+    data_offset = (sizeof(pool_file_header_t) + nblocks * sizeof(uint32_t) + page - 1) & ~(page - 1);
+    total = data_offset + (size_t)size * sizeof(uint32_t);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    fresh = (st.st_size == 0);
+    if ((fresh && ftruncate(fd, (off_t)total) != 0) ||
+        (!fresh && (size_t)st.st_size != total)) {
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    /* The magic is written last, so a file whose creation was
+     * interrupted is simply initialized again. */
+    if (hdr->magic == 0) {
+        fresh = true;
+    }
+
+    if (fresh) {
+        hdr->version = POOL_FILE_VERSION;
+        hdr->size = size;
+        hdr->nblocks = nblocks;
+        hdr->data_offset = (uint32_t)data_offset;
+        hdr->cursor = 0;
+        atomic_store_explicit(&hdr->current_block, POOL_BLOCK_A, memory_order_relaxed);
+        atomic_store_explicit(&hdr->generation, 0, memory_order_relaxed);
+        atomic_store_explicit(&hdr->states[0], POOL_STATE_ACTIVE, memory_order_relaxed);
+        for (uint32_t i = 1; i < nblocks; i++) {
+            atomic_store_explicit(&hdr->states[i], POOL_STATE_READY, memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_release);
+        hdr->magic = POOL_FILE_MAGIC;
+    } else {
+        uint32_t current = atomic_load_explicit(&hdr->current_block, memory_order_relaxed);
+
+        if (hdr->magic != POOL_FILE_MAGIC || hdr->version != POOL_FILE_VERSION ||
+            hdr->size != size || hdr->nblocks != nblocks || hdr->data_offset != data_offset ||
+            current >= size || current % (size / nblocks) != 0) {
+            munmap(hdr, total);
+            close(fd);
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < nblocks; i++) {
+            uint32_t state = atomic_load_explicit(&hdr->states[i], memory_order_relaxed);
+
+            if (i * (size / nblocks) == current) {
+                state = POOL_STATE_ACTIVE;
+            } else if (state != POOL_STATE_READY) {
+                state = POOL_STATE_STALE;
+            }
+            atomic_store_explicit(&hdr->states[i], state, memory_order_relaxed);
+        }
+    }
+
+    pool_t *p = pool_new(size, nblocks, max_it);
+
+    p->pool = (uint32_t*)((uint8_t*)hdr + data_offset);
+    p->states = hdr->states;
+    p->file = hdr;
+    p->fd = fd;
+    p->mapping = total;
+    p->cursor = hdr->cursor % p->block_size;
+    atomic_store_explicit(&p->shared->current_block, hdr->current_block, memory_order_relaxed);
+    atomic_store_explicit(&p->shared->take, (uint64_t)hdr->current_block << 32, memory_order_relaxed);
+
+    if (service != NULL && producer != NULL) {
+        pool_attach_producer(p, service, producer, arg, fresh);
+    }
+
+    return p;
+}
+
+/**
+ * @brief Write the cursor and main block of a file-backed
+ * pool to its header and flush the whole file to disk.
+ * Without it, blocks survive a process restart but not a
+ * power loss. `destroy_pool` calls it.
+ * 
+ * @param *pool instance. 
+ * @return int 0 on success, -1 when the pool is not
+ * file-backed or the flush failed.
+ */
+int pool_sync(pool_t *pool)
+{
+    if (pool->file == NULL) {
+        return -1;
+    }
+
+    pool->file->cursor = pool->cursor;
+    atomic_store_explicit(&pool->file->current_block,
+                          atomic_load_explicit(&pool->shared->current_block, memory_order_acquire),
+                          memory_order_release);
+
+    return (msync(pool->file, pool->mapping, MS_SYNC) == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Check whether the segment `name` was left behind
+ * by an owner that died without `destroy_pool`.
+ * 
+ * @param *name segment name.
+ * @return bool whether the segment may be replaced.
+ */
+static bool pool_shm_abandoned(const char *name)
+{
+    struct stat st;
+    pool_shm_header_t *hdr;
+    bool abandoned = false;
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(pool_shm_header_t)) {
+        hdr = mmap(NULL, sizeof(pool_shm_header_t), PROT_READ, MAP_SHARED, fd, 0);
+        if (hdr != MAP_FAILED) {
+            abandoned = hdr->magic == POOL_SHM_MAGIC && hdr->slots[0] != 0 &&
+                        kill(hdr->slots[0], 0) != 0 && errno == ESRCH;
+            munmap(hdr, sizeof(pool_shm_header_t));
+        }
+    }
+    close(fd);
+
+    return abandoned;
+}
+
+/**
+ * @brief Refill thread of a producer-fed shared-memory pool.
+ * It runs the producer on every STALE block, then sleeps until
+ * a switch bumps `epoch` or a pin is dropped. The timeout bounds
+ * how long the slots of crashed consumers stay unreaped.
+ * 
+ * @param *args pool_t instance.
+ */
+static void *pool_shared_watcher(void *args)
+{
+    pool_t *pool = (pool_t*)args;
+    struct timespec timeout = { 0, 100 * 1000 * 1000 };
+    uint32_t block;
+
+    while (atomic_load_explicit(&pool->watching, memory_order_acquire)) {
+        unsigned int epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+
+        pool_shared_reap(pool);
+        while (pool_refill_begin(pool, &block) == 0) {
+            pool->producer(pool->pool + block, pool->block_size, pool->producer_arg);
+            pool_refill_end(pool, block);
+        }
+        syscall(SYS_futex, &pool->shared->epoch, FUTEX_WAIT, epoch, &timeout, NULL, 0);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Create a pool object in the shared-memory segment
+ * `name`, to be attached to by other processes with
+ * `pool_attach`.
+ * Every process reads and switches the same blocks: the
+ * block states, the main block and the take cursor live in
+ * the segment and are only touched with lock-free atomics.
+ * The segment lock is a process-shared robust mutex guarding
+ * the table of attached processes.
+ * 
+ * With a `producer`, the calling process feeds every attached
+ * consumer: a refill thread waits on the switch epoch, runs
+ * the producer on each STALE block and reaps the slots of
+ * crashed consumers. Attached processes then never recycle
+ * STALE blocks, as in `create_pool_producer`.
+ * 
+ * A segment left behind by a crashed owner is replaced.
+ * 
+ * @param *name segment name, as for `shm_open`.
+ * @param size total number of uint32_t elements.
+ * @param nblocks number of blocks in the ring (at least 2).
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @param producer block producer, or NULL for a plain pool.
+ * @param *arg argument handed to `producer`.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the geometry is invalid or the segment exists or cannot be created.
+ */
+pool_t *create_pool_shared(const char *name, uint32_t size, uint32_t nblocks, uint32_t max_it,
+                           pool_producer_fn producer, void *arg)
+{
+    pthread_mutexattr_t attr;
+    pool_shm_header_t *hdr;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pins_offset, data_offset, total;
+    int fd;
+
+    if (name == NULL || nblocks < 2 || size < nblocks || size % nblocks != 0) {
+        return NULL;
+    }
+
+    pins_offset = (sizeof(pool_shm_header_t) + nblocks * sizeof(uint32_t) + POOL_CACHELINE - 1) &
+                  ~(size_t)(POOL_CACHELINE - 1);
+    data_offset = (pins_offset + (size_t)POOL_SHM_SLOTS * nblocks * sizeof(atomic_uint) + page - 1) &
+                  ~(page - 1);
+    total = data_offset + (size_t)size * sizeof(uint32_t);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST && pool_shm_abandoned(name)) {
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)total) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /* The segment starts zeroed: no slot is taken and no block is
+     * pinned. */
+    hdr->version = POOL_SHM_VERSION;
+    hdr->size = size;
+    hdr->nblocks = nblocks;
+    hdr->states_offset = sizeof(pool_shm_header_t);
+    hdr->pins_offset = (uint32_t)pins_offset;
+    hdr->data_offset = (uint32_t)data_offset;
+    hdr->produced = (producer != NULL);
+    hdr->slots[0] = getpid();
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr->shared.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    atomic_init(&hdr->shared.current_block, POOL_BLOCK_A);
+    atomic_init(&hdr->shared.epoch, 0);
+    atomic_init(&hdr->shared.switch_pending, false);
+    atomic_init(&hdr->shared.published, 0);
+    atomic_init(&hdr->shared.waiters, 0);
+    atomic_init(&hdr->shared.take, (uint64_t)POOL_BLOCK_A << 32);
+    atomic_init(&hdr->shared.shard_reads, 0);
+
+    pool_t *p = pool_new(size, nblocks, max_it);
+
+    free(p->pins);
+    p->pool = (uint32_t*)((uint8_t*)hdr + data_offset);
+    p->states = (_Atomic uint32_t*)((uint8_t*)hdr + hdr->states_offset);
+    p->pins = (atomic_uint*)((uint8_t*)hdr + pins_offset);
+    p->shared = &hdr->shared;
+    p->shm = hdr;
+    p->mapping = total;
+    p->name = strdup(name);
+
+    if (p->name == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    atomic_init(&p->states[0], POOL_STATE_ACTIVE);
+    for (uint32_t i = 1; i < nblocks; i++) {
+        atomic_init(&p->states[i], (producer != NULL) ? POOL_STATE_STALE : POOL_STATE_READY);
+    }
+
+    if (producer != NULL) {
+        p->producer = producer;
+        p->producer_arg = arg;
+        p->recycle = false;
+        producer(p->pool, p->block_size, arg);
+    }
+
+    /* The magic is written last, so `pool_attach` never sees a
+     * half initialized segment. */
+    atomic_thread_fence(memory_order_release);
+    hdr->magic = POOL_SHM_MAGIC;
+
+    if (producer != NULL) {
+        atomic_store_explicit(&p->watching, true, memory_order_release);
+        if (pthread_create(&p->watcher, NULL, &pool_shared_watcher, p)) {
+            perror("Cannot create thread");
+            exit(2);
+        }
+    }
+
+    return p;
+}
+
+/**
+ * @brief Take a free slot of the attacher table for the
+ * calling process.
+ * 
+ * @param *pool instance. 
+ * @return int 0 on success, -1 when the table is full.
+ */
+static int pool_shared_claim(pool_t *pool)
+{
+    int ret = -1;
+
+    pool_shared_lock(pool);
+    for (uint32_t slot = 1; slot < POOL_SHM_SLOTS; slot++) {
+        if (pool->shm->slots[slot] == 0) {
+            pool->shm->slots[slot] = getpid();
+            pool->slot = slot;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->shared->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Attach to the pool created by `create_pool_shared`
+ * under `name`.
+ * The attached pool shares the blocks, their states and the
+ * main block with every other process; its cursor and read
+ * counter are its own. `destroy_pool` detaches it.
+ * 
+ * @param *name segment name.
+ * @param max_it reads on the main block before `pool_get` switches it.
+ * @return pool_t* a heap instance of the pool object, or NULL when
+ * the segment does not exist, holds a pool of another version or
+ * has no free slot.
+ */
+pool_t *pool_attach(const char *name, uint32_t max_it)
+{
+    struct stat st;
+    pool_shm_header_t *hdr;
+    int fd;
+
+    if (name == NULL) {
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(pool_shm_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* The header is not trusted: the geometry must be valid for
+     * `pool_new` and every array must lie inside the mapping. */
+    if (hdr->magic != POOL_SHM_MAGIC || hdr->version != POOL_SHM_VERSION ||
+        hdr->nblocks < 2 || hdr->size < hdr->nblocks || hdr->size % hdr->nblocks != 0 ||
+        hdr->data_offset + (size_t)hdr->size * sizeof(uint32_t) != (size_t)st.st_size ||
+        hdr->states_offset + (size_t)hdr->nblocks * sizeof(uint32_t) > (size_t)st.st_size ||
+        hdr->pins_offset + (size_t)POOL_SHM_SLOTS * hdr->nblocks * sizeof(atomic_uint) >
+        (size_t)st.st_size) {
+        munmap(hdr, (size_t)st.st_size);
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    pool_t *p = pool_new(hdr->size, hdr->nblocks, max_it);
+
+    free(p->pins);
+    p->pool = (uint32_t*)((uint8_t*)hdr + hdr->data_offset);
+    p->states = (_Atomic uint32_t*)((uint8_t*)hdr + hdr->states_offset);
+    p->shared = &hdr->shared;
+    p->shm = hdr;
+    p->mapping = (size_t)st.st_size;
+    p->recycle = !hdr->produced;
+
+    if (pool_shared_claim(p) != 0 && (pool_shared_reap(p) <= 0 || pool_shared_claim(p) != 0)) {
+        pool_free(p);
+        munmap(hdr, (size_t)st.st_size);
+        return NULL;
+    }
+
+    p->pins = (atomic_uint*)((uint8_t*)hdr + hdr->pins_offset) + p->slot * p->nblocks;
+    p->cursor = 0;
+
+    return p;
+}
+
+/**
+ * @brief Release the slots of attached processes that
+ * exited without `destroy_pool`.
+ * Their pins are dropped, so the blocks they were reading
+ * can be refilled again. Producer-fed pools do this in their
+ * refill thread; `pool_attach` does it when the table is full.
+ * 
+ * @param *pool a shared-memory pool.
+ * @return int number of slots released, or -1 when the pool
+ * is not in shared memory.
+ */
+int pool_shared_reap(pool_t *pool)
+{
+    atomic_uint *pins;
+    int reaped = 0;
+
+    if (pool->shm == NULL) {
+        return -1;
+    }
+
+    pins = (atomic_uint*)((uint8_t*)pool->shm + pool->shm->pins_offset);
+
+    pool_shared_lock(pool);
+    for (uint32_t slot = 1; slot < POOL_SHM_SLOTS; slot++) {
+        pid_t pid = pool->shm->slots[slot];
+
+        if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < pool->nblocks; i++) {
+            atomic_store_explicit(&pins[slot * pool->nblocks + i], 0, memory_order_release);
+        }
+        pool->shm->slots[slot] = 0;
+        reaped++;
+    }
+    pthread_mutex_unlock(&pool->shared->lock);
+
+    if (reaped > 0) {
+        pool_shared_wake(pool);
+    }
+
+    return reaped;
+}
+
+/**
+ * @brief Aggregate the statistics of `pool` into `stats`.
+ * Counters are kept in cache-line stripes, one per thread, that
+ * only their owner writes and this function sums; latencies are
+ * in shared histograms. All are updated with relaxed atomics, so
+ * readers are never stopped: the snapshot is exact per counter
+ * but not a single cut across counters. Statistics
+ * are per process, also for shared-memory pools.
+ * 
+ * @param *pool instance. 
+ * @param *stats receives the counters and histograms.
+ */
+void pool_stats_snapshot(pool_t *pool, pool_stats_t *stats)
+{
+    for (uint32_t c = 0; c < POOL_STAT_COUNT; c++) {
+        stats->counts[c] = 0;
+        for (uint32_t i = 0; i <= POOL_STAT_STRIPES; i++) {
+            stats->counts[c] += atomic_load_explicit(&pool->stats[i].counts[c], memory_order_relaxed);
+        }
+    }
+
+    for (uint32_t h = 0; h < POOL_HISTS; h++) {
+        for (uint32_t b = 0; b < POOL_HIST_BUCKETS; b++) {
+            stats->latency[h][b] = atomic_load_explicit(&pool->latency[h * POOL_HIST_BUCKETS + b],
+                                                        memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Estimate a latency quantile from a snapshot.
+ * 
+ * @param *stats snapshot taken with `pool_stats_snapshot`.
+ * @param hist one of the POOL_HIST_* histograms.
+ * @param q quantile, between 0 and 1 (0.99 for p99).
+ * @return uint64_t upper bound of the bucket holding the quantile,
+ * in nanoseconds, or 0 when the histogram is empty.
+ */
+uint64_t pool_stats_percentile(const pool_stats_t *stats, int hist, double q)
+{
+    uint64_t total = 0, rank, seen = 0;
+
+    for (uint32_t b = 0; b < POOL_HIST_BUCKETS; b++) {
+        total += stats->latency[hist][b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(q * (double)total + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (uint32_t b = 0; b < POOL_HIST_BUCKETS; b++) {
+        seen += stats->latency[hist][b];
+        if (seen >= rank) {
+            return pool_hist_upper(b);
+        }
+    }
+    return pool_hist_upper(POOL_HIST_BUCKETS - 1);
+}
+
+/* Events behind the POOL_PERF_* counters and their group. Hardware
+ * events come first so that one of them leads the hardware group. */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    uint32_t group;
+} pool_perf_events[POOL_PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, POOL_PERF_GROUP_HW },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, POOL_PERF_GROUP_HW },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, POOL_PERF_GROUP_HW },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), POOL_PERF_GROUP_HW },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, POOL_PERF_GROUP_HW },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, POOL_PERF_GROUP_SW },
+};
+
+/**
+ * @brief Open the POOL_PERF_* counters for the calling thread.
+ * User-space events only are counted, so unprivileged processes
+ * can use them with the default `perf_event_paranoid`. Counters
+ * the kernel refuses (no PMU in a VM, seccomp, paranoid level)
+ * are skipped; the others keep working.
+ * 
+ * The hardware counters form one group and the task clock its
+ * own, so a PMU group that cannot be scheduled does not stop the
+ * clock. Each group reports how long it was enabled and running,
+ * which `pool_perf_end` uses to scale multiplexed counts.
+ * 
+ * @param *perf instance, owned by the calling thread.
+ * @return int number of counters opened, 0 when perf events
+ * are unavailable.
+ */
+int pool_perf_open(pool_perf_t *perf)
+{
+    struct perf_event_attr attr;
+    int opened = 0;
+
+    for (uint32_t g = 0; g < POOL_PERF_GROUPS; g++) {
+        perf->leaders[g] = -1;
+        perf->enabled[g] = 0;
+        perf->running[g] = 0;
+    }
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        int *leader = &perf->leaders[pool_perf_events[i].group];
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = pool_perf_events[i].type;
+        attr.config = pool_perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        /* A whole group is read at once, so every batch sees its
+         * counters over the same interval. */
+        perf->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, *leader, PERF_FLAG_FD_CLOEXEC);
+        perf->ids[i] = 0;
+        perf->begin[i] = 0;
+        if (perf->fds[i] < 0) {
+            perf->fds[i] = -1;
+            continue;
+        }
+
+        if (ioctl(perf->fds[i], PERF_EVENT_IOC_ID, &perf->ids[i]) != 0) {
+            close(perf->fds[i]);
+            perf->fds[i] = -1;
+            continue;
+        }
+        if (*leader < 0) {
+            *leader = perf->fds[i];
+        }
+        opened++;
+    }
+
+    return opened;
+}
+
+/**
+ * @brief Read every counter of both groups.
+ * 
+ * @param *perf instance. 
+ * @param *values receives one value per POOL_PERF_* counter,
+ * 0 for counters that are not open.
+ * @param *enabled receives the time each group was enabled.
+ * @param *running receives the time each group was running.
+ */
+static void pool_perf_read(pool_perf_t *perf, uint64_t *values, uint64_t *enabled, uint64_t *running)
+{
+    uint64_t buf[3 + 2 * POOL_PERF_COUNTERS];
+
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        values[i] = 0;
+    }
+
+    for (uint32_t g = 0; g < POOL_PERF_GROUPS; g++) {
+        enabled[g] = 0;
+        running[g] = 0;
+        if (perf->leaders[g] < 0 || read(perf->leaders[g], buf, sizeof(buf)) <= 0) {
+            continue;
+        }
+
+        /* nr, time enabled, time running, then { value, id } pairs. */
+        enabled[g] = buf[1];
+        running[g] = buf[2];
+        for (uint64_t n = 0; n < buf[0] && n < POOL_PERF_COUNTERS; n++) {
+            for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+                if (perf->fds[i] >= 0 && perf->ids[i] == buf[4 + 2 * n]) {
+                    values[i] = buf[3 + 2 * n];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Start measuring a batch of pool operations.
+ * 
+ * @param *perf instance opened by the calling thread.
+ */
+void pool_perf_begin(pool_perf_t *perf)
+{
+    pool_perf_read(perf, perf->begin, perf->enabled, perf->running);
+}
+
+/**
+ * @brief End the batch started by `pool_perf_begin` and add
+ * its counts, along with `ops`, to the statistics of `pool`.
+ * Counts per operation are POOL_STAT_CYCLES.. divided by
+ * POOL_STAT_PERF_OPS in a `pool_stats_snapshot`. Each call
+ * reads the counters with a single system call per group, so
+ * measure batches rather than single operations.
+ * 
+ * A group the PMU multiplexed has its counts scaled by the time
+ * it was enabled over the time it ran. When a group did not run
+ * at all, the batch is dropped and `ops` is not counted, so the
+ * counts per operation are never silently low.
+ * 
+ * @param *perf instance opened by the calling thread.
+ * @param *pool pool the batch ran on.
+ * @param ops number of operations in the batch.
+ */
+void pool_perf_end(pool_perf_t *perf, pool_t *pool, uint64_t ops)
+{
+    uint64_t end[POOL_PERF_COUNTERS];
+    uint64_t enabled[POOL_PERF_GROUPS], running[POOL_PERF_GROUPS];
+    bool open = false;
+
+    for (uint32_t g = 0; g < POOL_PERF_GROUPS; g++) {
+        open = open || perf->leaders[g] >= 0;
+    }
+    if (!open) {
+        return;
+    }
+
+    pool_perf_read(perf, end, enabled, running);
+    for (uint32_t g = 0; g < POOL_PERF_GROUPS; g++) {
+        if (perf->leaders[g] >= 0 && running[g] == perf->running[g]) {
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        uint32_t g = pool_perf_events[i].group;
+        uint64_t count = end[i] - perf->begin[i];
+        uint64_t ran = running[g] - perf->running[g];
+        uint64_t was_enabled = enabled[g] - perf->enabled[g];
+
+        if (perf->fds[i] < 0) {
+            continue;
+        }
+        if (ran < was_enabled) {
+            count = (uint64_t)((double)count * (double)was_enabled / (double)ran);
+        }
+        pool_count(pool, POOL_STAT_CYCLES + i, count);
+    }
+    pool_count(pool, POOL_STAT_PERF_OPS, ops);
+}
+
+/**
+ * @brief Close the counters of `perf`.
+ * 
+ * @param *perf instance. 
+ */
+void pool_perf_close(pool_perf_t *perf)
+{
+    for (uint32_t i = 0; i < POOL_PERF_COUNTERS; i++) {
+        if (perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+            perf->fds[i] = -1;
+        }
+    }
+    for (uint32_t g = 0; g < POOL_PERF_GROUPS; g++) {
+        perf->leaders[g] = -1;
+    }
+}
+
+/**
+ * @brief Write the events recorded by every thread to `path`
+ * as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+ * Switches and refills are spans, pending switches, stalled
+ * reads and read retries are instants; each thread keeps its
+ * last POOL_TRACE_EVENTS events. Events recorded while the dump
+ * runs may be missing or torn, so dump once readers are idle.
+ * 
+ * Events are only recorded when the library is built with
+ * POOL_TRACE (cmake -DPOOL_TRACE=ON); otherwise tracing costs
+ * nothing and this function fails.
+ * 
+ * @param *path output file.
+ * @return int 0 on success, -1 when tracing is compiled out or
+ * the file cannot be written.
+ */
+int pool_trace_dump(const char *path)
+{
+#ifdef POOL_TRACE
+    static const char *names[] = { "switch", "switch_pending", "stall", "read_retry", "refill" };
+    static const char *args[] = { "block", "block", "reads", "block", "block" };
+    FILE *f = fopen(path, "w");
+    bool first = true;
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (pool_trace_ring_t *ring = atomic_load_explicit(&pool_trace_rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (uint64_t i = (head > POOL_TRACE_EVENTS) ? head - POOL_TRACE_EVENTS : 0; i < head; i++) {
+            const pool_trace_event_t *e = &ring->events[i % POOL_TRACE_EVENTS];
+
+            fprintf(f, "%s\n{\"name\": \"%s\", \"cat\": \"pool\", \"pid\": %d, \"tid\": %ld, "
+                    "\"ts\": %.3f, ", first ? "" : ",", names[e->type], (int)getpid(), ring->tid,
+                    (double)e->ts / 1000.0);
+            if (e->type == POOL_TRACE_SWITCH || e->type == POOL_TRACE_REFILL) {
+                fprintf(f, "\"ph\": \"X\", \"dur\": %.3f, ", (double)e->dur / 1000.0);
+            } else {
+                fprintf(f, "\"ph\": \"i\", \"s\": \"t\", ");
+            }
+            fprintf(f, "\"args\": {\"%s\": %u}}", args[e->type], e->arg);
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return (fclose(f) == 0) ? 0 : -1;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Retrieve the eventfd signaled on `event`, for callers
+ * running an event loop instead of blocking.
+ * The fd is created on first use, non-blocking, and stays owned
+ * by the pool: do not close it. Every signal adds 1 to the
+ * eventfd counter, so a read returns the number of events since
+ * the previous read.
+ * 
+ * POOL_EVENT_PUBLISH is signaled by every `pool_refill_end`,
+ * POOL_EVENT_LOW_WATER once per main block, see
+ * `pool_set_low_watermark`. The fds belong to the process: a
+ * pool created with `create_pool_shared` only signals the
+ * events of its own process.
+ * 
+ * @param *pool instance. 
+ * @param event one of the POOL_EVENT_* events.
+ * @return int the eventfd, -1 when `event` is invalid or the
+ * eventfd cannot be created.
+ */
+int pool_event_fd(pool_t *pool, int event)
+{
+    int fd, expected = -1;
+
+    if (event < 0 || event >= POOL_EVENTS) {
+        return -1;
+    }
+
+    fd = atomic_load_explicit(&pool->events[event], memory_order_acquire);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Two threads may race to create it, the loser closes its own. */
+    if (!atomic_compare_exchange_strong_explicit(&pool->events[event], &expected, fd,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        close(fd);
+        return expected;
+    }
+    return fd;
+}
+
+/**
+ * @brief Signal POOL_EVENT_LOW_WATER when the main block has
+ * `reads` reads left before the switch policy retires it.
+ * The time policy has no read limit, so its event is signaled
+ * once the main block is `max_age` old.
+ * 
+ * @param *pool instance. 
+ * @param reads reads left on the main block, 0 disables the
+ * event.
+ */
+void pool_set_low_watermark(pool_t *pool, uint32_t reads)
+{
+    pool->low_water = reads;
+}
+
+/* Header written over a free object: `next` chains the objects
+ * of a magazine, `below` the magazines of a depot block and
+ * `count` is the size of the magazine headed by this object.
+ * Objects are named by their offset in POOL_OBJECT_ALIGN units
+ * plus 1, so that naming one takes a shift rather than a
+ * division, and 0 ends a chain. */
+typedef struct _pool_free_object {
+    _Atomic uint32_t below;
+    uint32_t next;
+    uint32_t count;
+} pool_free_object_t;
+
+/**
+ * @brief Head of the depot block `block`.
+ * 
+ * @param *objects instance. 
+ * @param block 0 or 1.
+ * @return _Atomic uint64_t* the tagged head.
+ */
+static inline _Atomic uint64_t *pool_depot(pool_objects_t *objects, uint32_t block)
+{
+    return (block == 0) ? &objects->depot_a : &objects->depot_b;
+}
+
+/**
+ * @brief Translate an object name to its free header.
+ * 
+ * @param *arena arena of the objects.
+ * @param name name of the object, see `pool_free_object_t`.
+ * @return pool_free_object_t* header of the object.
+ */
+static inline pool_free_object_t *pool_free_object(uint8_t *arena, uint32_t name)
+{
+    return (pool_free_object_t*)(arena + (size_t)(name - 1) * POOL_OBJECT_ALIGN);
+}
+
+/**
+ * @brief Name of the object at `obj`.
+ * 
+ * @param *arena arena of the objects.
+ * @param *obj object.
+ * @return uint32_t name of the object, see `pool_free_object_t`.
+ */
+static inline uint32_t pool_object_name(uint8_t *arena, void *obj)
+{
+    return (uint32_t)(((uint8_t*)obj - arena) / POOL_OBJECT_ALIGN) + 1;
+}
+
+/**
+ * @brief Push the magazine chained from `head` on the depot
+ * block `block`.
+ * The head is tagged, so a magazine popped and pushed back
+ * between the load and the CAS of another thread makes that
+ * CAS fail instead of corrupting the stack (ABA).
+ * 
+ * @param *objects instance. 
+ * @param block 0 or 1.
+ * @param head name of the first object.
+ * @param count number of objects, at least 1.
+ */
+static void pool_depot_push(pool_objects_t *objects, uint32_t block, uint32_t head, uint32_t count)
+{
+    _Atomic uint64_t *depot = pool_depot(objects, block);
+    pool_free_object_t *obj = pool_free_object(objects->arena, head);
+    uint64_t old = atomic_load_explicit(depot, memory_order_relaxed);
+    uint64_t new;
+
+    obj->count = count;
+    do {
+        atomic_store_explicit(&obj->below, (uint32_t)old, memory_order_relaxed);
+        new = (((old >> 32) + 1) << 32) | head;
+    } while (!atomic_compare_exchange_weak_explicit(depot, &old, new, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/**
+ * @brief Pop a magazine from the depot block `block`.
+ * 
+ * @param *objects instance. 
+ * @param block 0 or 1.
+ * @param *count number of objects of the magazine.
+ * @return uint32_t name of its first object, 0 when the block
+ * is empty.
+ */
+static uint32_t pool_depot_pop(pool_objects_t *objects, uint32_t block, uint32_t *count)
+{
+    _Atomic uint64_t *depot = pool_depot(objects, block);
+    uint64_t old = atomic_load_explicit(depot, memory_order_acquire);
+    pool_free_object_t *obj;
+    uint64_t new;
+
+    do {
+        if ((uint32_t)old == 0) {
+            return 0;
+        }
+        /* The head may be handed out again while we read it; the
+         * arena stays mapped and the tag rejects the stale value. */
+        obj = pool_free_object(objects->arena, (uint32_t)old);
+        new = (((old >> 32) + 1) << 32) |
+              atomic_load_explicit(&obj->below, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(depot, &old, new, memory_order_acquire,
+                                                    memory_order_acquire));
+
+    *count = obj->count;
+    return (uint32_t)old;
+}
+
+/**
+ * @brief Move every magazine of the standby depot block to the
+ * main block.
+ * The standby stack is detached with one CAS, so a concurrent
+ * free either lands in it before and is moved, or in the new
+ * empty standby stack after. Its magazines are then pushed one
+ * by one, which puts the oldest frees on top of the main block.
+ * 
+ * @param *objects instance. 
+ */
+static void pool_depot_recycle(pool_objects_t *objects)
+{
+    uint64_t old = atomic_load_explicit(&objects->depot_b, memory_order_relaxed);
+    uint32_t head;
+
+    while (!atomic_compare_exchange_weak_explicit(&objects->depot_b, &old, ((old >> 32) + 1) << 32,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+    }
+
+    head = (uint32_t)old;
+    while (head != 0) {
+        pool_free_object_t *obj = pool_free_object(objects->arena, head);
+        uint32_t below = atomic_load_explicit(&obj->below, memory_order_relaxed);
+
+        pool_depot_push(objects, 0, head, obj->count);
+        head = below;
+    }
+}
+
+/**
+ * @brief Reload the empty allocation magazine of `cache` and
+ * allocate from it, recycling the standby depot block when the
+ * main block is drained.
+ * 
+ * @param *cache instance. 
+ * @return void* an object, or NULL when the depot is empty.
+ */
+static void *pool_object_reload(pool_object_cache_t *cache)
+{
+    pool_objects_t *objects = cache->objects;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        cache->alloc_head = pool_depot_pop(objects, 0, &cache->nalloc);
+        if (cache->alloc_head != 0) {
+            return pool_object_alloc(cache);
+        }
+
+        /* The main block is drained: recycle what was freed. */
+        if (cache->nfree > 0) {
+            pool_depot_push(objects, 1, cache->free_head, cache->nfree);
+            cache->free_head = 0;
+            cache->nfree = 0;
+        }
+        pool_depot_recycle(objects);
+    }
+
+    cache->nalloc = 0;
+    return NULL;
+}
+
+/**
+ * @brief Create an allocator of `count` objects of `obj_size`
+ * bytes, carved from the storage of a cache-line aligned pool
+ * of two blocks.
+ * Objects are handed out by `pool_object_alloc` through
+ * per-thread caches. The free objects sit in a depot of two
+ * blocks, like the double blocks of a pool: allocations drain
+ * the main block while frees go to the standby block, and once
+ * the main block is empty the standby block is moved into it.
+ * Frees never touch the main block, so a freed object is never
+ * reused before every object of the main block was.
+ * 
+ * @param obj_size object size, rounded up to POOL_OBJECT_ALIGN.
+ * @param count number of objects.
+ * @return pool_objects_t* a heap instance, or NULL when
+ * `obj_size` or `count` is 0 or too large.
+ */
+pool_objects_t *create_pool_objects(size_t obj_size, uint32_t count)
+{
+    if (obj_size == 0 || count == 0) {
+        return NULL;
+    }
+
+    obj_size = (obj_size + POOL_OBJECT_ALIGN - 1) & ~((size_t)POOL_OBJECT_ALIGN - 1);
+    if (obj_size == 0 || obj_size / POOL_OBJECT_ALIGN > (UINT32_MAX - 1) / count) {
+        return NULL;
+    }
+
+    /* Objects are a multiple of 16 bytes, so the words always
+     * split evenly into the two blocks. */
+    if ((uint64_t)obj_size * count / sizeof(uint32_t) > UINT32_MAX) {
+        return NULL;
+    }
+
+    pool_objects_t *objects = aligned_alloc(POOL_CACHELINE, sizeof(pool_objects_t));
+    pool_options_t opts;
+
+    if (objects == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    pool_options_init(&opts);
+    opts.alignment = POOL_CACHELINE;
+    objects->pool = create_pool_opts((uint32_t)(obj_size * count / sizeof(uint32_t)), 2, UINT32_MAX,
+                                     &opts);
+    objects->arena = (uint8_t*)objects->pool->pool;
+    objects->obj_size = obj_size;
+    objects->count = count;
+    atomic_init(&objects->depot_a, 0);
+    atomic_init(&objects->depot_b, 0);
+
+    /* Every object starts in the main block, in magazines pushed
+     * from the end so that the first one holds the lowest ones. */
+    uint32_t step = (uint32_t)(obj_size / POOL_OBJECT_ALIGN);
+    uint32_t first = (count - 1) / POOL_MAGAZINE_SIZE * POOL_MAGAZINE_SIZE;
+
+    for (uint32_t i = first + POOL_MAGAZINE_SIZE; i > 0; i -= POOL_MAGAZINE_SIZE) {
+        uint32_t start = i - POOL_MAGAZINE_SIZE;
+        uint32_t n = (count - start < POOL_MAGAZINE_SIZE) ? count - start : POOL_MAGAZINE_SIZE;
+        uint32_t next = 0;
+
+        for (uint32_t k = n; k > 0; k--) {
+            uint32_t name = (start + k - 1) * step + 1;
+
+            pool_free_object(objects->arena, name)->next = next;
+            next = name;
+        }
+        pool_depot_push(objects, 0, next, n);
+    }
+
+    return objects;
+}
+
+/**
+ * @brief Deallocate `objects` and its pool. Every cache must
+ * be unregistered first.
+ * 
+ * @param *objects instance. 
+ */
+void destroy_pool_objects(pool_objects_t *objects)
+{
+    if (objects != NULL) {
+        destroy_pool(objects->pool);
+        free(objects);
+    }
+}
+
+/**
+ * @brief Register a per-thread cache of `objects`.
+ * A cache holds one magazine to allocate from and one
+ * collecting frees, so most calls touch no shared state.
+ * 
+ * @param *objects instance. 
+ * @return pool_object_cache_t* a heap instance of the cache.
+ */
+pool_object_cache_t *pool_object_cache_register(pool_objects_t *objects)
+{
+    pool_object_cache_t *cache = aligned_alloc(POOL_CACHELINE, sizeof(pool_object_cache_t));
+
+    if (cache == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    cache->objects = objects;
+    cache->arena = objects->arena;
+    cache->alloc_head = 0;
+    cache->nalloc = 0;
+    cache->free_head = 0;
+    cache->nfree = 0;
+
+    return cache;
+}
+
+/**
+ * @brief Give the objects held by `cache` back to the depot and
+ * deallocate it.
+ * 
+ * @param *cache instance. 
+ */
+void pool_object_cache_unregister(pool_object_cache_t *cache)
+{
+    if (cache != NULL) {
+        if (cache->nalloc > 0) {
+            pool_depot_push(cache->objects, 0, cache->alloc_head, cache->nalloc);
+        }
+        if (cache->nfree > 0) {
+            pool_depot_push(cache->objects, 1, cache->free_head, cache->nfree);
+        }
+        free(cache);
+    }
+}
+
+/**
+ * @brief Allocate an object.
+ * The object comes from the allocation magazine of `cache`; an
+ * empty magazine is reloaded with a whole magazine popped from
+ * the main depot block. When that block is empty, the frees of
+ * `cache` are flushed to the standby block and the standby
+ * magazines are moved to the main block. This function never
+ * enters the kernel.
+ * 
+ * @param *cache instance. 
+ * @return void* an object of `obj_size` bytes, or NULL when
+ * every object is allocated or held by another cache.
+ */
+void *pool_object_alloc(pool_object_cache_t *cache)
+{
+    if (cache->nalloc == 0) {
+        return pool_object_reload(cache);
+    }
+
+    pool_free_object_t *obj = pool_free_object(cache->arena, cache->alloc_head);
+
+    cache->alloc_head = obj->next;
+    cache->nalloc--;
+    return obj;
+}
+
+/**
+ * @brief Free an object allocated from the same pool.
+ * The object is collected by `cache` and pushed to the standby
+ * depot block once a magazine is full. Any cache of the pool
+ * may free it, whichever cache allocated it.
+ * 
+ * @param *cache instance. 
+ * @param *obj object, or NULL.
+ */
+void pool_object_free(pool_object_cache_t *cache, void *obj)
+{
+    if (obj == NULL) {
+        return;
+    }
+
+    ((pool_free_object_t*)obj)->next = cache->free_head;
+    cache->free_head = pool_object_name(cache->arena, obj);
+    if (++cache->nfree == POOL_MAGAZINE_SIZE) {
+        pool_depot_push(cache->objects, 1, cache->free_head, POOL_MAGAZINE_SIZE);
+        cache->free_head = 0;
+        cache->nfree = 0;
+    }
+}
+
+/**
+ * @brief Wake the threads sleeping on `event`, if any.
+ * Called after every enqueue (for consumers) and dequeue (for
+ * producers). The fence pairs with the one in
+ * `pool_queue_sleep`: either the sleeper sees the slot we just
+ * published, or we see it registered and bump `event`.
+ * 
+ * @param *event futex word.
+ * @param *waiting number of sleepers.
+ */
+static inline void pool_queue_notify(atomic_uint *event, atomic_uint *waiting)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) != 0) {
+        atomic_fetch_add_explicit(event, 1, memory_order_relaxed);
+        syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Sleep until `event` moves, unless the slot at `*pos`
+ * is already in the state a retry needs.
+ * 
+ * @param *queue instance. 
+ * @param *event futex word.
+ * @param *waiting number of sleepers.
+ * @param *pos `tail` or `head`.
+ * @param ahead 0 to wait for a free slot, 1 for a full one.
+ */
+static void pool_queue_sleep(pool_queue_t *queue, atomic_uint *event, atomic_uint *waiting,
+                             _Atomic uint32_t *pos, uint32_t ahead)
+{
+    uint32_t seen = atomic_load_explicit(event, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint32_t p = atomic_load_explicit(pos, memory_order_relaxed);
+
+    if ((int32_t)(atomic_load_explicit(&queue->seqs[p & queue->mask], memory_order_acquire) -
+                  (p + ahead)) < 0) {
+        syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    atomic_fetch_sub_explicit(waiting, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Claim up to `count` consecutive slots from `*pos`.
+ * A slot is ready when its sequence equals its position plus
+ * `ahead`: 0 for producers, which need a free slot, and 1 for
+ * consumers, which need a published one.
+ * 
+ * @param *queue instance. 
+ * @param *pos `tail` or `head`.
+ * @param ahead 0 or 1.
+ * @param count most slots to claim.
+ * @param *first first position claimed.
+ * @return uint32_t number of slots claimed, 0 when the first
+ * slot is not ready (queue full or empty).
+ */
+static uint32_t pool_queue_claim(pool_queue_t *queue, _Atomic uint32_t *pos, uint32_t ahead,
+                                 uint32_t count, uint32_t *first)
+{
+    uint32_t p = atomic_load_explicit(pos, memory_order_relaxed);
+
+    for (;;) {
+        uint32_t n = 0;
+
+        while (n < count &&
+               atomic_load_explicit(&queue->seqs[(p + n) & queue->mask], memory_order_acquire) ==
+               p + n + ahead) {
+            n++;
+        }
+
+        if (n == 0) {
+            int32_t diff = (int32_t)(atomic_load_explicit(&queue->seqs[p & queue->mask],
+                                                          memory_order_acquire) - (p + ahead));
+
+            if (diff < 0) {
+                return 0;
+            }
+            /* Another thread claimed `p` already. */
+            p = atomic_load_explicit(pos, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(pos, &p, p + n, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *first = p;
+            return n;
+        }
+    }
+}
+
+/**
+ * @brief Create a bounded multi-producer multi-consumer queue of
+ * uint32_t items over the storage of `pool`.
+ * Each slot carries a sequence number (D. Vyukov's bounded MPMC
+ * queue): a producer claims a position with one CAS on `tail`,
+ * writes the slot and publishes it by storing position + 1 in
+ * its sequence; a consumer claims it with one CAS on `head` and
+ * frees it by storing position + capacity. No lock is taken;
+ * the blocking calls sleep on a futex only when the queue is
+ * full or empty.
+ * 
+ * The capacity is the largest power of two not above `size`,
+ * so positions are masked. The queue owns the storage until it
+ * is destroyed: do not use the other pool functions meanwhile.
+ * 
+ * @param *pool storage, which the queue does not own.
+ * @return pool_queue_t* a heap instance, or NULL when the pool
+ * has fewer than 2 elements.
+ */
+pool_queue_t *create_pool_queue(pool_t *pool)
+{
+    if (pool->size < 2) {
+        return NULL;
+    }
+
+    pool_queue_t *queue = aligned_alloc(POOL_CACHELINE, sizeof(pool_queue_t));
+    uint32_t capacity = 1;
+
+    while (capacity <= pool->size / 2) {
+        capacity *= 2;
+    }
+
+    if (queue == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    queue->seqs = aligned_alloc(POOL_CACHELINE, ((capacity * sizeof(*queue->seqs) + POOL_CACHELINE - 1) /
+                                                 POOL_CACHELINE) * POOL_CACHELINE);
+
+    if (queue->seqs == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        atomic_init(&queue->seqs[i], i);
+    }
+
+    queue->pool = pool;
+    queue->slots = pool->pool;
+    queue->mask = capacity - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->not_full, 0);
+    atomic_init(&queue->producers_waiting, 0);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->not_empty, 0);
+    atomic_init(&queue->consumers_waiting, 0);
+
+    return queue;
+}
+
+/**
+ * @brief Deallocate `queue`, leaving its pool alive.
+ * 
+ * @param *queue instance. 
+ */
+void destroy_pool_queue(pool_queue_t *queue)
+{
+    if (queue != NULL) {
+        free(queue->seqs);
+        free(queue);
+    }
+}
+
+/**
+ * @brief Enqueue `value` unless the queue is full.
+ * 
+ * @param *queue instance. 
+ * @param value item.
+ * @return int 0 when enqueued, -1 when the queue is full.
+ */
+int pool_queue_try_enqueue(pool_queue_t *queue, uint32_t value)
+{
+    return (pool_queue_try_enqueue_many(queue, &value, 1) == 1) ? 0 : -1;
+}
+
+/**
+ * @brief Dequeue the oldest item unless the queue is empty.
+ * 
+ * @param *queue instance. 
+ * @param *value destination of the item.
+ * @return int 0 when dequeued, -1 when the queue is empty.
+ */
+int pool_queue_try_dequeue(pool_queue_t *queue, uint32_t *value)
+{
+    return (pool_queue_try_dequeue_many(queue, value, 1) == 1) ? 0 : -1;
+}
+
+/**
+ * @brief Enqueue up to `count` items with a single claim on the
+ * tail. The items enqueued are consecutive in the queue.
+ * 
+ * @param *queue instance. 
+ * @param *values items.
+ * @param count number of items.
+ * @return uint32_t number of items enqueued, 0 when the queue
+ * is full.
+ */
+uint32_t pool_queue_try_enqueue_many(pool_queue_t *queue, const uint32_t *values, uint32_t count)
+{
+    uint32_t first;
+    uint32_t n = pool_queue_claim(queue, &queue->tail, 0, count, &first);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t p = first + i;
+
+        queue->slots[p & queue->mask] = values[i];
+        atomic_store_explicit(&queue->seqs[p & queue->mask], p + 1, memory_order_release);
+    }
+
+    if (n > 0) {
+        pool_queue_notify(&queue->not_empty, &queue->consumers_waiting);
+    }
+    return n;
+}
+
+/**
+ * @brief Dequeue up to `count` of the oldest items with a single
+ * claim on the head.
+ * 
+ * @param *queue instance. 
+ * @param *out destination of the items.
+ * @param count room in `out`.
+ * @return uint32_t number of items dequeued, 0 when the queue
+ * is empty.
+ */
+uint32_t pool_queue_try_dequeue_many(pool_queue_t *queue, uint32_t *out, uint32_t count)
+{
+    uint32_t first;
+    uint32_t n = pool_queue_claim(queue, &queue->head, 1, count, &first);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t p = first + i;
+
+        out[i] = queue->slots[p & queue->mask];
+        atomic_store_explicit(&queue->seqs[p & queue->mask], p + queue->mask + 1,
+                              memory_order_release);
+    }
+
+    if (n > 0) {
+        pool_queue_notify(&queue->not_full, &queue->producers_waiting);
+    }
+    return n;
+}
+
+/**
+ * @brief Enqueue `value`, sleeping while the queue is full.
+ * 
+ * @param *queue instance. 
+ * @param value item.
+ */
+void pool_queue_enqueue(pool_queue_t *queue, uint32_t value)
+{
+    while (pool_queue_try_enqueue(queue, value) != 0) {
+        pool_queue_sleep(queue, &queue->not_full, &queue->producers_waiting, &queue->tail, 0);
+    }
+}
+
+/**
+ * @brief Dequeue the oldest item, sleeping while the queue is
+ * empty.
+ * 
+ * @param *queue instance. 
+ * @return uint32_t the item.
+ */
+uint32_t pool_queue_dequeue(pool_queue_t *queue)
+{
+    uint32_t value;
+
+    while (pool_queue_try_dequeue(queue, &value) != 0) {
+        pool_queue_sleep(queue, &queue->not_empty, &queue->consumers_waiting, &queue->head, 1);
+    }
+    return value;
+}
+
 /**
- * @brief Create a pool object
+ * @brief Enqueue all `count` items, sleeping whenever the queue
+ * is full. Other producers may interleave their items between
+ * the batches this call is split into.
  * 
- * @return pool_t* a heap instance of the pool object.
+ * @param *queue instance. 
+ * @param *values items.
+ * @param count number of items.
  */
-pool_t *create_pool(void)
+void pool_queue_enqueue_many(pool_queue_t *queue, const uint32_t *values, uint32_t count)
 {
-    pool_t *p = malloc(sizeof(pool_t));
-    
-    if (p == NULL) {
-        perror("Cannot allocate memory!");
-        exit(1);
+    while (count > 0) {
+        uint32_t n = pool_queue_try_enqueue_many(queue, values, count);
+
+        if (n == 0) {
+            pool_queue_sleep(queue, &queue->not_full, &queue->producers_waiting, &queue->tail, 0);
+        }
+        values += n;
+        count -= n;
     }
+}
+
+/**
+ * @brief Dequeue up to `count` of the oldest items, sleeping
+ * while the queue is empty.
+ * 
+ * @param *queue instance. 
+ * @param *out destination of the items.
+ * @param count room in `out`, at least 1.
+ * @return uint32_t number of items dequeued, at least 1.
+ */
+uint32_t pool_queue_dequeue_many(pool_queue_t *queue, uint32_t *out, uint32_t count)
+{
+    uint32_t n;
 
-    for (uint32_t i = 0; i < POOL_SIZE; i++) {
-        p->pool[i] = 0;
+    while ((n = pool_queue_try_dequeue_many(queue, out, count)) == 0) {
+        pool_queue_sleep(queue, &queue->not_empty, &queue->consumers_waiting, &queue->head, 1);
     }
+    return n;
+}
 
-    p->current_block = POOL_BLOCK_A;
-    p->cursor = 0;
-    p->iterations = 0;
+/**
+ * @brief Copy POOL_GROUP_BATCH values of a READY standby block of
+ * `pool`, starting at `index`, without touching its main block.
+ * The block is pinned while it is copied: once it is seen READY
+ * under the pin, a refill can only claim it after the pin is gone.
+ * 
+ * @param *pool instance. 
+ * @param index position of the first value.
+ * @param *out receives the values.
+ * @return bool whether a READY block was copied.
+ */
+static bool pool_group_copy_ready(pool_t *pool, uint32_t index, uint32_t *out)
+{
+    uint32_t current = atomic_load_explicit(&pool->shared->current_block, memory_order_acquire);
 
-    pthread_mutex_init(&p->lock, NULL);
-    p->locked = ATOMIC_VAR_INIT(false);
+    for (uint32_t next = pool_next_block(pool, current); next != current;
+         next = pool_next_block(pool, next)) {
+        uint32_t n = next / pool->block_size;
 
-    return p;
+        if (atomic_load_explicit(&pool->states[n], memory_order_relaxed) != POOL_STATE_READY) {
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&pool->pins[n], 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&pool->states[n], memory_order_seq_cst) == POOL_STATE_READY) {
+            pool_copy_wrapped(pool, next, index % pool->block_size, out, POOL_GROUP_BATCH, false);
+            pool_unpin(pool, next);
+            return true;
+        }
+        pool_unpin(pool, next);
+    }
+    return false;
 }
 
 /**
- * @brief Deallocate and destroy the pool object.
+ * @brief Refill the stolen values of `member` from the next
+ * sibling, in round-robin order, that has a READY standby block.
+ * Neither the main block nor the counters of the sibling are
+ * touched.
  * 
- * @param *pool instance. 
+ * @param *member instance. 
+ * @param index position of the first value in the sibling.
+ * @return bool whether a batch was stolen.
  */
-void destroy_pool(pool_t *pool) {
-    if (pool != NULL) {
-        pthread_mutex_destroy(&pool->lock);
-        free(pool);
-        pool = NULL;
+static bool pool_group_steal(pool_group_member_t *member, uint32_t index)
+{
+    pool_group_t *group = member->group;
+
+    for (uint32_t i = 1; i <= group->npools; i++) {
+        uint32_t victim = (member->victim + i) % group->npools;
+
+        if (victim == member->home ||
+            !pool_group_copy_ready(group->pools[victim], index, member->stolen)) {
+            continue;
+        }
+
+        member->victim = victim;
+        member->next = 0;
+        member->nstolen = POOL_GROUP_BATCH;
+        atomic_fetch_add_explicit(&group->counts[POOL_GROUP_STAT_STEALS], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&group->counts[POOL_GROUP_STAT_STOLEN], POOL_GROUP_BATCH,
+                                  memory_order_relaxed);
+        return true;
     }
+
+    atomic_fetch_add_explicit(&group->counts[POOL_GROUP_STAT_MISSES], 1, memory_order_relaxed);
+    return false;
 }
 
 /**
- * @brief Fill the entire pool with the `value`.
- * Avoid use this function since it's not thread-safe.
- * Prefer using `pool_fill_area` instead.
+ * @brief Group `npools` pools, typically one per shard, so that
+ * the readers of a pool whose refill is late read from the
+ * others instead of an exhausted block.
+ * The pools are not copied nor owned: they must outlive the
+ * group.
  * 
- * @param *pool instance 
- * @param value value to be filled
+ * @param **pools pools of the group.
+ * @param npools number of pools, at least 1.
+ * @return pool_group_t* a heap instance, or NULL when `npools`
+ * is 0.
  */
-void pool_fill(pool_t *pool, uint32_t value)
+pool_group_t *create_pool_group(pool_t **pools, uint32_t npools)
 {
-    for (uint32_t i = 0; i < POOL_SIZE; i++) {
-        pool->pool[i] = value;
+    if (pools == NULL || npools == 0) {
+        return NULL;
+    }
+
+    pool_group_t *group = aligned_alloc(POOL_CACHELINE, sizeof(pool_group_t));
+
+    if (group == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    group->pools = malloc(npools * sizeof(pool_t*));
+
+    if (group->pools == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    memcpy(group->pools, pools, npools * sizeof(pool_t*));
+    group->npools = npools;
+    for (uint32_t i = 0; i < POOL_GROUP_STAT_COUNT; i++) {
+        atomic_init(&group->counts[i], 0);
     }
+
+    return group;
 }
 
 /**
- * @brief Fill an specific area of the pool with `value`.
- * Use this with care, since it may not be thread-safe
- * depending of the `index` and the `offset`.
+ * @brief Deallocate `group`, leaving its pools alive. Every
+ * member must have left first.
  * 
- * @param *pool instance 
- * @param value value to fill
- * @param index initial index position
- * @param offset length of position
+ * @param *group instance. 
  */
-void pool_fill_area(pool_t *pool, uint32_t value, uint32_t index, uint32_t offset)
+void destroy_pool_group(pool_group_t *group)
 {
-    for (uint32_t i = index; i < index + offset; i++) {
-        pool->pool[i] = value;
+    if (group != NULL) {
+        free(group->pools);
+        free(group);
     }
 }
 
 /**
- * @brief Insert `value` in the pool using its own cursor.
- * This function is thread-safe, since the cursor always point
- * to the main block.
+ * @brief Register a reader thread of `group` whose home is pool
+ * number `home`.
  * 
- * @param *pool instance of pool.
- * @param value uint32_t value to be inserted.
+ * @param *group instance. 
+ * @param home index of the home pool.
+ * @return pool_group_member_t* a heap instance, or NULL when
+ * `home` is out of range.
  */
-void pool_insert(pool_t *pool, uint32_t value)
+pool_group_member_t *pool_group_join(pool_group_t *group, uint32_t home)
 {
-    pool->pool[pool->cursor + pool->current_block] = value;
-    pool->cursor = (pool->cursor + 1) % POOL_BLOCK_SIZE;
+    if (home >= group->npools) {
+        return NULL;
+    }
+
+    pool_group_member_t *member = aligned_alloc(POOL_CACHELINE, sizeof(pool_group_member_t));
+
+    if (member == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    member->group = group;
+    member->home = home;
+    member->victim = home;
+    member->next = 0;
+    member->nstolen = 0;
+
+    return member;
 }
 
 /**
- * @brief Insert `value` in the pool at `index` position.
- * This function is thread-safe since the index is translated
- * to the main block.
+ * @brief Deallocate `member`.
  * 
- * @param *pool instance. 
- * @param value uint32_t value to be inserted.
- * @param index position on the pool.
+ * @param *member instance. 
  */
-void pool_insert_at(pool_t *pool, uint32_t value, uint32_t index)
+void pool_group_leave(pool_group_member_t *member)
 {
-    pool->pool[(index % POOL_BLOCK_SIZE) + pool->current_block] = value;
+    free(member);
 }
 
 /**
- * @brief Retrieve the value at `index` position.
- * This function is thread-safe since the index is translated
- * to a valid main block position. It is recommended to use
- * this function instead of accessing the pool object directly
- * since it may lead to inconsistent values.
+ * @brief Read a value for `member`.
+ * The value comes from the home pool, through `pool_get`, unless
+ * its main block is exhausted: a switch is pending because no
+ * standby block is READY yet. The member then serves values
+ * stolen from a READY standby block of a sibling, copying
+ * POOL_GROUP_BATCH of them at once. The sibling keeps reading its
+ * main block: its switch policy and statistics are not touched,
+ * and the standby block stays READY for its next switch. Once the
+ * home refill is published, reads go home again. When no sibling
+ * has a READY block, the home pool is read anyway, as `pool_get`
+ * would.
  * 
- * @param *pool instance. 
+ * @param *member instance. 
  * @param index position.
- * @return uint32_t retrieves the value at index.
+ * @return uint32_t the value.
  */
-uint32_t pool_get(pool_t *pool, uint32_t index)
+uint32_t pool_group_get(pool_group_member_t *member, uint32_t index)
 {
-    pool->iterations++;
+    pool_t *home = member->group->pools[member->home];
 
-    if (pool->iterations >= POOL_MAX_IT) {
-        pool_switch_block_s(pool);
+    if (!atomic_load_explicit(&home->shared->switch_pending, memory_order_relaxed)) {
+        return pool_get(home, index);
     }
 
-    return pool->pool[(index % POOL_BLOCK_SIZE) + pool->current_block];
+    /* Values left from an earlier stall are still unread, so they
+     * are served before stealing again. */
+    if (member->next < member->nstolen || pool_group_steal(member, index)) {
+        return member->stolen[member->next++];
+    }
+    return pool_get(home, index);
 }
 
 /**
- * @brief Switches the main block of pool.
- * This function is not thread-safe. It is not
- * possible to guarantee that some thread is performing
- * any operation based on the main block.
+ * @brief Copy the steal counters of `group`.
+ * The counters are only written when a member steals, so the
+ * home reads cost nothing. They are kept in the group only: the
+ * statistics of the pools do not count steals.
  * 
- * It is highly recommended to use pool_switch_block_s
- * instead.
+ * @param *group instance. 
+ * @param *counts receives the POOL_GROUP_STAT_* counters.
+ */
+void pool_group_stats(pool_group_t *group, uint64_t *counts)
+{
+    for (uint32_t i = 0; i < POOL_GROUP_STAT_COUNT; i++) {
+        counts[i] = atomic_load_explicit(&group->counts[i], memory_order_relaxed);
+    }
+}
+
+/* Flag of the `user_data` of a readiness wait, next to the block
+ * number that the read of the other completions carries. */
+#define POOL_URING_POLL     (UINT64_C(1) << 32)
+
+/* io_uring of a stream, mapped by hand so that liburing is not
+ * needed. Only the stream thread touches it. */
+typedef struct _pool_uring {
+    int fd;
+    bool fixed;
+    uint32_t pending;
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_len;
+    void *cq_ring;
+    size_t cq_len;
+    size_t sqes_len;
+    /* Per block: file offset of the next byte, bytes read and
+     * whether a read is in flight. */
+    uint64_t *pos;
+    uint32_t *done;
+    bool *reading;
+} pool_uring_t;
+
+/**
+ * @brief Reserve the file range of the next `len` bytes.
  * 
- * This function always succeed.
+ * @param *stream instance. 
+ * @param len number of bytes.
+ * @return uint64_t offset of the range, wrapped at the file size.
+ */
+static uint64_t pool_stream_claim(pool_stream_t *stream, uint64_t len)
+{
+    if (stream->size == 0) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&stream->offset, len, memory_order_relaxed) % stream->size;
+}
+
+/**
+ * @brief Read `len` bytes of `stream` into `data` with pread,
+ * or read for devices.
+ * A non-blocking descriptor without data is waited for with
+ * `poll`, 100ms at a time, until the stream is stopped.
  * 
- * @param *pool instance. 
+ * @param *stream instance. 
+ * @param *data destination.
+ * @param len number of bytes.
+ * @return int 0 on success, else the errno value of the failure
+ * (ECANCELED when the stream was stopped while waiting).
  */
-int pool_switch_block(pool_t *pool)
+static int pool_stream_read(pool_stream_t *stream, uint8_t *data, size_t len)
 {
-    if (pool->current_block == POOL_BLOCK_A) {
-        pool->current_block = POOL_BLOCK_B;
-    } else {
-        pool->current_block = POOL_BLOCK_A;
+    uint64_t pos = pool_stream_claim(stream, len);
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = (stream->size != 0) ? pread(stream->fd, data + done, len - done, (off_t)pos) :
+                                          read(stream->fd, data + done, len - done);
+
+        if (n < 0) {
+            struct pollfd wait = { stream->fd, POLLIN, 0 };
+
+            if (errno == EAGAIN) {
+                if (!atomic_load_explicit(&stream->running, memory_order_acquire)) {
+                    return ECANCELED;
+                }
+                poll(&wait, 1, 100);
+            } else if (errno != EINTR) {
+                return errno;
+            }
+            continue;
+        }
+        if (n == 0) {
+            /* End of file: wrap around, unless there is nothing
+             * left to wrap to. */
+            if (stream->size == 0 || pos == 0) {
+                return ENODATA;
+            }
+            pos = 0;
+            continue;
+        }
+        done += (size_t)n;
+        pos += (uint64_t)n;
     }
+
     return 0;
 }
 
 /**
- * @brief Swtiches the main block of pool.
- * This function is thread-safe. If the current
- * block is using by some thread the operation is
- * aborted and the function returns -1. This function
- * returns 0 when it can successfully switch the block.
+ * @brief Give a block claimed by `stream` back and stop the stream.
+ * 
+ * @param *stream instance. 
+ * @param block offset of the block.
+ * @param error errno value of the failed read.
+ */
+static void pool_stream_fail(pool_stream_t *stream, uint32_t block, int error)
+{
+    atomic_store_explicit(&stream->pool->states[block / stream->pool->block_size],
+                          POOL_STATE_STALE, memory_order_release);
+    atomic_store_explicit(&stream->error, error, memory_order_release);
+}
+
+/**
+ * @brief Sleep until a switch moves the epoch of `pool` away
+ * from `epoch`, or for 100ms.
  * 
  * @param *pool instance. 
+ * @param epoch epoch loaded before looking for STALE blocks.
  */
-int pool_switch_block_s(pool_t *pool)
+static void pool_stream_sleep(pool_t *pool, unsigned int epoch)
 {
-    if (atomic_load_explicit(&pool->locked, memory_order_seq_cst) == true) {
-        /* When the locked flag is set, we will abort the switch. */
-        return -1;
+    struct timespec timeout = { 0, 100 * 1000 * 1000 };
+
+    syscall(SYS_futex, &pool->shared->epoch, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, epoch, &timeout,
+            NULL, 0);
+}
+
+/**
+ * @brief Body of a pread thread: read every STALE block it can
+ * claim, then wait for the next switch.
+ * 
+ * @param *args stream instance.
+ */
+static void *pool_stream_pread_worker(void *args)
+{
+    pool_stream_t *stream = (pool_stream_t*)args;
+    pool_t *pool = stream->pool;
+    uint32_t block;
+
+    while (atomic_load_explicit(&stream->running, memory_order_acquire) &&
+           atomic_load_explicit(&stream->error, memory_order_acquire) == 0) {
+        unsigned int epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+
+        while (atomic_load_explicit(&stream->running, memory_order_acquire) &&
+               pool_refill_begin(pool, &block) == 0) {
+            int error = pool_stream_read(stream, (uint8_t*)(pool->pool + block),
+                                         (size_t)pool->block_size * sizeof(uint32_t));
+
+            if (error != 0) {
+                pool_stream_fail(stream, block, error);
+                return NULL;
+            }
+            pool_refill_end(pool, block);
+        }
+        pool_stream_sleep(pool, epoch);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Unmap and close a ring.
+ * 
+ * @param *ring instance. 
+ */
+static void pool_uring_free(pool_uring_t *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_len);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_len);
+    }
+    close(ring->fd);
+    free(ring->pos);
+    free(ring->done);
+    free(ring->reading);
+    free(ring);
+}
+
+/**
+ * @brief Set up an io_uring of `depth` entries for `stream` and
+ * register the blocks of its pool as fixed buffers, one per block.
+ * 
+ * @param *stream instance. 
+ * @param depth number of entries.
+ * @return pool_uring_t* a heap instance of the ring, or NULL when
+ * io_uring is unavailable.
+ */
+static pool_uring_t *pool_uring_new(pool_stream_t *stream, uint32_t depth)
+{
+    pool_t *pool = stream->pool;
+    struct io_uring_params params;
+    struct iovec *iov;
+    pool_uring_t *ring;
+    uint8_t *sq, *cq;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = (int)syscall(SYS_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(pool_uring_t));
+    if (ring == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
     }
+    ring->fd = fd;
 
-    if (pool->current_block == POOL_BLOCK_A) {
-        pool->current_block = POOL_BLOCK_B;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = ring->cq_len = (ring->sq_len > ring->cq_len) ? ring->sq_len : ring->cq_len;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        pool_uring_free(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
     } else {
-        pool->current_block = POOL_BLOCK_A;
+        ring->cq_ring = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            pool_uring_free(ring);
+            return NULL;
+        }
     }
-    return 0;
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        pool_uring_free(ring);
+        return NULL;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_tail = (_Atomic uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->pos = calloc(pool->nblocks, sizeof(uint64_t));
+    ring->done = calloc(pool->nblocks, sizeof(uint32_t));
+    ring->reading = calloc(pool->nblocks, sizeof(bool));
+    iov = malloc(pool->nblocks * sizeof(struct iovec));
+    if (ring->pos == NULL || ring->done == NULL || ring->reading == NULL || iov == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    /* File-backed memory cannot be registered, and a read names
+     * its fixed buffer with 16 bits; the reads then target the
+     * same blocks without the fixed buffers. */
+    for (uint32_t i = 0; i < pool->nblocks; i++) {
+        iov[i].iov_base = pool->pool + (size_t)i * pool->block_size;
+        iov[i].iov_len = (size_t)pool->block_size * sizeof(uint32_t);
+    }
+    ring->fixed = pool->nblocks <= UINT16_MAX &&
+                  syscall(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov,
+                          pool->nblocks) == 0;
+    free(iov);
+
+    return ring;
 }
 
 /**
- * @brief Set the pool cursor to `new_cursor`.
+ * @brief Queue the read of the rest of block number `n`.
+ * At most `depth` reads are in flight, so the submission queue
+ * never overflows.
  * 
- * @param *pool instance. 
- * @param new_cursor new cursor position.
+ * @param *stream instance. 
+ * @param n block number.
  */
-void pool_set_cursor(pool_t *pool, uint32_t new_cursor)
+static void pool_uring_read(pool_stream_t *stream, uint32_t n)
+{
+    pool_uring_t *ring = stream->ring;
+    pool_t *pool = stream->pool;
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = stream->fd;
+    /* Devices are read at their current position. */
+    sqe->off = (stream->size != 0) ? ring->pos[n] : (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)((uint8_t*)(pool->pool + (size_t)n * pool->block_size) +
+                                      ring->done[n]);
+    sqe->len = pool->block_size * sizeof(uint32_t) - ring->done[n];
+    sqe->buf_index = (uint16_t)n;
+    sqe->user_data = n;
+
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->pending++;
+}
+
+/**
+ * @brief Queue a wait for `stream` to become readable, after a
+ * read of block number `n` found a non-blocking descriptor empty.
+ * Its completion queues the read again, so the thread sleeps in
+ * `io_uring_enter` instead of resubmitting the read in a loop.
+ * 
+ * @param *stream instance. 
+ * @param n block number.
+ */
+static void pool_uring_poll(pool_stream_t *stream, uint32_t n)
+{
+    pool_uring_t *ring = stream->ring;
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stream->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = POOL_URING_POLL | n;
+
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->pending++;
+}
+
+/**
+ * @brief Handle the completion of a read of block number `n`:
+ * queue the rest of a short read, or publish the block.
+ * 
+ * @param *stream instance. 
+ * @param n block number.
+ * @param res result of the read, a byte count or -errno.
+ * @return int 1 while the block is still being read, else 0.
+ */
+static int pool_uring_complete(pool_stream_t *stream, uint32_t n, int32_t res)
+{
+    pool_uring_t *ring = stream->ring;
+    pool_t *pool = stream->pool;
+    uint32_t block = n * pool->block_size;
+
+    if (res > 0) {
+        ring->done[n] += (uint32_t)res;
+        ring->pos[n] += (uint64_t)res;
+        if (ring->done[n] == pool->block_size * sizeof(uint32_t)) {
+            ring->reading[n] = false;
+            pool_refill_end(pool, block);
+            return 0;
+        }
+    } else if (res == 0) {
+        if (stream->size == 0 || ring->pos[n] == 0) {
+            ring->reading[n] = false;
+            pool_stream_fail(stream, block, ENODATA);
+            return 0;
+        }
+        ring->pos[n] = 0;
+    } else if (res == -EAGAIN) {
+        pool_uring_poll(stream, n);
+        return 1;
+    } else if (res != -EINTR) {
+        ring->reading[n] = false;
+        pool_stream_fail(stream, block, -res);
+        return 0;
+    }
+
+    pool_uring_read(stream, n);
+    return 1;
+}
+
+/**
+ * @brief Body of the io_uring thread.
+ * Every STALE block it can claim, up to `depth`, gets a read in
+ * flight; the thread then sleeps in `io_uring_enter` until one
+ * completes, or on the switch epoch when nothing is in flight.
+ * Once stopped, it waits for the reads still in flight. A
+ * failure of `io_uring_enter` itself stops the stream like a
+ * failed read.
+ * 
+ * @param *args stream instance.
+ */
+static void *pool_stream_uring_worker(void *args)
+{
+    pool_stream_t *stream = (pool_stream_t*)args;
+    pool_uring_t *ring = stream->ring;
+    pool_t *pool = stream->pool;
+    uint32_t inflight = 0;
+    uint32_t block;
+
+    while (inflight != 0 || (atomic_load_explicit(&stream->running, memory_order_acquire) &&
+                             atomic_load_explicit(&stream->error, memory_order_acquire) == 0)) {
+        unsigned int epoch = atomic_load_explicit(&pool->shared->epoch, memory_order_acquire);
+        uint32_t head, tail;
+        int submitted;
+
+        while (inflight < stream->depth &&
+               atomic_load_explicit(&stream->running, memory_order_acquire) &&
+               atomic_load_explicit(&stream->error, memory_order_acquire) == 0 &&
+               pool_refill_begin(pool, &block) == 0) {
+            uint32_t n = block / pool->block_size;
+
+            ring->pos[n] = pool_stream_claim(stream, (uint64_t)pool->block_size * sizeof(uint32_t));
+            ring->done[n] = 0;
+            ring->reading[n] = true;
+            pool_uring_read(stream, n);
+            inflight++;
+        }
+
+        if (inflight == 0) {
+            if (atomic_load_explicit(&stream->running, memory_order_acquire)) {
+                pool_stream_sleep(pool, epoch);
+            }
+            continue;
+        }
+
+        submitted = (int)syscall(SYS_io_uring_enter, ring->fd, ring->pending, 1,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            int error = errno;
+
+            if (error == EINTR || error == EAGAIN || error == EBUSY) {
+                continue;
+            }
+
+            /* The ring is unusable: every block still being read
+             * goes back to STALE, as after a failed read. A STALE
+             * block is never made the main block of a stream, so
+             * a read the kernel still completes is harmless until
+             * `destroy_pool_stream` closes the ring. */
+            for (uint32_t n = 0; n < pool->nblocks; n++) {
+                if (ring->reading[n]) {
+                    ring->reading[n] = false;
+                    pool_stream_fail(stream, n * pool->block_size, error);
+                }
+            }
+            return NULL;
+        }
+        ring->pending -= (uint32_t)submitted;
+
+        head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            uint32_t n = (uint32_t)cqe->user_data;
+
+            /* A ready descriptor queues the read again; a failed
+             * wait is handled like a failed read. */
+            if ((cqe->user_data & POOL_URING_POLL) && cqe->res >= 0) {
+                pool_uring_read(stream, n);
+            } else {
+                inflight -= 1 - pool_uring_complete(stream, n, cqe->res);
+            }
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Refill `pool` with the contents of `fd`, a regular file
+ * or a device such as `/dev/urandom`.
+ * The main block is read before this function returns and every
+ * other block is marked STALE; from then on each block made STALE
+ * by a switch is read again in place, from the next bytes of
+ * `fd`. A regular file is read from the current position of `fd`,
+ * which is left unchanged, and wraps around to its start at its
+ * end. A non-blocking descriptor without data is waited for, not
+ * polled in a loop. As in `create_pool_producer`, STALE blocks
+ * are never recycled, and a switch that finds no READY block is
+ * left pending until a read completes.
+ * 
+ * With io_uring, a single thread keeps up to `depth` block reads
+ * in flight. The blocks are registered as fixed buffers, so the
+ * kernel writes straight into the pool; when they cannot be
+ * registered (a file-backed pool, or more than 65535 blocks,
+ * which a read cannot name), plain reads into the same
+ * memory are used. The pread engine runs `depth` threads, each
+ * reading one block at a time. Both wait on the switch epoch
+ * while there is nothing to read.
+ * 
+ * A read or io_uring error stops the stream: the blocks being
+ * read go back to STALE and `pool_stream_error` reports the error.
+ * 
+ * @param *pool instance, nothing consumed yet.
+ * @param fd open descriptor, still owned by the caller.
+ * @param depth number of block reads in flight.
+ * @param mode one of the POOL_STREAM_* engines.
+ * @return pool_stream_t* a heap instance of the stream, or NULL when
+ * an argument is invalid, `pool` is already refilled, the main
+ * block cannot be read or POOL_STREAM_URING is unavailable.
+ */
+pool_stream_t *create_pool_stream(pool_t *pool, int fd, uint32_t depth, int mode)
+{
+    if (pool == NULL || fd < 0 || depth == 0 || mode < POOL_STREAM_AUTO || mode > POOL_STREAM_PREAD ||
+        pool->shm != NULL || pool->service != NULL || pool->producer != NULL || pool->stream != NULL) {
+        return NULL;
+    }
+
+    pool_stream_t *s = malloc(sizeof(pool_stream_t));
+    uint32_t current = atomic_load_explicit(&pool->shared->current_block, memory_order_relaxed);
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    if (s == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    /* Character devices and pipes have no end to wrap at. */
+    if (position >= 0) {
+        lseek(fd, position, SEEK_SET);
+    }
+    s->pool = pool;
+    s->fd = fd;
+    s->depth = depth;
+    s->size = (end > 0) ? (uint64_t)end : 0;
+    atomic_init(&s->offset, (s->size != 0 && position > 0) ? (uint64_t)position : 0);
+    atomic_init(&s->error, 0);
+    atomic_init(&s->running, true);
+    s->ring = NULL;
+
+    if (pool_stream_read(s, (uint8_t*)(pool->pool + current),
+                         (size_t)pool->block_size * sizeof(uint32_t)) != 0) {
+        free(s);
+        return NULL;
+    }
+
+    if (mode != POOL_STREAM_PREAD) {
+        s->ring = pool_uring_new(s, depth);
+        if (s->ring == NULL && mode == POOL_STREAM_URING) {
+            free(s);
+            return NULL;
+        }
+    }
+    s->mode = (s->ring != NULL) ? POOL_STREAM_URING : POOL_STREAM_PREAD;
+    s->nthreads = (s->ring != NULL) ? 1 : depth;
+    s->threads = malloc(s->nthreads * sizeof(pthread_t));
+    if (s->threads == NULL) {
+        perror("Cannot allocate memory!");
+        exit(1);
+    }
+
+    pool->recycle = false;
+    pool->stream = s;
+    for (uint32_t i = 0; i < pool->nblocks; i++) {
+        if (i * pool->block_size != current) {
+            atomic_store_explicit(&pool->states[i], POOL_STATE_STALE, memory_order_release);
+        }
+    }
+
+    for (uint32_t i = 0; i < s->nthreads; i++) {
+        if (pthread_create(&s->threads[i], NULL,
+                           (s->ring != NULL) ? &pool_stream_uring_worker : &pool_stream_pread_worker, s)) {
+            perror("Cannot create thread");
+            exit(2);
+        }
+    }
+
+    return s;
+}
+
+/**
+ * @brief Stop the reads of `stream`, wait for those in flight
+ * and deallocate it.
+ * Destroy the stream before its pool, once its readers are done.
+ * The pool keeps its blocks but is no longer refilled.
+ * 
+ * @param *stream instance. 
+ */
+void destroy_pool_stream(pool_stream_t *stream)
+{
+    if (stream != NULL) {
+        atomic_store_explicit(&stream->running, false, memory_order_release);
+        syscall(SYS_futex, &stream->pool->shared->epoch, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+                NULL, NULL, 0);
+        for (uint32_t i = 0; i < stream->nthreads; i++) {
+            pthread_join(stream->threads[i], NULL);
+        }
+
+        if (stream->ring != NULL) {
+            pool_uring_free(stream->ring);
+        }
+        stream->pool->stream = NULL;
+        free(stream->threads);
+        free(stream);
+    }
+}
+
+/**
+ * @brief Error that stopped `stream`.
+ * 
+ * @param *stream instance. 
+ * @return int 0 while the stream runs, else the errno value of
+ * the failed read or `io_uring_enter` call (ENODATA when a file
+ * became empty).
+ */
+int pool_stream_error(pool_stream_t *stream)
 {
-    pool->cursor = new_cursor % POOL_BLOCK_SIZE;
-}
\ No newline at end of file
+    return atomic_load_explicit(&stream->error, memory_order_acquire);
+}
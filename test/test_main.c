@@ -17,9 +17,24 @@
  * along with Pool32.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "../src/include/pool.h"
+#include "../src/include/pool_typed.h"
+#include "../src/include/chacha20.h"
 
 
 void test_create_pool(void)
@@ -28,8 +43,10 @@ void test_create_pool(void)
 
     assert(pool->cursor == 0);
     assert(pool->iterations == 0);
-    assert(pool->locked == false);
-    assert(pool->current_block == POOL_BLOCK_A);
+    assert(pool->shared->epoch == 0);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+    assert(pool->states[0] == POOL_STATE_ACTIVE);
+    assert(pool->states[1] == POOL_STATE_READY);
 
     destroy_pool(pool);
 }
@@ -101,6 +118,1500 @@ void test_switch(void)
     destroy_pool(pool);
 }
 
+void test_ring(void)
+{
+    pool_t *pool = create_pool_ex(300, 3, 10);
+    uint32_t i;
+
+    assert(pool != NULL);
+    assert(pool->block_size == 100);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+
+    for (i = 0; i < pool->nblocks; i++) {
+        pool_fill_area(pool, i, i * pool->block_size, pool->block_size);
+    }
+
+    assert(pool_get(pool, 0) == 0);
+    pool_switch_block_s(pool);
+    assert(pool->shared->current_block == 100);
+    assert(pool_get(pool, 250) == 1);
+    pool_switch_block_s(pool);
+    assert(pool_get(pool, 99) == 2);
+    pool_switch_block_s(pool);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+
+    pool_set_cursor(pool, 99);
+    pool_insert(pool, 0xffffffff);
+    assert(pool->cursor == 0);
+    assert(pool->pool[99] == 0xffffffff);
+
+    destroy_pool(pool);
+
+    assert(create_pool_ex(300, 1, 10) == NULL);
+    assert(create_pool_ex(301, 3, 10) == NULL);
+    assert(create_pool_ex(0, 2, 10) == NULL);
+}
+
+void test_refill(void)
+{
+    pool_t *pool = create_pool_ex(300, 3, POOL_MAX_IT);
+    uint32_t block, other;
+
+    /* Nothing has been consumed yet, so there is nothing to refill. */
+    assert(pool_refill_begin(pool, &block) == -1);
+
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool->shared->epoch == 1);
+    assert(pool_refill_begin(pool, &block) == 0);
+    assert(block == POOL_BLOCK_A);
+    assert(pool->states[0] == POOL_STATE_FILLING);
+    pool_fill_area(pool, 0xaaaaaaaa, block, pool->block_size);
+
+    /* The READY block is taken, then the FILLING one is skipped. */
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool->shared->current_block == 200);
+    assert(pool_refill_begin(pool, &other) == 0);
+    assert(other == 100);
+
+    /* Every standby block is FILLING: the switch is left pending... */
+    assert(pool_switch_block_s(pool) == -1);
+    assert(pool->shared->switch_pending == true);
+    assert(pool->shared->current_block == 200);
+
+    /* ...and performed by the publication of the first refill. */
+    pool_refill_end(pool, block);
+    assert(pool->shared->switch_pending == false);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+    assert(pool_get(pool, 7) == 0xaaaaaaaa);
+
+    pool_refill_end(pool, other);
+    assert(pool->states[1] == POOL_STATE_READY);
+    assert(pool->states[2] == POOL_STATE_STALE);
+
+    destroy_pool(pool);
+}
+
+void fill_block(pool_t *pool, uint32_t block, void *arg)
+{
+    atomic_uint *calls = (atomic_uint*)arg;
+
+    atomic_fetch_add(calls, 1);
+    pool_fill_area(pool, 0xdddddddd, block, pool->block_size);
+}
+
+void test_service(void)
+{
+    pool_service_t *service = create_pool_service(2, 8);
+    pool_t *a = create_pool_ex(300, 3, POOL_MAX_IT);
+    pool_t *b = create_pool();
+    atomic_uint calls = ATOMIC_VAR_INIT(0);
+
+    assert(create_pool_service(0, 8) == NULL);
+    assert(create_pool_service(2, 0) == NULL);
+    assert(service != NULL);
+
+    pool_set_refill(a, service, &fill_block, &calls);
+    pool_set_refill(b, service, &fill_block, &calls);
+
+    /* Each switch queues a refill of the block it left behind. */
+    assert(pool_switch_block_s(a) == 0);
+    assert(pool_switch_block_s(b) == 0);
+    pool_service_drain(service);
+
+    assert(calls == 2);
+    assert(a->states[0] == POOL_STATE_READY);
+    assert(b->states[0] == POOL_STATE_READY);
+    assert(a->pool[POOL_BLOCK_A] == 0xdddddddd);
+    assert(b->pool[POOL_BLOCK_A + 99] == 0xdddddddd);
+
+    /* Without a STALE block the job is dropped. */
+    assert(pool_service_submit(service, a, &fill_block, &calls) == 0);
+    assert(pool_switch_block_s(b) == 0);
+    destroy_pool_service(service);
+    assert(calls == 3);
+    assert(b->pool[POOL_BLOCK_B] == 0xdddddddd);
+
+    destroy_pool(a);
+    destroy_pool(b);
+}
+
+void count_up(uint32_t *data, uint32_t len, void *arg)
+{
+    atomic_uint *calls = (atomic_uint*)arg;
+    uint32_t call = atomic_fetch_add(calls, 1);
+
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = call;
+    }
+}
+
+void test_producer(void)
+{
+    pool_service_t *service = create_pool_service(1, 8);
+    atomic_uint calls = ATOMIC_VAR_INIT(0);
+    pool_t *pool;
+
+    assert(create_pool_producer(300, 3, POOL_MAX_IT, NULL, &count_up, &calls) == NULL);
+    assert(create_pool_producer(300, 3, POOL_MAX_IT, service, NULL, &calls) == NULL);
+
+    pool = create_pool_producer(300, 3, POOL_MAX_IT, service, &count_up, &calls);
+    assert(pool != NULL);
+    assert(pool_get(pool, 0) == 0);
+
+    pool_service_drain(service);
+    assert(calls == 3);
+    assert(pool->states[1] == POOL_STATE_READY);
+    assert(pool->states[2] == POOL_STATE_READY);
+
+    /* Consume both fresh blocks; the next switch must wait for
+     * the producer instead of recycling the consumed block. */
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool_switch_block_s(pool) == 0);
+    pool_service_drain(service);
+    assert(calls == 5);
+
+    /* The first block was produced again, then the second one. */
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool_get(pool, 0) == 3);
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool_get(pool, 0) == 4);
+
+    destroy_pool_service(service);
+    destroy_pool(pool);
+}
+
+void test_chacha20(void)
+{
+    /* RFC 8439, section 2.3.2. */
+    static const uint32_t expected[CHACHA20_BLOCK_WORDS] = {
+        0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+        0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+        0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+        0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2,
+    };
+    uint8_t key[32];
+    uint8_t nonce[12] = {0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0};
+    static uint32_t reference[1000], output[1000];
+    chacha20_t ctx;
+    uint32_t i;
+    int kernel;
+
+    for (i = 0; i < 32; i++) {
+        key[i] = (uint8_t)i;
+    }
+
+    for (kernel = CHACHA20_SCALAR; kernel <= CHACHA20_AVX512; kernel++) {
+        if (!chacha20_kernel_supported(kernel)) {
+            continue;
+        }
+
+        chacha20_init(&ctx, key, nonce, 1);
+        assert(chacha20_set_kernel(&ctx, kernel) == 0);
+        chacha20_keystream(&ctx, output, CHACHA20_BLOCK_WORDS);
+        for (i = 0; i < CHACHA20_BLOCK_WORDS; i++) {
+            assert(output[i] == expected[i]);
+        }
+
+        /* Start right below the carry into the nonce, so every
+         * kernel also takes its scalar path for that group. */
+        chacha20_init(&ctx, key, nonce, UINT32_MAX - 20);
+        assert(chacha20_set_kernel(&ctx, kernel) == 0);
+        chacha20_keystream(&ctx, output, 999);
+        chacha20_keystream(&ctx, output + 999, 1);
+        if (kernel == CHACHA20_SCALAR) {
+            for (i = 0; i < 1000; i++) {
+                reference[i] = output[i];
+            }
+        }
+        for (i = 0; i < 1000; i++) {
+            assert(output[i] == reference[i]);
+        }
+    }
+    assert(chacha20_set_kernel(&ctx, CHACHA20_AUTO) == 0);
+    assert(ctx.kernel != CHACHA20_AUTO);
+}
+
+void test_batch(void)
+{
+    pool_t *pool = create_pool_ex(32, 2, 1000);
+    uint32_t values[40], out[40];
+    uint32_t i;
+
+    for (i = 0; i < 40; i++) {
+        values[i] = i;
+    }
+
+    /* Wraps around the 16-element block. */
+    pool_set_cursor(pool, 10);
+    pool_insert_many(pool, values, 10);
+    assert(pool->cursor == 4);
+    assert(pool->pool[10] == 0 && pool->pool[15] == 5);
+    assert(pool->pool[0] == 6 && pool->pool[3] == 9);
+    assert(pool->pool[16] == 0);
+
+    pool_get_many(pool, 14, out, 6);
+    assert(out[0] == 4 && out[1] == 5 && out[2] == 6 && out[5] == 9);
+    assert(pool->iterations == 6);
+
+    /* Same result as one pool_insert per value. */
+    pool_set_cursor(pool, 0);
+    pool_insert_many(pool, values, 40);
+    for (i = 0; i < 16; i++) {
+        assert(pool_get(pool, (40 + i) % 16) == 24 + i);
+    }
+
+    /* A batch reaching `max_it` switches once, before the copy. */
+    pool_fill_area(pool, 0x12345678, POOL_BLOCK_A + 16, 16);
+    pool->max_it = 30;
+    pool_get_many(pool, 0, out, 16);
+    assert(pool->shared->current_block == 16);
+    assert(pool->iterations == 0);
+    for (i = 0; i < 16; i++) {
+        assert(out[i] == 0x12345678);
+    }
+
+    pool_fill_area(pool, 0x0badcafe, 3, 21);
+    assert(pool->pool[2] != 0x0badcafe);
+    for (i = 3; i < 24; i++) {
+        assert(pool->pool[i] == 0x0badcafe);
+    }
+    assert(pool->pool[24] == 0x12345678);
+
+    destroy_pool(pool);
+}
+
+void test_reserve(void)
+{
+    pool_t *pool = create_pool_ex(32, 2, 20);
+    pool_span_t span, other;
+    uint32_t block;
+
+    pool_fill_area(pool, 7, POOL_BLOCK_A, 16);
+
+    assert(pool_reserve(pool, 4, 8, &span) == 8);
+    assert(span.data == pool->pool + 4);
+    assert(span.data[7] == 7);
+    assert(pool->pins[0] == 1);
+
+    /* Shortened at the end of the block. */
+    assert(pool_reserve(pool, 30, 8, &other) == 2);
+    assert(other.data == pool->pool + 14);
+    pool_release(pool, &other);
+    assert(pool->iterations == 2);
+
+    /* The pinned block can be switched away from, but not refilled. */
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool->states[0] == POOL_STATE_STALE);
+    assert(pool_refill_begin(pool, &block) == -1);
+    assert(pool->states[0] == POOL_STATE_STALE);
+    assert(span.data[0] == 7);
+
+    pool_release(pool, &span);
+    assert(span.length == 0);
+    assert(pool->pins[0] == 0);
+    assert(pool->iterations == 8);
+    assert(pool_refill_begin(pool, &block) == 0);
+    assert(block == POOL_BLOCK_A);
+    pool_refill_end(pool, block);
+
+    /* Releasing enough values uses up the iteration budget. */
+    pool_reserve(pool, 0, 16, &span);
+    pool_release(pool, &span);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+
+    destroy_pool(pool);
+}
+
+void unique_values(uint32_t *data, uint32_t len, void *arg)
+{
+    atomic_uint *next = (atomic_uint*)arg;
+    uint32_t first = atomic_fetch_add(next, len);
+
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = first + i;
+    }
+}
+
+struct taker_args {
+    pool_t *pool;
+    uint32_t *out;
+    uint32_t count;
+};
+
+void *taker_routine(void *args)
+{
+    struct taker_args *arguments = (struct taker_args*)args;
+    uint32_t taken = 0;
+
+    while (taken < arguments->count) {
+        uint32_t n = arguments->count - taken;
+
+        if (n > 7) {
+            n = 7;
+        }
+        taken += pool_take_many(arguments->pool, arguments->out + taken, n);
+        if (taken < arguments->count) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_take(void)
+{
+    pool_t *pool = create_pool_ex(48, 3, POOL_MAX_IT);
+    pool_service_t *service = create_pool_service(1, 8);
+    atomic_uint next = ATOMIC_VAR_INIT(0);
+    static uint32_t out[4][1000];
+    static bool seen[8000];
+    struct taker_args args[4];
+    pthread_t threads[4];
+    uint32_t value, i, j;
+
+    /* Every block is handed out once, then the pool runs dry. */
+    pool_fill_area(pool, 1, 0, 16);
+    pool_fill_area(pool, 2, 16, 16);
+    pool_fill_area(pool, 3, 32, 16);
+    for (i = 0; i < 48; i++) {
+        assert(pool_take(pool, &value) == 0);
+        assert(value == 1 + i / 16);
+    }
+    assert(pool_take(pool, &value) == -1);
+    assert(pool_take_many(pool, out[0], 4) == 0);
+    assert(pool->shared->current_block == 32);
+    destroy_pool(pool);
+
+    /* A request larger than a block spans blocks, and the slot
+     * never carries into the block half of the cursor. */
+    pool = create_pool_ex(48, 3, POOL_MAX_IT);
+    pool_fill_area(pool, 1, 0, 16);
+    pool_fill_area(pool, 2, 16, 16);
+    pool_fill_area(pool, 3, 32, 16);
+    assert(pool_take_many(pool, out[0], 5) == 5);
+    assert(pool_take_many(pool, out[0], UINT32_MAX) == 43);
+    for (i = 0; i < 43; i++) {
+        assert(out[0][i] == 1 + (i + 5) / 16);
+    }
+    assert((uint32_t)(pool->shared->take >> 32) == 32);
+    assert((uint32_t)pool->shared->take <= 16);
+    destroy_pool(pool);
+
+    /* No value is handed out twice across threads. */
+    pool = create_pool_producer(96, 3, POOL_MAX_IT, service, &unique_values, &next);
+    for (i = 0; i < 4; i++) {
+        args[i] = (struct taker_args){.pool = pool, .out = out[i], .count = 1000};
+        assert(pthread_create(&threads[i], NULL, &taker_routine, &args[i]) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        for (j = 0; j < 1000; j++) {
+            assert(out[i][j] < 8000);
+            assert(!seen[out[i][j]]);
+            seen[out[i][j]] = true;
+        }
+    }
+
+    destroy_pool_service(service);
+    destroy_pool(pool);
+}
+
+void test_shard(void)
+{
+    pool_t *pool = create_pool_ex(32, 2, 16);
+    pool_shard_t *a = pool_shard_register(pool);
+    pool_shard_t *b = pool_shard_register(pool);
+    uint32_t i;
+
+    assert((uintptr_t)pool % POOL_CACHELINE == 0);
+    assert((uintptr_t)a % POOL_CACHELINE == 0);
+    assert(offsetof(pool_t, shared) / POOL_CACHELINE !=
+           offsetof(pool_t, iterations) / POOL_CACHELINE);
+    assert(offsetof(pool_shared_t, current_block) / POOL_CACHELINE !=
+           offsetof(pool_shared_t, shard_reads) / POOL_CACHELINE);
+    assert(a->quota == 2);
+
+    pool_shard_set_cursor(a, 0);
+    pool_shard_set_cursor(b, 8);
+    for (i = 0; i < 8; i++) {
+        pool_shard_insert(a, i);
+        pool_shard_insert(b, 100 + i);
+    }
+    assert(a->cursor == 8 && b->cursor == 0);
+    assert(pool->cursor == 0);
+
+    /* Reads are flushed in batches of `quota`... */
+    assert(pool_shard_get(a, 3) == 3);
+    assert(pool->shared->shard_reads == 0);
+    assert(pool_shard_get(b, 9) == 101);
+    assert(pool_shard_get(a, 9) == 101);
+    assert(pool->shared->shard_reads == 2);
+    assert(pool->iterations == 0);
+
+    /* ...and the block is switched once they add up to `max_it`. */
+    for (i = 0; i < 12; i++) {
+        pool_shard_get(b, 0);
+    }
+    pool_shard_get(a, 0);
+    assert(pool->shared->shard_reads == 14);
+    pool_shard_unregister(b);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+    pool_shard_unregister(a);
+    assert(pool->shared->current_block == 16);
+    assert(pool->shared->shard_reads == 0);
+
+    destroy_pool(pool);
+}
+
+void test_backing(void)
+{
+    pool_options_t opts;
+    pool_replicas_t *replicas;
+    pool_t *pool;
+    uint32_t i;
+
+    pool_options_init(&opts);
+    assert(opts.backing == POOL_BACKING_HEAP && opts.numa_node == -1);
+
+    /* The alignment must be a power of two. */
+    opts.alignment = 3000;
+    assert(create_pool_opts(3000, 3, POOL_MAX_IT, &opts) == NULL);
+
+    opts.alignment = 4096;
+    pool = create_pool_opts(3000, 3, POOL_MAX_IT, &opts);
+    assert((uintptr_t)pool->pool % 4096 == 0);
+    assert(pool->mapping == 0);
+    destroy_pool(pool);
+
+    /* Mapped storage starts zeroed without being written. */
+    opts.backing = POOL_BACKING_MMAP;
+    pool = create_pool_opts(1 << 20, 4, POOL_MAX_IT, &opts);
+    assert(pool->mapping == (1 << 20) * sizeof(uint32_t));
+    for (i = 0; i < pool->size; i += 4096) {
+        assert(pool->pool[i] == 0);
+    }
+    pool_fill_area(pool, 0xcccccccc, POOL_BLOCK_A, pool->block_size);
+    assert(pool_get(pool, 12345) == 0xcccccccc);
+    destroy_pool(pool);
+
+    /* Without reserved huge pages this falls back to THP. */
+    opts.backing = POOL_BACKING_HUGETLB;
+    opts.alignment = 0;
+    opts.numa_node = 0;
+    pool = create_pool_opts(1 << 20, 2, POOL_MAX_IT, &opts);
+    assert((uintptr_t)pool->pool % POOL_HUGE_PAGE == 0);
+    assert(pool->mapping >= (1 << 20) * sizeof(uint32_t));
+    assert(pool->numa_node == 0 || pool->numa_node == -1);
+    pool_fill(pool, 0x01020304);
+    assert(pool->pool[pool->size - 1] == 0x01020304);
+    destroy_pool(pool);
+
+    replicas = create_pool_replicas(300, 3, POOL_MAX_IT, NULL, NULL, NULL, NULL);
+    assert(replicas->nnodes >= 1);
+    pool = pool_replica_local(replicas);
+    assert(pool != NULL && pool->mapping != 0);
+    pool_insert_at(pool, 7, 3);
+    assert(pool_get(pool, 3) == 7);
+    destroy_pool_replicas(replicas);
+    assert(create_pool_replicas(301, 3, POOL_MAX_IT, NULL, NULL, NULL, NULL) == NULL);
+}
+
+void test_mapped(void)
+{
+    char path[] = "/tmp/pool_test_XXXXXX";
+    pool_service_t *service;
+    atomic_uint calls = ATOMIC_VAR_INIT(0);
+    pool_t *pool;
+    uint32_t block;
+    uint64_t generation;
+    int fd = mkstemp(path);
+
+    assert(fd >= 0);
+    close(fd);
+
+    pool = create_pool_mapped(path, 300, 3, POOL_MAX_IT, NULL, NULL, NULL);
+    assert(pool != NULL);
+    assert(pool->file->magic == POOL_FILE_MAGIC);
+    assert(pool->states == pool->file->states);
+    assert(pool_get(pool, 5) == 0);
+
+    pool_fill_area(pool, 0xbbbbbbbb, POOL_BLOCK_B, 100);
+    assert(pool_switch_block_s(pool) == 0);
+    pool_set_cursor(pool, 41);
+
+    /* Leave a refill half done, as a crash would. */
+    assert(pool_refill_begin(pool, &block) == 0);
+    assert(block == POOL_BLOCK_A);
+    pool->pool[block] = 0xdeadbeef;
+    generation = pool->file->generation;
+    destroy_pool(pool);
+
+    /* Another geometry is refused. */
+    assert(create_pool_mapped(path, 400, 4, POOL_MAX_IT, NULL, NULL, NULL) == NULL);
+
+    pool = create_pool_mapped(path, 300, 3, POOL_MAX_IT, NULL, NULL, NULL);
+    assert(pool != NULL);
+    assert(pool->shared->current_block == POOL_BLOCK_B);
+    assert(pool->cursor == 41);
+    assert(pool->file->generation == generation);
+    assert(pool_get(pool, 0) == 0xbbbbbbbb);
+    assert(pool->states[0] == POOL_STATE_STALE);
+    assert(pool->states[1] == POOL_STATE_ACTIVE);
+    assert(pool->states[2] == POOL_STATE_READY);
+    assert(pool_sync(pool) == 0);
+    destroy_pool(pool);
+
+    /* A producer only refills what the restart left STALE. */
+    service = create_pool_service(1, 4);
+    pool = create_pool_mapped(path, 300, 3, POOL_MAX_IT, service, &count_up, &calls);
+    pool_service_drain(service);
+    assert(calls == 1);
+    assert(pool->states[0] == POOL_STATE_READY);
+    assert(pool->pool[0] == 0);
+    assert(pool_get(pool, 0) == 0xbbbbbbbb);
+    destroy_pool_service(service);
+    destroy_pool(pool);
+
+    unlink(path);
+
+    pool = create_pool();
+    assert(pool_sync(pool) == -1);
+    destroy_pool(pool);
+}
+
+void test_shared(void)
+{
+    const char *name = "/pool32-test";
+    atomic_uint calls = ATOMIC_VAR_INIT(0);
+    pool_t *pool, *consumer;
+    pool_span_t span;
+    uint32_t block, other;
+    bool stale = true;
+    int status;
+    pid_t pid;
+
+    shm_unlink(name);
+    assert(create_pool_shared(name, 30, 4, POOL_MAX_IT, NULL, NULL) == NULL);
+    pool = create_pool_shared(name, 32, 4, POOL_MAX_IT, NULL, NULL);
+    assert(pool != NULL);
+    assert(create_pool_shared(name, 32, 4, POOL_MAX_IT, NULL, NULL) == NULL);
+    pool_fill(pool, 7);
+
+    /* The child switches the shared main block and dies holding
+     * a span. */
+    pid = fork();
+    if (pid == 0) {
+        consumer = pool_attach(name, POOL_MAX_IT);
+        if (consumer == NULL || consumer->slot != 1 || pool_get(consumer, 3) != 7 ||
+            pool_switch_block_s(consumer) != 0 || pool_reserve(consumer, 0, 8, &span) != 8) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(pool->shared->current_block == 8);
+    assert(pool->shm->slots[1] == pid);
+
+    /* Its pin keeps the block from being refilled until reaped. */
+    assert(pool_switch_block_s(pool) == 0);
+    assert(pool_refill_begin(pool, &block) == 0);
+    assert(block == 0);
+    assert(pool_refill_begin(pool, &other) == -1);
+    assert(pool_shared_reap(pool) == 1);
+    assert(pool->shm->slots[1] == 0);
+    assert(pool_refill_begin(pool, &other) == 0);
+    assert(other == 8);
+    pool_refill_end(pool, block);
+    pool_refill_end(pool, other);
+    destroy_pool(pool);
+    assert(pool_attach(name, POOL_MAX_IT) == NULL);
+
+    /* One producer feeds a consumer in another process. */
+    pool = create_pool_shared(name, 32, 4, POOL_MAX_IT, &count_up, &calls);
+    assert(pool != NULL);
+    pid = fork();
+    if (pid == 0) {
+        consumer = pool_attach(name, POOL_MAX_IT);
+        if (consumer == NULL || pool_get(consumer, 0) != 0) {
+            _exit(1);
+        }
+        while (pool_switch_block_s(consumer) != 0) {
+            sched_yield();
+        }
+        if (pool_get(consumer, 0) == 0) {
+            _exit(2);
+        }
+        destroy_pool(consumer);
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(pool->shm->slots[1] == 0);
+
+    /* The block the consumer left is produced again. */
+    for (int i = 0; i < 1000 && stale; i++) {
+        stale = false;
+        for (uint32_t n = 0; n < pool->nblocks; n++) {
+            stale |= (pool->states[n] == POOL_STATE_STALE);
+        }
+        usleep(1000);
+    }
+    assert(!stale);
+    assert(calls > pool->nblocks);
+    destroy_pool(pool);
+}
+
+struct stats_args {
+    pool_t *pool;
+    uint32_t first;
+};
+
+void *stats_writer(void *args)
+{
+    struct stats_args *a = (struct stats_args*)args;
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        pool_insert_at(a->pool, i, a->first + i);
+    }
+    return NULL;
+}
+
+void test_stats(void)
+{
+    pool_t *pool = create_pool_ex(32, 2, 8);
+    pool_t *wide = create_pool_ex(8000, 2, POOL_MAX_IT);
+    struct stats_args args[4];
+    pthread_t threads[4];
+    pool_stats_t stats;
+    uint64_t switches = 0;
+    uint32_t block, i;
+
+    pool_stats_snapshot(pool, &stats);
+    assert(stats.counts[POOL_STAT_GETS] == 0);
+    assert(pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.5) == 0);
+
+    for (i = 0; i < 20; i++) {
+        pool_get(pool, i);
+    }
+    pool_insert(pool, 1);
+
+    /* With the only standby block FILLING, the switch is left
+     * pending and the next reads are past `max_it`. */
+    assert(pool_refill_begin(pool, &block) == 0);
+    for (i = 0; i < 4; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool_refill_begin(pool, &i) == -1);
+    pool_refill_end(pool, block);
+
+    /* Writers on disjoint ranges count in their own stripes; the
+     * second wave reuses the stripes of the exited first one. */
+    for (uint32_t wave = 1; wave <= 2; wave++) {
+        for (i = 0; i < 4; i++) {
+            args[i].pool = wide;
+            args[i].first = i * 1000;
+            pthread_create(&threads[i], NULL, &stats_writer, &args[i]);
+        }
+        for (i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pool_stats_snapshot(wide, &stats);
+        assert(stats.counts[POOL_STAT_INSERTS] == wave * 4000);
+    }
+    destroy_pool(wide);
+
+    pool_stats_snapshot(pool, &stats);
+    assert(stats.counts[POOL_STAT_GETS] == 24);
+    assert(stats.counts[POOL_STAT_INSERTS] == 1);
+    assert(stats.counts[POOL_STAT_SWITCHES] == 3);
+    assert(stats.counts[POOL_STAT_SWITCH_PENDING] == 1);
+    assert(stats.counts[POOL_STAT_EXHAUSTED_READS] == 1);
+    assert(stats.counts[POOL_STAT_REFILLS] == 1);
+    assert(stats.counts[POOL_STAT_REFILL_MISSES] == 1);
+
+    for (i = 0; i < POOL_HIST_BUCKETS; i++) {
+        switches += stats.latency[POOL_HIST_SWITCH][i];
+    }
+    assert(switches == 3);
+    assert(pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.5) <=
+           pool_stats_percentile(&stats, POOL_HIST_SWITCH, 0.99));
+    assert(pool_stats_percentile(&stats, POOL_HIST_REFILL, 1.0) > 0);
+
+    destroy_pool(pool);
+}
+
+void test_perf(void)
+{
+    pool_t *pool = create_pool_ex(32, 2, 8);
+    pool_stats_t stats;
+    pool_perf_t perf;
+    int opened = pool_perf_open(&perf);
+    bool task_clock = (perf.fds[POOL_PERF_TASK_CLOCK] >= 0);
+    bool hardware = (perf.leaders[POOL_PERF_GROUP_HW] >= 0);
+    uint32_t i;
+
+    assert(opened >= 0 && opened <= POOL_PERF_COUNTERS);
+
+    pool_perf_begin(&perf);
+    for (i = 0; i < 1000; i++) {
+        pool_get(pool, i);
+    }
+    pool_perf_end(&perf, pool, 1000);
+    pool_perf_close(&perf);
+    assert(perf.leaders[POOL_PERF_GROUP_HW] == -1 && perf.leaders[POOL_PERF_GROUP_SW] == -1);
+
+    /* Without perf events nothing is recorded, and nothing fails. */
+    pool_stats_snapshot(pool, &stats);
+    assert(stats.counts[POOL_STAT_GETS] == 1000);
+    if (opened == 0) {
+        assert(stats.counts[POOL_STAT_PERF_OPS] == 0);
+    } else if (hardware) {
+        /* A PMU group that was never scheduled drops the batch. */
+        assert(stats.counts[POOL_STAT_PERF_OPS] == 1000 || stats.counts[POOL_STAT_PERF_OPS] == 0);
+    } else {
+        assert(stats.counts[POOL_STAT_PERF_OPS] == 1000);
+    }
+    if (task_clock && stats.counts[POOL_STAT_PERF_OPS] != 0) {
+        assert(stats.counts[POOL_STAT_TASK_CLOCK] > 0);
+    }
+
+    destroy_pool(pool);
+}
+
+void test_trace(void)
+{
+    char path[] = "/tmp/pool_trace_XXXXXX";
+    pool_t *pool = create_pool_ex(32, 2, 8);
+    uint32_t block, i;
+    int fd = mkstemp(path);
+
+    assert(fd >= 0);
+    close(fd);
+
+    for (i = 0; i < 20; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool_refill_begin(pool, &block) == 0);
+    pool_get(pool, 0);
+    pool_refill_end(pool, block);
+
+#ifdef POOL_TRACE
+    FILE *f;
+    char *json;
+    long len;
+
+    assert(pool_trace_dump(path) == 0);
+    f = fopen(path, "r");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    json = calloc(1, (size_t)len + 1);
+    assert(fread(json, 1, (size_t)len, f) == (size_t)len);
+    fclose(f);
+
+    assert(strstr(json, "\"traceEvents\"") != NULL);
+    assert(strstr(json, "\"name\": \"switch\"") != NULL);
+    assert(strstr(json, "\"name\": \"switch_pending\"") != NULL);
+    assert(strstr(json, "\"name\": \"stall\"") != NULL);
+    assert(strstr(json, "\"name\": \"refill\"") != NULL);
+    assert(strstr(json, "\"ph\": \"X\"") != NULL);
+    free(json);
+#else
+    assert(pool_trace_dump(path) == -1);
+#endif
+
+    unlink(path);
+    destroy_pool(pool);
+}
+
+void test_policy(void)
+{
+    pool_options_t opts;
+    pool_t *pool;
+    uint32_t i;
+
+    pool_options_init(&opts);
+    assert(opts.policy == POOL_POLICY_COUNT);
+    opts.policy = POOL_POLICY_TIME;
+    assert(create_pool_opts(64, 2, 16, &opts) == NULL);
+    opts.policy = 42;
+    assert(create_pool_opts(64, 2, 16, &opts) == NULL);
+
+    /* Time: reads do not switch a young block, the first read
+     * after `max_age` does (the clock is read every stride). */
+    opts.policy = POOL_POLICY_TIME;
+    opts.max_age = 50 * 1000 * 1000;
+    pool = create_pool_opts(64, 2, 16, &opts);
+    for (i = 0; i < 1000; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool->shared->current_block == 0);
+    usleep(60 * 1000);
+    for (i = 0; i <= POOL_TIME_STRIDE && pool->shared->current_block == 0; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool->shared->current_block == 32);
+    assert(pool->threshold == POOL_TIME_STRIDE);
+    destroy_pool(pool);
+
+    /* Adaptive: slow refills and fast reads push the threshold up
+     * to its bound, fast refills and slow reads down to its bound. */
+    opts.policy = POOL_POLICY_ADAPTIVE;
+    pool = create_pool_opts(64, 2, 2 * POOL_ADAPTIVE_RANGE, &opts);
+    assert(pool->threshold == 2 * POOL_ADAPTIVE_RANGE);
+    pool->refill_cost = 1000 * 1000 * 1000;
+    pool->read_cost = 10 << 8;
+    for (i = 0; i < 2 * POOL_ADAPTIVE_RANGE; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool->shared->current_block == 32);
+    assert(pool->threshold == 2 * POOL_ADAPTIVE_RANGE * POOL_ADAPTIVE_RANGE);
+    for (i = 0; i < 2 * POOL_ADAPTIVE_RANGE * POOL_ADAPTIVE_RANGE - 1; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool->shared->current_block == 32);
+    pool_get(pool, 0);
+    assert(pool->shared->current_block == 0);
+
+    pool->refill_cost = 1;
+    pool->read_cost = 1000000 << 8;
+    for (i = 0; i < 2 * POOL_ADAPTIVE_RANGE * POOL_ADAPTIVE_RANGE; i++) {
+        pool_get(pool, i);
+    }
+    assert(pool->threshold == 2);
+    destroy_pool(pool);
+}
+
+struct wait_args {
+    pool_t *pool;
+    atomic_bool done;
+    int ret;
+};
+
+void *wait_switch(void *arg)
+{
+    struct wait_args *args = (struct wait_args*)arg;
+
+    args->ret = pool_switch_block_wait(args->pool);
+    atomic_store(&args->done, true);
+    return NULL;
+}
+
+void test_wait(void)
+{
+    pool_t *pool = create_pool_ex(200, 2, POOL_MAX_IT);
+    struct wait_args args = { .pool = pool, .ret = -1 };
+    struct timespec start, deadline, now;
+    uint32_t block, other;
+    pthread_t thread;
+
+    atomic_init(&args.done, false);
+
+    /* A READY block is taken without waiting. */
+    assert(pool_switch_block_wait(pool) == 0);
+    assert(pool->shared->current_block == 100);
+    assert(pool_refill_begin(pool, &block) == 0);
+    assert(block == POOL_BLOCK_A);
+
+    /* The only standby block is FILLING: the waiter sleeps until
+     * it is published. */
+    pthread_create(&thread, NULL, wait_switch, &args);
+    usleep(20 * 1000);
+    assert(atomic_load(&args.done) == false);
+    pool_refill_end(pool, block);
+    pthread_join(thread, NULL);
+    assert(args.ret == 0);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+
+    /* Nothing is published before the deadline. */
+    assert(pool_refill_begin(pool, &other) == 0);
+    assert(other == 100);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_nsec += 20 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    assert(pool_switch_block_timedwait(pool, &deadline) == -1);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    assert((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) >= 20 * 1000 * 1000);
+    assert(pool->shared->current_block == POOL_BLOCK_A);
+
+    /* The switch stays pending and the publication performs it. */
+    pool_refill_end(pool, other);
+    assert(pool->shared->current_block == 100);
+
+    destroy_pool(pool);
+}
+
+void test_events(void)
+{
+    pool_t *pool = create_pool_ex(200, 2, 10);
+    int publish = pool_event_fd(pool, POOL_EVENT_PUBLISH);
+    int low = pool_event_fd(pool, POOL_EVENT_LOW_WATER);
+    struct pollfd fds[2] = { { .fd = publish, .events = POLLIN }, { .fd = low, .events = POLLIN } };
+    uint64_t count;
+    uint32_t block, i;
+
+    assert(publish >= 0 && low >= 0 && publish != low);
+    assert(pool_event_fd(pool, POOL_EVENT_PUBLISH) == publish);
+    assert(pool_event_fd(pool, POOL_EVENTS) == -1);
+    assert(poll(fds, 2, 0) == 0);
+
+    /* The low watermark fires once, 3 reads before the switch. */
+    pool_set_low_watermark(pool, 3);
+    for (i = 0; i < 6; i++) {
+        pool_get(pool, i);
+    }
+    assert(poll(fds, 2, 0) == 0);
+    pool_get(pool, 6);
+    assert(poll(fds, 2, 0) == 1 && fds[1].revents == POLLIN);
+    pool_get(pool, 7);
+    pool_get(pool, 8);
+    assert(read(low, &count, sizeof(count)) == sizeof(count) && count == 1);
+
+    /* The switch re-arms it; publications are counted. */
+    pool_get(pool, 9);
+    assert(pool->shared->current_block == 100);
+    assert(pool_refill_begin(pool, &block) == 0);
+    pool_refill_end(pool, block);
+    for (i = 0; i < 7; i++) {
+        pool_get(pool, i);
+    }
+    assert(poll(fds, 2, 0) == 2);
+    assert(read(publish, &count, sizeof(count)) == sizeof(count) && count == 1);
+    assert(read(low, &count, sizeof(count)) == sizeof(count) && count == 1);
+    assert(read(low, &count, sizeof(count)) == -1);
+
+    destroy_pool(pool);
+}
+
+void test_elems(void)
+{
+    static const uint32_t sizes[] = { 4, 8, 12, 16, 64, POOL_ELEM_MAX };
+    uint8_t elem[POOL_ELEM_MAX], out[4 * POOL_ELEM_MAX];
+    pool_options_t opts;
+    pool_t *pool;
+    uint64_t ids[3], id;
+    uint32_t i, k;
+
+    pool_options_init(&opts);
+    assert(opts.elem_size == sizeof(uint32_t));
+    opts.elem_size = 6;
+    assert(create_pool_opts(100, 2, 10, &opts) == NULL);
+    opts.elem_size = POOL_ELEM_MAX + 4;
+    assert(create_pool_opts(100, 2, 10, &opts) == NULL);
+
+    /* 64-bit IDs: `size` counts elements, blocks keep switching
+     * after `max_it` reads. */
+    opts.elem_size = sizeof(uint64_t);
+    pool = create_pool_opts(100, 2, 10, &opts);
+    assert(pool->size == 200 && pool->block_size == 100 && pool->block_elems == 50);
+
+    id = 0x1122334455667788ULL;
+    pool_insert_elem(pool, &id);
+    id = 0x99aabbccddeeff00ULL;
+    pool_insert_elem_at(pool, &id, 51);
+    pool_get_elem(pool, 0, &id);
+    assert(id == 0x1122334455667788ULL);
+    pool_get_elem(pool, 1, &id);
+    assert(id == 0x99aabbccddeeff00ULL);
+
+    ids[0] = 1;
+    ids[1] = 2;
+    ids[2] = 3;
+    pool_set_cursor(pool, 98);
+    pool_insert_elems(pool, ids, 3);
+    assert(pool->cursor == 4);
+    pool_get_elems(pool, 49, ids, 3);
+    assert(ids[0] == 1 && ids[1] == 2 && ids[2] == 3);
+
+    for (i = 0; i < 6; i++) {
+        pool_get_elem(pool, i, &id);
+    }
+    assert(pool->shared->current_block == 100);
+    destroy_pool(pool);
+
+    /* Fills of every width, including the widths without a
+     * vector pattern. */
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        opts.elem_size = sizes[k];
+        pool = create_pool_opts(10, 2, 10, &opts);
+        assert(pool->elem_words == sizes[k] / 4);
+        for (i = 0; i < sizes[k]; i++) {
+            elem[i] = (uint8_t)(i * 7 + k + 1);
+        }
+        pool_fill_elem(pool, elem);
+        for (i = 0; i < 10; i++) {
+            assert(memcmp(pool->pool + i * pool->elem_words, elem, sizes[k]) == 0);
+        }
+        pool_get_elems(pool, 3, out, 4);
+        for (i = 0; i < 4; i++) {
+            assert(memcmp(out + i * sizes[k], elem, sizes[k]) == 0);
+        }
+        pool_get_elem(pool, 4, out);
+        assert(memcmp(out, elem, sizes[k]) == 0);
+        destroy_pool(pool);
+    }
+}
+
+POOL_DEFINE(typed_ids, uint64_t, 64)
+POOL_DEFINE_RING(typed_ring, uint32_t, 16, 4)
+
+void test_typed(void)
+{
+    static typed_ids_t ids;
+    static typed_ring_t ring;
+    uint32_t i;
+
+    typed_ids_init(&ids, 10);
+    assert(sizeof(ids.pool) == 2 * 64 * sizeof(uint64_t));
+    assert((uintptr_t)ids.pool % POOL_CACHELINE == 0);
+
+    /* Indices are masked into the main block. */
+    typed_ids_insert_at(&ids, 0x1122334455667788ULL, 64 + 5);
+    assert(typed_ids_block(&ids, 0)[5] == 0x1122334455667788ULL);
+    assert(typed_ids_get(&ids, 5) == 0x1122334455667788ULL);
+
+    /* The standby block is written by the caller and taken after
+     * `max_it` reads. */
+    assert(typed_ids_standby(&ids) == 1);
+    typed_ids_block(&ids, 1)[3] = 42;
+    for (i = 0; i < 8; i++) {
+        typed_ids_get(&ids, i);
+    }
+    assert(ids.current_block == 0);
+    assert(typed_ids_get(&ids, 3) == 42);
+    assert(ids.current_block == 1 && ids.epoch == 1);
+    assert(typed_ids_standby(&ids) == 0);
+
+    /* The ring wraps with a mask. */
+    typed_ring_init(&ring, POOL_MAX_IT);
+    typed_ring_fill(&ring, 7);
+    for (i = 0; i < 16; i++) {
+        typed_ring_insert(&ring, i);
+    }
+    assert(ring.cursor == 0);
+    assert(typed_ring_get(&ring, 16 + 9) == 9);
+    for (i = 1; i <= 4; i++) {
+        assert(typed_ring_switch(&ring) == 0);
+        assert(ring.current_block == (i & 3));
+    }
+    assert(typed_ring_get(&ring, 9) == 9);
+    assert(typed_ring_switch(&ring) == 0);
+    assert(typed_ring_get(&ring, 9) == 7);
+}
+
+struct object_args {
+    pool_objects_t *objects;
+    uint32_t id;
+    atomic_uint *failures;
+};
+
+void *object_worker(void *arg)
+{
+    struct object_args *args = (struct object_args*)arg;
+    pool_object_cache_t *cache = pool_object_cache_register(args->objects);
+    uint32_t *held[8];
+
+    for (uint32_t round = 0; round < 20000; round++) {
+        uint32_t n = 1 + round % 8;
+
+        for (uint32_t i = 0; i < n; i++) {
+            held[i] = pool_object_alloc(cache);
+            assert(held[i] != NULL);
+            held[i][0] = args->id;
+            held[i][1] = round;
+        }
+        sched_yield();
+        for (uint32_t i = 0; i < n; i++) {
+            if (held[i][0] != args->id || held[i][1] != round) {
+                atomic_fetch_add(args->failures, 1);
+            }
+            pool_object_free(cache, held[i]);
+        }
+    }
+
+    pool_object_cache_unregister(cache);
+    return NULL;
+}
+
+void test_objects(void)
+{
+    pool_objects_t *objects;
+    pool_object_cache_t *cache;
+    static uint8_t *objs[256];
+    struct object_args args[4];
+    pthread_t threads[4];
+    atomic_uint failures;
+    uint8_t *first;
+    uint32_t i;
+
+    assert(create_pool_objects(0, 16) == NULL);
+    assert(create_pool_objects(16, 0) == NULL);
+
+    /* Objects are aligned, distinct and handed out until the
+     * arena is exhausted. */
+    objects = create_pool_objects(24, 200);
+    assert(objects->obj_size == 32);
+    assert(objects->arena == (uint8_t*)objects->pool->pool && objects->pool->nblocks == 2);
+    assert((uintptr_t)objects->arena % POOL_CACHELINE == 0);
+    cache = pool_object_cache_register(objects);
+    for (i = 0; i < 200; i++) {
+        objs[i] = pool_object_alloc(cache);
+        assert(objs[i] != NULL);
+        assert((uintptr_t)objs[i] % POOL_OBJECT_ALIGN == 0);
+        assert(objs[i] >= objects->arena && objs[i] < objects->arena + 200 * 32);
+        memset(objs[i], (int)i, 32);
+    }
+    assert(objs[0] == objects->arena);
+    for (i = 0; i < 200; i++) {
+        assert(objs[i][31] == (uint8_t)i);
+    }
+    assert(pool_object_alloc(cache) == NULL);
+
+    /* Frees go to the standby block: a freed object comes back
+     * only after every object of the main block was handed out. */
+    first = objs[0];
+    pool_object_free(cache, first);
+    for (i = 1; i < 200; i++) {
+        pool_object_free(cache, objs[i]);
+    }
+    for (i = 0; i < 200; i++) {
+        assert(pool_object_alloc(cache) != NULL);
+    }
+    assert(pool_object_alloc(cache) == NULL);
+    pool_object_free(cache, NULL);
+    pool_object_cache_unregister(cache);
+    destroy_pool_objects(objects);
+
+    objects = create_pool_objects(64, 256);
+    cache = pool_object_cache_register(objects);
+    first = pool_object_alloc(cache);
+    pool_object_free(cache, first);
+    for (i = 0; i < 255; i++) {
+        assert(pool_object_alloc(cache) != first);
+    }
+    assert(pool_object_alloc(cache) == first);
+    pool_object_cache_unregister(cache);
+    destroy_pool_objects(objects);
+
+    /* Threads never see an object handed to another one. Each
+     * cache may hold two magazines, so the arena is sized for it. */
+    objects = create_pool_objects(64, 4 * (2 * POOL_MAGAZINE_SIZE + 8));
+    atomic_init(&failures, 0);
+    for (i = 0; i < 4; i++) {
+        args[i].objects = objects;
+        args[i].id = i + 1;
+        args[i].failures = &failures;
+        pthread_create(&threads[i], NULL, object_worker, &args[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(atomic_load(&failures) == 0);
+    destroy_pool_objects(objects);
+}
+
+struct queue_args {
+    pool_queue_t *queue;
+    uint32_t id;
+    uint32_t count;
+    uint64_t sum;
+};
+
+void *queue_producer(void *arg)
+{
+    struct queue_args *args = (struct queue_args*)arg;
+    uint32_t batch[5];
+
+    for (uint32_t i = 0; i < args->count; i += 5) {
+        for (uint32_t k = 0; k < 5; k++) {
+            batch[k] = args->id * args->count + i + k;
+        }
+        if (i % 2 == 0) {
+            pool_queue_enqueue_many(args->queue, batch, 5);
+        } else {
+            for (uint32_t k = 0; k < 5; k++) {
+                pool_queue_enqueue(args->queue, batch[k]);
+            }
+        }
+    }
+    return NULL;
+}
+
+void *queue_consumer(void *arg)
+{
+    struct queue_args *args = (struct queue_args*)arg;
+    uint32_t out[7];
+    uint32_t got = 0;
+
+    while (got < args->count) {
+        uint32_t want = args->count - got;
+        uint32_t n = pool_queue_dequeue_many(args->queue, out, (want < 7) ? want : 7);
+
+        for (uint32_t k = 0; k < n; k++) {
+            args->sum += out[k];
+        }
+        got += n;
+    }
+    return NULL;
+}
+
+void test_queue(void)
+{
+    pool_t *pool = create_pool_ex(12, 2, POOL_MAX_IT);
+    pool_queue_t *queue = create_pool_queue(pool);
+    struct queue_args producers[3], consumers[3];
+    pthread_t threads[6];
+    uint32_t values[10], out[10];
+    uint64_t sum = 0, expected = 0;
+    uint32_t i, value;
+
+    /* 12 elements give a capacity of 8. */
+    assert(queue->mask == 7);
+    assert(pool_queue_try_dequeue(queue, &value) == -1);
+    for (i = 0; i < 8; i++) {
+        assert(pool_queue_try_enqueue(queue, 100 + i) == 0);
+    }
+    assert(pool_queue_try_enqueue(queue, 108) == -1);
+    assert(pool->pool[3] == 103);
+    for (i = 0; i < 8; i++) {
+        assert(pool_queue_try_dequeue(queue, &value) == 0 && value == 100 + i);
+    }
+    assert(pool_queue_try_dequeue(queue, &value) == -1);
+
+    /* Batches stop at the capacity and wrap around the storage. */
+    for (i = 0; i < 10; i++) {
+        values[i] = i;
+    }
+    assert(pool_queue_try_enqueue_many(queue, values, 3) == 3);
+    assert(pool_queue_try_dequeue_many(queue, out, 2) == 2 && out[0] == 0 && out[1] == 1);
+    assert(pool_queue_try_enqueue_many(queue, values + 3, 7) == 7);
+    assert(pool_queue_try_enqueue_many(queue, values, 1) == 0);
+    assert(pool_queue_try_dequeue_many(queue, out, 10) == 8);
+    for (i = 0; i < 8; i++) {
+        assert(out[i] == i + 2);
+    }
+    destroy_pool_queue(queue);
+    destroy_pool(pool);
+
+    /* Blocking producers and consumers on a queue much smaller
+     * than the traffic: every item arrives exactly once. */
+    pool = create_pool_ex(16, 2, POOL_MAX_IT);
+    queue = create_pool_queue(pool);
+    for (i = 0; i < 3; i++) {
+        producers[i] = (struct queue_args){ .queue = queue, .id = i, .count = 20000 };
+        consumers[i] = (struct queue_args){ .queue = queue, .count = 20000 };
+        pthread_create(&threads[i], NULL, queue_producer, &producers[i]);
+        pthread_create(&threads[3 + i], NULL, queue_consumer, &consumers[i]);
+    }
+    for (i = 0; i < 6; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < 3; i++) {
+        sum += consumers[i].sum;
+    }
+    for (i = 0; i < 3 * 20000; i++) {
+        expected += i;
+    }
+    assert(sum == expected);
+    assert(pool_queue_try_dequeue(queue, &value) == -1);
+    destroy_pool_queue(queue);
+    destroy_pool(pool);
+}
+
+void test_group(void)
+{
+    pool_t *pools[3];
+    pool_group_t *group;
+    pool_group_member_t *member;
+    uint64_t counts[POOL_GROUP_STAT_COUNT];
+    uint32_t block, i;
+
+    assert(create_pool_group(pools, 0) == NULL);
+
+    /* Pools that wait for their refills instead of recycling. */
+    for (i = 0; i < 3; i++) {
+        pools[i] = create_pool_ex(8, 2, 4);
+        pools[i]->recycle = false;
+        pool_fill_area(pools[i], 10 * i + 1, POOL_BLOCK_A, 4);
+        pool_fill_area(pools[i], 10 * i + 2, 4, 4);
+    }
+    group = create_pool_group(pools, 3);
+    assert(pool_group_join(group, 3) == NULL);
+    member = pool_group_join(group, 0);
+
+    /* Reads stay home while it has a fresh block... */
+    for (i = 0; i < 3; i++) {
+        assert(pool_group_get(member, i) == 1);
+    }
+    for (i = 0; i < 5; i++) {
+        assert(pool_group_get(member, i) == 2);
+    }
+    assert(pools[0]->shared->switch_pending == true);
+
+    /* ...and steal a batch from the READY block of the next sibling
+     * once it has none, leaving the sibling untouched. */
+    for (i = 0; i < POOL_GROUP_BATCH; i++) {
+        assert(pool_group_get(member, i) == 12);
+    }
+    pool_group_stats(group, counts);
+    assert(counts[POOL_GROUP_STAT_STEALS] == 1);
+    assert(counts[POOL_GROUP_STAT_STOLEN] == POOL_GROUP_BATCH);
+    assert(pools[1]->shared->current_block == POOL_BLOCK_A);
+    assert(pools[1]->iterations == 0);
+    assert(pools[1]->states[1] == POOL_STATE_READY);
+
+    /* A sibling without a READY block is skipped. */
+    assert(pool_switch_block_s(pools[1]) == 0);
+    assert(pool_group_get(member, 0) == 22);
+    assert(member->victim == 2);
+
+    /* With no READY block left in any sibling, the home block is read. */
+    assert(pool_switch_block_s(pools[2]) == 0);
+    for (i = 1; i < POOL_GROUP_BATCH; i++) {
+        assert(pool_group_get(member, i) == 22);
+    }
+    assert(pool_group_get(member, 0) == 2);
+    pool_group_stats(group, counts);
+    assert(counts[POOL_GROUP_STAT_STEALS] == 2);
+    assert(counts[POOL_GROUP_STAT_MISSES] == 1);
+
+    /* The home refill brings the reads back home. */
+    assert(pool_refill_begin(pools[0], &block) == 0);
+    pool_fill_area(pools[0], 5, block, 4);
+    pool_refill_end(pools[0], block);
+    assert(pool_group_get(member, 0) == 5);
+
+    pool_group_leave(member);
+    destroy_pool_group(group);
+    for (i = 0; i < 3; i++) {
+        destroy_pool(pools[i]);
+    }
+}
+
+void test_stream(void)
+{
+    static const int modes[] = { POOL_STREAM_PREAD, POOL_STREAM_AUTO };
+    char path[] = "/tmp/pool_stream_XXXXXX";
+    char empty[] = "/tmp/pool_stream_XXXXXX";
+    uint32_t words[1000];
+    pool_stream_t *stream;
+    pool_t *pool;
+    uint32_t i;
+    int fd = mkstemp(path);
+    int fd_empty = mkstemp(empty);
+    int fd_random;
+
+    assert(fd >= 0 && fd_empty >= 0);
+    for (i = 0; i < 1000; i++) {
+        words[i] = i;
+    }
+    assert(write(fd, words, sizeof(words)) == (ssize_t)sizeof(words));
+
+    pool = create_pool_ex(1024, 4, 1024);
+    assert(create_pool_stream(NULL, fd, 2, POOL_STREAM_AUTO) == NULL);
+    assert(create_pool_stream(pool, -1, 2, POOL_STREAM_AUTO) == NULL);
+    assert(create_pool_stream(pool, fd, 0, POOL_STREAM_AUTO) == NULL);
+    assert(create_pool_stream(pool, fd, 2, POOL_STREAM_PREAD + 1) == NULL);
+    assert(create_pool_stream(pool, fd_empty, 2, POOL_STREAM_AUTO) == NULL);
+    destroy_pool(pool);
+
+    for (uint32_t m = 0; m < 2; m++) {
+        pool = create_pool_ex(1024, 4, 1024);
+        stream = create_pool_stream(pool, fd, 2, modes[m]);
+        assert(stream != NULL);
+        assert(stream->mode == POOL_STREAM_URING || stream->mode == POOL_STREAM_PREAD);
+        assert(modes[m] != POOL_STREAM_PREAD || stream->mode == POOL_STREAM_PREAD);
+        assert(create_pool_stream(pool, fd, 2, modes[m]) == NULL);
+
+        /* The main block holds the start of the file. */
+        for (i = 0; i < 256; i++) {
+            assert(pool->pool[i] == i);
+        }
+
+        /* Every refill is a contiguous run of the file, wrapping
+         * around at its end; 1000 words is not a block multiple. */
+        for (uint32_t round = 0; round < 12; round++) {
+            uint32_t block, first;
+
+            assert(pool_switch_block_wait(pool) == 0);
+            block = pool->shared->current_block;
+            first = pool->pool[block];
+            assert(first % 8 == 0);
+            for (i = 0; i < 256; i++) {
+                assert(pool->pool[block + i] == (first + i) % 1000);
+            }
+            assert(pool_get(pool, 5) == (first + 5) % 1000);
+        }
+
+        assert(pool_stream_error(stream) == 0);
+        destroy_pool_stream(stream);
+        assert(pool->stream == NULL);
+        destroy_pool(pool);
+    }
+
+    /* A file is read from the position of the descriptor, which
+     * is left where it was. */
+    assert(lseek(fd, 40 * sizeof(uint32_t), SEEK_SET) == 40 * sizeof(uint32_t));
+    pool = create_pool_ex(1024, 4, 1024);
+    stream = create_pool_stream(pool, fd, 2, POOL_STREAM_PREAD);
+    assert(stream != NULL);
+    for (i = 0; i < 256; i++) {
+        assert(pool->pool[i] == 40 + i);
+    }
+    assert(lseek(fd, 0, SEEK_CUR) == 40 * sizeof(uint32_t));
+    destroy_pool_stream(stream);
+    destroy_pool(pool);
+
+    /* An empty non-blocking pipe is waited for until it is written;
+     * closing it ends the reads still waiting. */
+    for (uint32_t m = 0; m < 2; m++) {
+        int pipe_fds[2];
+
+        assert(pipe(pipe_fds) == 0);
+        assert(fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK) == 0);
+        assert(write(pipe_fds[1], words, 2048) == 2048);
+        pool = create_pool_ex(1024, 4, 1024);
+        stream = create_pool_stream(pool, pipe_fds[0], 2, modes[m]);
+        assert(stream != NULL);
+        for (i = 0; i < 256; i++) {
+            assert(pool->pool[i] == i);
+        }
+        assert(pool_switch_block_wait(pool) == 0);
+        usleep(20000);
+        assert(pool_stream_error(stream) == 0);
+        assert(write(pipe_fds[1], words, 3072) == 3072);
+        assert(pool_switch_block_wait(pool) == 0);
+        close(pipe_fds[1]);
+        destroy_pool_stream(stream);
+        destroy_pool(pool);
+        close(pipe_fds[0]);
+    }
+
+    /* A device is read sequentially. */
+    fd_random = open("/dev/urandom", O_RDONLY);
+    if (fd_random >= 0) {
+        pool = create_pool_ex(1024, 4, 1024);
+        stream = create_pool_stream(pool, fd_random, 2, POOL_STREAM_AUTO);
+        assert(stream != NULL);
+        for (i = 0; i < 8; i++) {
+            assert(pool_switch_block_wait(pool) == 0);
+        }
+        assert(pool_stream_error(stream) == 0);
+        destroy_pool_stream(stream);
+        destroy_pool(pool);
+        close(fd_random);
+    }
+
+    close(fd_empty);
+    close(fd);
+    unlink(empty);
+    unlink(path);
+}
 
 int main(void)
 {
@@ -108,6 +1619,30 @@ int main(void)
     test_fill();
     test_positioning();
     test_switch();
+    test_ring();
+    test_refill();
+    test_service();
+    test_producer();
+    test_chacha20();
+    test_batch();
+    test_reserve();
+    test_take();
+    test_shard();
+    test_backing();
+    test_mapped();
+    test_shared();
+    test_stats();
+    test_perf();
+    test_trace();
+    test_policy();
+    test_wait();
+    test_events();
+    test_elems();
+    test_typed();
+    test_objects();
+    test_queue();
+    test_group();
+    test_stream();
 
     return 0;
 }
\ No newline at end of file